@@ -0,0 +1,201 @@
+package main
+
+import (
+	"fmt"
+	"net/http"
+	"net/url"
+	"strconv"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Admission limits how many clients we stream to and how fast we send to them
+// altogether. Each client costs us a goroutine and its share of the egress, so
+// past some point a surge of new viewers degrades the stream for everyone. We
+// turn clients away at the limits instead, so those already watching stay
+// smooth.
+//
+// We turn a client away by redirecting it to a peer, if we have one, and
+// otherwise with a 503 that says when to retry.
+type Admission struct {
+	mutex *sync.Mutex
+
+	// Clients we're streaming to, in all and by input name.
+	clients      int
+	inputClients map[string]int
+
+	// The most clients we stream to in all, and the most bytes a second we
+	// send in all. 0 means no limit.
+	maxClients int
+	maxEgress  int64
+
+	// The base URL of a peer to redirect clients to, or "".
+	redirect string
+
+	// Bytes we sent, and how many we sent in the last second. We update the
+	// rate each second, if there is an egress limit.
+	sent uint64
+	rate int64
+}
+
+// How many seconds we ask clients we turn away to wait before retrying.
+const admissionRetryAfter = 5
+
+// We add this to the query of a request we redirect to a peer. A peer that
+// can't take the client either responds 503 rather than redirecting it again,
+// so that two full nodes don't pass a client back and forth.
+const admissionRedirectedParam = "redirected"
+
+func newAdmission(maxClients int, maxEgress int64, redirect string) *Admission {
+	a := &Admission{
+		mutex:        &sync.Mutex{},
+		inputClients: map[string]int{},
+		maxClients:   maxClients,
+		maxEgress:    maxEgress,
+		redirect:     redirect,
+	}
+
+	if maxEgress > 0 {
+		go a.measureEgress()
+	}
+
+	return a
+}
+
+// Admit counts a new client of the input, if we have room for it. The client
+// must call Leave once it is done.
+//
+// It returns an error saying which limit we're at if we don't have room.
+func (a *Admission) Admit(config InputConfig) error {
+	a.mutex.Lock()
+	defer a.mutex.Unlock()
+
+	if a.maxClients > 0 && a.clients >= a.maxClients {
+		return fmt.Errorf("at the limit of %d clients", a.maxClients)
+	}
+
+	maxInputClients := 0
+	if config.MaxClients != nil {
+		maxInputClients = *config.MaxClients
+	}
+	if maxInputClients > 0 && a.inputClients[config.Name] >= maxInputClients {
+		return fmt.Errorf("at the limit of %d clients for input %s",
+			maxInputClients, config.Name)
+	}
+
+	if err := a.checkEgress(); err != nil {
+		return err
+	}
+
+	a.clients++
+	a.inputClients[config.Name]++
+	return nil
+}
+
+// AdmitRequest checks we have room to serve a one off request, such as for an
+// HLS segment. These don't hold a connection open, so only the egress limit
+// applies to them.
+func (a *Admission) AdmitRequest() error {
+	return a.checkEgress()
+}
+
+func (a *Admission) checkEgress() error {
+	if a.maxEgress > 0 {
+		if rate := atomic.LoadInt64(&a.rate); rate >= a.maxEgress {
+			return fmt.Errorf("sending %d bytes/second, at the limit of %d", rate,
+				a.maxEgress)
+		}
+	}
+	return nil
+}
+
+// Leave stops counting a client of the input.
+func (a *Admission) Leave(name string) {
+	a.mutex.Lock()
+	defer a.mutex.Unlock()
+
+	a.clients--
+	a.inputClients[name]--
+	if a.inputClients[name] == 0 {
+		delete(a.inputClients, name)
+	}
+}
+
+// Sent counts bytes we sent to a client.
+func (a *Admission) Sent(n int) {
+	atomic.AddUint64(&a.sent, uint64(n))
+}
+
+// Update the egress rate each second.
+func (a *Admission) measureEgress() {
+	ticker := time.NewTicker(time.Second)
+	defer ticker.Stop()
+
+	last := atomic.LoadUint64(&a.sent)
+	for range ticker.C {
+		sent := atomic.LoadUint64(&a.sent)
+		atomic.StoreInt64(&a.rate, int64(sent-last))
+		last = sent
+	}
+}
+
+// Reject responds to a client we turned away: with a redirect to the same
+// path on our peer, or with a 503.
+//
+// WebSocket clients don't follow redirects, so they always get the 503.
+func (a *Admission) Reject(rw http.ResponseWriter, r *http.Request,
+	websocket bool) {
+	query := r.URL.Query()
+	if a.redirect != "" && !websocket &&
+		query.Get(admissionRedirectedParam) == "" {
+		query.Set(admissionRedirectedParam, "1")
+		u := a.redirect + r.URL.EscapedPath() + "?" + query.Encode()
+
+		rw.Header().Set("Cache-Control", "no-cache")
+		http.Redirect(rw, r, u, http.StatusTemporaryRedirect)
+		return
+	}
+
+	retryLater(rw)
+}
+
+// retryLater responds with a 503 that says when to retry.
+func retryLater(rw http.ResponseWriter) {
+	rw.Header().Set("Retry-After", strconv.Itoa(admissionRetryAfter))
+	unavailable(rw)
+}
+
+// sentWriter counts what we write through a ResponseWriter in the input's
+// metrics and toward the egress limit. streamRequest counts its writes
+// itself, as it doesn't always write through the ResponseWriter.
+type sentWriter struct {
+	http.ResponseWriter
+	admission *Admission
+	metrics   *InputMetrics
+}
+
+// CountSent returns rw wrapped so that what we write through it counts as
+// sent to one of the input's clients.
+func (a *Admission) CountSent(rw http.ResponseWriter,
+	metrics *InputMetrics) http.ResponseWriter {
+	return sentWriter{ResponseWriter: rw, admission: a, metrics: metrics}
+}
+
+func (w sentWriter) Write(p []byte) (int, error) {
+	n, err := w.ResponseWriter.Write(p)
+	w.metrics.BytesSent.Add(uint64(n))
+	w.admission.Sent(n)
+	return n, err
+}
+
+// validRedirect returns whether the URL is one we can redirect clients to: an
+// absolute http or https URL without a query.
+func validRedirect(s string) bool {
+	u, err := url.Parse(s)
+	if err != nil {
+		return false
+	}
+	return (u.Scheme == "http" || u.Scheme == "https") && u.Host != "" &&
+		u.RawQuery == "" && u.Fragment == ""
+}
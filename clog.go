@@ -0,0 +1,56 @@
+package main
+
+import (
+	"fmt"
+	"log"
+	"unsafe"
+)
+
+// #include "videostreamer.h"
+// extern void goLog(void *, enum VSLogLevel, char *);
+import "C"
+
+// Log levels by name, for -log-level.
+var logLevels = map[string]C.enum_VSLogLevel{
+	"error":   C.VS_LOG_ERROR,
+	"warning": C.VS_LOG_WARNING,
+	"info":    C.VS_LOG_INFO,
+	"debug":   C.VS_LOG_DEBUG,
+	"trace":   C.VS_LOG_TRACE,
+}
+
+// What we prefix C's log messages with.
+var logLevelNames = map[C.enum_VSLogLevel]string{
+	C.VS_LOG_ERROR:   "error",
+	C.VS_LOG_WARNING: "warning",
+	C.VS_LOG_INFO:    "info",
+	C.VS_LOG_DEBUG:   "debug",
+	C.VS_LOG_TRACE:   "trace",
+}
+
+// parseLogLevel returns the level with the given name, and whether it enables
+// verbose (debug and trace) logging.
+func parseLogLevel(name string) (C.enum_VSLogLevel, bool, error) {
+	level, ok := logLevels[name]
+	if !ok {
+		return 0, false, fmt.Errorf("unknown log level: %s", name)
+	}
+	return level, level >= C.VS_LOG_DEBUG, nil
+}
+
+// setupCLog sends what videostreamer.c logs to our log rather than stdout.
+//
+// C logs messages up to level, at most rate a second, and one in every sample
+// of its per packet messages. It checks these before formatting a message.
+func setupCLog(level C.enum_VSLogLevel, rate, sample int) {
+	C.vs_set_log_callback(C.vs_log_cb(C.goLog), nil, level, C.int(rate),
+		C.int(sample))
+}
+
+// goLog receives a message videostreamer.c logs. It may call this from any
+// thread.
+//
+//export goLog
+func goLog(opaque unsafe.Pointer, level C.enum_VSLogLevel, msg *C.char) {
+	log.Printf("%s: %s", logLevelNames[level], C.GoString(msg))
+}
@@ -0,0 +1,427 @@
+// Command loadgen opens many concurrent clients to a videostreamer stream,
+// some of them deliberately slow, and reports how quickly they start receiving
+// video and how many of them the server drops.
+//
+// For each client we measure the time to the first byte of the response body
+// and to the first fragment starting with a keyframe (when a player could
+// first show video). We notice when the server skips a client ahead from gaps
+// in the fragments' sequence numbers, and count a client as dropped if the
+// server ends its stream before the run does.
+//
+// If the server's /metrics is reachable, we also report how much the server
+// allocated during the run, overall and per fragment delivered.
+package main
+
+import (
+	"bufio"
+	"context"
+	"flag"
+	"fmt"
+	"io"
+	"log"
+	"net/http"
+	"net/url"
+	"os"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+)
+
+// Args are command line arguments.
+type Args struct {
+	URL        string
+	MetricsURL string
+	Clients    int
+	Slow       int
+	SlowRate   int
+	Duration   time.Duration
+	Ramp       time.Duration
+}
+
+// Result is what we measured for one client.
+type Result struct {
+	Slow bool
+
+	// Set if we could not start streaming, such as if the server responded
+	// with an error.
+	Err error
+
+	// From sending the request. Zero if we never got there.
+	FirstByte     time.Duration
+	FirstKeyframe time.Duration
+
+	// Whether the server ended the stream before we were done with it.
+	Dropped bool
+
+	Bytes     int64
+	Fragments int64
+
+	// How many fragments we missed, from gaps in their sequence numbers. The
+	// server skips a client ahead when it falls behind.
+	Skipped int64
+}
+
+func main() {
+	args, err := getArgs()
+	if err != nil {
+		log.Fatalf("Invalid argument: %s", err)
+	}
+
+	before, metricsErr := scrapeMetrics(args.MetricsURL)
+	if metricsErr != nil {
+		log.Printf("Not reporting server metrics: %s", metricsErr)
+	}
+
+	results := make([]Result, args.Clients)
+	wg := &sync.WaitGroup{}
+	start := time.Now()
+
+	for i := 0; i < args.Clients; i++ {
+		if args.Ramp > 0 && args.Clients > 1 {
+			when := start.Add(args.Ramp * time.Duration(i) /
+				time.Duration(args.Clients-1))
+			time.Sleep(time.Until(when))
+		}
+
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			// Spread the slow clients among the others.
+			slow := i*args.Slow/args.Clients != (i+1)*args.Slow/args.Clients
+			results[i] = runClient(args, slow)
+		}(i)
+	}
+
+	wg.Wait()
+
+	report(os.Stdout, args, results)
+
+	if metricsErr == nil {
+		after, err := scrapeMetrics(args.MetricsURL)
+		if err != nil {
+			log.Printf("Not reporting server metrics: %s", err)
+			return
+		}
+		reportMetrics(os.Stdout, before, after, results)
+	}
+}
+
+func getArgs() (Args, error) {
+	streamURL := flag.String("url", "http://localhost:8080/stream", "URL of the stream to open, such as http://host:8080/stream/front-door.")
+	metricsURL := flag.String("metrics", "", "URL of the server's metrics. By default, /metrics on the stream's host. none means don't read them.")
+	clients := flag.Int("clients", 100, "How many clients to open.")
+	slow := flag.Int("slow", 0, "How many of the clients read slowly.")
+	slowRate := flag.Int("slow-rate", 16*1024, "Bytes a second slow clients read.")
+	duration := flag.Duration("duration", time.Minute, "How long each client streams.")
+	ramp := flag.Duration("ramp", 0, "Spread opening the clients over this long.")
+
+	flag.Parse()
+
+	u, err := url.Parse(*streamURL)
+	if err != nil || (u.Scheme != "http" && u.Scheme != "https") {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("invalid URL: %s", *streamURL)
+	}
+
+	if *metricsURL == "" {
+		*metricsURL = (&url.URL{Scheme: u.Scheme, Host: u.Host,
+			Path: "/metrics"}).String()
+	}
+	if *metricsURL == "none" {
+		*metricsURL = ""
+	}
+
+	if *clients <= 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("you must provide a positive number of clients")
+	}
+
+	if *slow < 0 || *slow > *clients {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("slow clients must be between 0 and -clients")
+	}
+
+	if *slowRate <= 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("you must provide a positive slow rate")
+	}
+
+	if *duration <= 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("you must provide a positive duration")
+	}
+
+	if *ramp < 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("ramp must not be negative")
+	}
+
+	return Args{
+		URL:        *streamURL,
+		MetricsURL: *metricsURL,
+		Clients:    *clients,
+		Slow:       *slow,
+		SlowRate:   *slowRate,
+		Duration:   *duration,
+		Ramp:       *ramp,
+	}, nil
+}
+
+// Stream from the URL for the duration, or until the server ends the stream.
+func runClient(args Args, slow bool) Result {
+	result := Result{Slow: slow}
+
+	ctx, cancel := context.WithTimeout(context.Background(), args.Duration)
+	defer cancel()
+
+	req, err := http.NewRequestWithContext(ctx, "GET", args.URL, nil)
+	if err != nil {
+		result.Err = err
+		return result
+	}
+
+	start := time.Now()
+	resp, err := http.DefaultClient.Do(req)
+	if err != nil {
+		result.Err = err
+		return result
+	}
+	defer func() {
+		_ = resp.Body.Close()
+	}()
+
+	if resp.StatusCode != http.StatusOK {
+		result.Err = fmt.Errorf("status %s", resp.Status)
+		return result
+	}
+
+	// Count bytes as they arrive, before a slow client holds them up.
+	counter := &countingReader{r: resp.Body, start: start}
+	var body io.Reader = counter
+	if slow {
+		body = &slowReader{r: body, rate: args.SlowRate, start: time.Now()}
+	}
+
+	s := newStreamReader(bufio.NewReader(body))
+	for {
+		frag, err := s.Next()
+		result.FirstByte = counter.firstByte
+		result.Bytes = counter.n
+		if err != nil {
+			// We stop reading once the context ends. Before then, the server ended
+			// the stream.
+			result.Dropped = ctx.Err() == nil
+			if result.Dropped && err != io.EOF {
+				log.Printf("Client stream ended: %s", err)
+			}
+			return result
+		}
+
+		result.Fragments++
+		result.Skipped += frag.Skipped
+		if frag.Keyframe && result.FirstKeyframe == 0 {
+			result.FirstKeyframe = time.Since(start)
+		}
+	}
+}
+
+// countingReader counts the bytes read through it, and notes when the first
+// arrived.
+type countingReader struct {
+	r         io.Reader
+	n         int64
+	start     time.Time
+	firstByte time.Duration
+}
+
+func (c *countingReader) Read(p []byte) (int, error) {
+	n, err := c.r.Read(p)
+	if n > 0 && c.n == 0 {
+		c.firstByte = time.Since(c.start)
+	}
+	c.n += int64(n)
+	return n, err
+}
+
+// slowReader reads no more than rate bytes a second on average.
+type slowReader struct {
+	r     io.Reader
+	rate  int
+	start time.Time
+	n     int64
+}
+
+// How much a slow reader reads at once. Small reads keep its rate smooth.
+const slowReadSize = 4096
+
+func (s *slowReader) Read(p []byte) (int, error) {
+	if len(p) > slowReadSize {
+		p = p[:slowReadSize]
+	}
+
+	n, err := s.r.Read(p)
+	s.n += int64(n)
+
+	due := s.start.Add(time.Duration(s.n) * time.Second / time.Duration(s.rate))
+	time.Sleep(time.Until(due))
+	return n, err
+}
+
+// Write what we measured.
+func report(w io.Writer, args Args, results []Result) {
+	fmt.Fprintf(w, "clients: %d (%d slow), duration %s\n", args.Clients,
+		args.Slow, args.Duration)
+
+	for _, slow := range []bool{false, true} {
+		var firstBytes, firstKeyframes []time.Duration
+		clients, failed, dropped := 0, 0, 0
+		var bytes, fragments, skipped int64
+
+		for _, r := range results {
+			if r.Slow != slow {
+				continue
+			}
+			clients++
+			if r.Err != nil {
+				failed++
+				continue
+			}
+			if r.Dropped {
+				dropped++
+			}
+			if r.FirstByte > 0 {
+				firstBytes = append(firstBytes, r.FirstByte)
+			}
+			if r.FirstKeyframe > 0 {
+				firstKeyframes = append(firstKeyframes, r.FirstKeyframe)
+			}
+			bytes += r.Bytes
+			fragments += r.Fragments
+			skipped += r.Skipped
+		}
+
+		if clients == 0 {
+			continue
+		}
+
+		kind := "fast"
+		if slow {
+			kind = "slow"
+		}
+		fmt.Fprintf(w, "\n%s clients: %d\n", kind, clients)
+		fmt.Fprintf(w, "  failed to start:     %d\n", failed)
+		fmt.Fprintf(w, "  dropped:             %d (%.1f%%)\n", dropped,
+			100*float64(dropped)/float64(clients))
+		fmt.Fprintf(w, "  time to first byte:     %s\n", percentiles(firstBytes))
+		fmt.Fprintf(w, "  time to first keyframe: %s\n",
+			percentiles(firstKeyframes))
+		fmt.Fprintf(w, "  bytes:               %d\n", bytes)
+		fmt.Fprintf(w, "  fragments:           %d\n", fragments)
+		fmt.Fprintf(w, "  fragments skipped:   %d\n", skipped)
+	}
+
+	// Say why some failed, once for each reason.
+	reasons := map[string]int{}
+	for _, r := range results {
+		if r.Err != nil {
+			reasons[r.Err.Error()]++
+		}
+	}
+	for reason, n := range reasons {
+		fmt.Fprintf(w, "\n%d failed: %s\n", n, reason)
+	}
+}
+
+// Summarize the durations as p50/p90/p99/max.
+func percentiles(ds []time.Duration) string {
+	if len(ds) == 0 {
+		return "none"
+	}
+
+	sort.Slice(ds, func(i, j int) bool { return ds[i] < ds[j] })
+	at := func(p float64) time.Duration {
+		return ds[int(p*float64(len(ds)-1))].Truncate(time.Millisecond)
+	}
+	return fmt.Sprintf("p50 %s p90 %s p99 %s max %s", at(0.5), at(0.9),
+		at(0.99), ds[len(ds)-1].Truncate(time.Millisecond))
+}
+
+// Read the server's metrics, summing each metric's samples (such as across
+// inputs). It returns an error if metricsURL is empty.
+func scrapeMetrics(metricsURL string) (map[string]float64, error) {
+	if metricsURL == "" {
+		return nil, fmt.Errorf("no metrics URL")
+	}
+
+	resp, err := http.Get(metricsURL)
+	if err != nil {
+		return nil, err
+	}
+	defer func() {
+		_ = resp.Body.Close()
+	}()
+
+	if resp.StatusCode != http.StatusOK {
+		return nil, fmt.Errorf("status %s", resp.Status)
+	}
+
+	metrics := map[string]float64{}
+	scanner := bufio.NewScanner(resp.Body)
+	for scanner.Scan() {
+		line := scanner.Text()
+		if line == "" || strings.HasPrefix(line, "#") {
+			continue
+		}
+
+		space := strings.LastIndexByte(line, ' ')
+		if space == -1 {
+			continue
+		}
+		name := line[:space]
+		if brace := strings.IndexByte(name, '{'); brace != -1 {
+			name = name[:brace]
+		}
+
+		v, err := strconv.ParseFloat(line[space+1:], 64)
+		if err != nil {
+			continue
+		}
+		metrics[name] += v
+	}
+	if err := scanner.Err(); err != nil {
+		return nil, err
+	}
+
+	return metrics, nil
+}
+
+// Write how much the server allocated and collected garbage during the run.
+func reportMetrics(w io.Writer, before, after map[string]float64,
+	results []Result) {
+	delta := func(name string) float64 { return after[name] - before[name] }
+
+	var fragments int64
+	for _, r := range results {
+		fragments += r.Fragments
+	}
+
+	fmt.Fprintf(w, "\nserver:\n")
+	fmt.Fprintf(w, "  fragments muxed:     %.0f\n",
+		delta("videostreamer_fragments_total"))
+	fmt.Fprintf(w, "  clients dropped:     %.0f\n",
+		delta("videostreamer_clients_dropped_total"))
+	fmt.Fprintf(w, "  client skips:        %.0f\n",
+		delta("videostreamer_client_skips_total"))
+	fmt.Fprintf(w, "  Go allocations:      %.0f (%.0f bytes)\n",
+		delta("videostreamer_go_mallocs_total"),
+		delta("videostreamer_go_alloc_bytes_total"))
+	if fragments > 0 {
+		fmt.Fprintf(w, "  allocations/fragment delivered: %.2f\n",
+			delta("videostreamer_go_mallocs_total")/float64(fragments))
+	}
+	fmt.Fprintf(w, "  GC cycles:           %.0f (%.3fs paused)\n",
+		delta("videostreamer_go_gc_total"),
+		delta("videostreamer_go_gc_pause_seconds_total"))
+}
@@ -0,0 +1,329 @@
+package main
+
+import (
+	"bufio"
+	"encoding/binary"
+	"fmt"
+	"io"
+	"io/ioutil"
+)
+
+// streamReader reads the fragmented MP4 a stream sends: the init segment, and
+// then fragments (a moof box and an mdat box each). We parse just enough to
+// know where each fragment ends, whether it starts with a video keyframe, and
+// its sequence number.
+type streamReader struct {
+	r *bufio.Reader
+
+	// Space for the boxes we parse.
+	buf []byte
+
+	// From the init segment. videoTrack is 0 until we have it.
+	videoTrack   uint32
+	defaultFlags uint32
+
+	// The sequence number of the last fragment.
+	lastSeq uint32
+	haveSeq bool
+}
+
+// fragment is what we know about a fragment.
+type fragment struct {
+	Keyframe bool
+
+	// How many fragments were missing before this one.
+	Skipped int64
+}
+
+// Sample flags bit saying the sample is not a sync sample.
+const sampleIsNonSync = 0x00010000
+
+func newStreamReader(r *bufio.Reader) *streamReader {
+	return &streamReader{r: r}
+}
+
+// Next reads up to the end of the next fragment.
+func (s *streamReader) Next() (fragment, error) {
+	var frag fragment
+	haveMoof := false
+
+	for {
+		boxType, size, err := s.readHeader()
+		if err != nil {
+			return fragment{}, err
+		}
+
+		switch boxType {
+		case "moov":
+			body, err := s.readBody(size)
+			if err != nil {
+				return fragment{}, err
+			}
+			if err := s.parseMoov(body); err != nil {
+				return fragment{}, err
+			}
+		case "moof":
+			body, err := s.readBody(size)
+			if err != nil {
+				return fragment{}, err
+			}
+			frag, err = s.parseMoof(body)
+			if err != nil {
+				return fragment{}, err
+			}
+			haveMoof = true
+		case "mdat":
+			if _, err := io.CopyN(ioutil.Discard, s.r, int64(size)); err != nil {
+				return fragment{}, err
+			}
+			if haveMoof {
+				return frag, nil
+			}
+		default:
+			if _, err := io.CopyN(ioutil.Discard, s.r, int64(size)); err != nil {
+				return fragment{}, err
+			}
+		}
+	}
+}
+
+// Read a box header, returning the box's type and the size of its body.
+func (s *streamReader) readHeader() (string, uint64, error) {
+	var header [16]byte
+	if _, err := io.ReadFull(s.r, header[:8]); err != nil {
+		return "", 0, err
+	}
+
+	size := uint64(binary.BigEndian.Uint32(header[:4]))
+	boxType := string(header[4:8])
+	headerSize := uint64(8)
+
+	if size == 1 {
+		if _, err := io.ReadFull(s.r, header[8:16]); err != nil {
+			return "", 0, err
+		}
+		size = binary.BigEndian.Uint64(header[8:16])
+		headerSize = 16
+	}
+
+	if size < headerSize {
+		return "", 0, fmt.Errorf("invalid %s box size %d", boxType, size)
+	}
+
+	return boxType, size - headerSize, nil
+}
+
+// How large a box we'll read into memory. Only mdat boxes should be large, and
+// we don't read those.
+const maxBoxSize = 16 * 1024 * 1024
+
+func (s *streamReader) readBody(size uint64) ([]byte, error) {
+	if size > maxBoxSize {
+		return nil, fmt.Errorf("box too large: %d bytes", size)
+	}
+
+	if uint64(cap(s.buf)) < size {
+		s.buf = make([]byte, size)
+	}
+	s.buf = s.buf[:size]
+
+	if _, err := io.ReadFull(s.r, s.buf); err != nil {
+		return nil, err
+	}
+	return s.buf, nil
+}
+
+// Find the video track and its default sample flags.
+func (s *streamReader) parseMoov(moov []byte) error {
+	return eachBox(moov, func(boxType string, body []byte) error {
+		switch boxType {
+		case "trak":
+			trackID, handler, err := parseTrak(body)
+			if err != nil {
+				return err
+			}
+			if handler == "vide" {
+				s.videoTrack = trackID
+			}
+		case "mvex":
+			return eachBox(body, func(boxType string, body []byte) error {
+				if boxType != "trex" {
+					return nil
+				}
+				if len(body) < 24 {
+					return fmt.Errorf("short trex box")
+				}
+				// We see trex after the traks.
+				if binary.BigEndian.Uint32(body[4:8]) == s.videoTrack {
+					s.defaultFlags = binary.BigEndian.Uint32(body[20:24])
+				}
+				return nil
+			})
+		}
+		return nil
+	})
+}
+
+// Find a track's ID and handler type.
+func parseTrak(trak []byte) (uint32, string, error) {
+	var trackID uint32
+	handler := ""
+
+	err := eachBox(trak, func(boxType string, body []byte) error {
+		switch boxType {
+		case "tkhd":
+			// Version 1 has 64 bit creation and modification times.
+			offset := 12
+			if len(body) > 0 && body[0] == 1 {
+				offset = 20
+			}
+			if len(body) < offset+4 {
+				return fmt.Errorf("short tkhd box")
+			}
+			trackID = binary.BigEndian.Uint32(body[offset:])
+		case "mdia":
+			return eachBox(body, func(boxType string, body []byte) error {
+				if boxType != "hdlr" {
+					return nil
+				}
+				if len(body) < 12 {
+					return fmt.Errorf("short hdlr box")
+				}
+				handler = string(body[8:12])
+				return nil
+			})
+		}
+		return nil
+	})
+
+	return trackID, handler, err
+}
+
+// Find the fragment's sequence number, and whether its first video sample is
+// a keyframe.
+func (s *streamReader) parseMoof(moof []byte) (fragment, error) {
+	var frag fragment
+
+	err := eachBox(moof, func(boxType string, body []byte) error {
+		switch boxType {
+		case "mfhd":
+			if len(body) < 8 {
+				return fmt.Errorf("short mfhd box")
+			}
+			seq := binary.BigEndian.Uint32(body[4:8])
+			if s.haveSeq && seq > s.lastSeq+1 {
+				frag.Skipped = int64(seq - s.lastSeq - 1)
+			}
+			s.lastSeq = seq
+			s.haveSeq = true
+		case "traf":
+			trackID, flags, err := s.parseTraf(body)
+			if err != nil {
+				return err
+			}
+			if trackID == s.videoTrack {
+				frag.Keyframe = flags&sampleIsNonSync == 0
+			}
+		}
+		return nil
+	})
+
+	return frag, err
+}
+
+// Find a traf's track ID and the flags of its first sample.
+func (s *streamReader) parseTraf(traf []byte) (uint32, uint32, error) {
+	var trackID uint32
+	flags := s.defaultFlags
+
+	err := eachBox(traf, func(boxType string, body []byte) error {
+		if boxType != "tfhd" && boxType != "trun" {
+			return nil
+		}
+		if len(body) < 8 {
+			return fmt.Errorf("short %s box", boxType)
+		}
+		boxFlags := binary.BigEndian.Uint32(body[0:4]) & 0xffffff
+
+		if boxType == "tfhd" {
+			trackID = binary.BigEndian.Uint32(body[4:8])
+
+			// Skip base data offset, sample description index, default sample
+			// duration, and default sample size, if present.
+			offset := 8
+			for _, field := range []struct {
+				flag uint32
+				size int
+			}{{0x01, 8}, {0x02, 4}, {0x08, 4}, {0x10, 4}} {
+				if boxFlags&field.flag != 0 {
+					offset += field.size
+				}
+			}
+			if boxFlags&0x20 != 0 {
+				if len(body) < offset+4 {
+					return fmt.Errorf("short tfhd box")
+				}
+				flags = binary.BigEndian.Uint32(body[offset:])
+			}
+			return nil
+		}
+
+		// trun. After the sample count, there may be a data offset and first
+		// sample flags. Then each sample's duration, size, flags, and
+		// composition time offset, if present.
+		offset := 8
+		if boxFlags&0x01 != 0 {
+			offset += 4
+		}
+		if boxFlags&0x04 != 0 {
+			if len(body) < offset+4 {
+				return fmt.Errorf("short trun box")
+			}
+			flags = binary.BigEndian.Uint32(body[offset:])
+			return nil
+		}
+		if boxFlags&0x400 != 0 && binary.BigEndian.Uint32(body[4:8]) > 0 {
+			if boxFlags&0x100 != 0 {
+				offset += 4
+			}
+			if boxFlags&0x200 != 0 {
+				offset += 4
+			}
+			if len(body) < offset+4 {
+				return fmt.Errorf("short trun box")
+			}
+			flags = binary.BigEndian.Uint32(body[offset:])
+		}
+		return nil
+	})
+
+	return trackID, flags, err
+}
+
+// eachBox calls fn with the type and body of each box in b.
+func eachBox(b []byte, fn func(string, []byte) error) error {
+	for len(b) > 0 {
+		if len(b) < 8 {
+			return fmt.Errorf("short box header")
+		}
+		size := uint64(binary.BigEndian.Uint32(b[:4]))
+		boxType := string(b[4:8])
+		headerSize := uint64(8)
+		if size == 1 {
+			if len(b) < 16 {
+				return fmt.Errorf("short box header")
+			}
+			size = binary.BigEndian.Uint64(b[8:16])
+			headerSize = 16
+		}
+		if size < headerSize || size > uint64(len(b)) {
+			return fmt.Errorf("invalid %s box size %d", boxType, size)
+		}
+
+		if err := fn(boxType, b[headerSize:size]); err != nil {
+			return err
+		}
+		b = b[size:]
+	}
+	return nil
+}
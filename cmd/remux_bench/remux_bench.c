@@ -0,0 +1,267 @@
+// This program measures how fast videostreamer.h remuxes.
+//
+// It reads packets from an input, such as a file recorded from a camera, and
+// writes them to a fragmented MP4 output through a callback that discards
+// them, as the daemon's outputs do before passing the bytes on to clients. It
+// reports packets per second and how long reading and writing take per
+// packet.
+//
+// With realtime, we read packets no faster than their timestamps say, like
+// ffmpeg's -re, to see the load of a live camera. With max, we read as fast as
+// we can. We read the input loops times, continuing the output's timestamps
+// from one to the next as the daemon does when it reconnects.
+
+// For clock_gettime(), nanosleep(), and getrusage().
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <videostreamer.h>
+
+struct Bench {
+	uint64_t packets;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t writes;
+
+	// Nanoseconds spent in vs_read_packet() and vs_write_packet().
+	int64_t read_ns;
+	int64_t write_ns;
+};
+
+static int64_t
+now_ns(void);
+
+static void
+sleep_until_ns(const int64_t);
+
+static int
+discard_output(void * const, uint8_t * const, const int);
+
+static int
+run_loop(struct Bench * const, const char * const, const char * const,
+		struct VSOutput ** const, const enum VSFragmentMode, const bool);
+
+int main(const int argc, const char * const * const argv)
+{
+	if (argc < 4 || argc > 6) {
+		printf("Usage: %s <input format> <input URL> <max|realtime> [loops] [gop|frame]\n",
+				argv[0]);
+		return 1;
+	}
+	const char * const input_format = argv[1];
+	const char * const input_url = argv[2];
+
+	bool realtime = false;
+	if (strcmp(argv[3], "realtime") == 0) {
+		realtime = true;
+	} else if (strcmp(argv[3], "max") != 0) {
+		printf("speed must be max or realtime\n");
+		return 1;
+	}
+
+	long loops = 1;
+	if (argc > 4) {
+		loops = atol(argv[4]);
+		if (loops <= 0) {
+			printf("loops must be positive\n");
+			return 1;
+		}
+	}
+
+	enum VSFragmentMode fragment_mode = VS_FRAGMENT_GOP;
+	if (argc > 5) {
+		if (strcmp(argv[5], "frame") == 0) {
+			fragment_mode = VS_FRAGMENT_FRAME;
+		} else if (strcmp(argv[5], "gop") != 0) {
+			printf("fragment must be gop or frame\n");
+			return 1;
+		}
+	}
+
+	vs_setup();
+
+	struct Bench bench;
+	memset(&bench, 0, sizeof(struct Bench));
+	struct VSOutput * output = NULL;
+
+	const int64_t start = now_ns();
+
+	for (long i = 0; i < loops; i++) {
+		if (run_loop(&bench, input_format, input_url, &output, fragment_mode,
+					realtime) != 0) {
+			vs_destroy_output(output);
+			return 1;
+		}
+	}
+
+	const int64_t elapsed = now_ns()-start;
+
+	vs_destroy_output(output);
+
+	if (bench.packets == 0) {
+		printf("read no packets\n");
+		return 1;
+	}
+
+	struct rusage usage;
+	memset(&usage, 0, sizeof(struct rusage));
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		printf("getrusage failed\n");
+		return 1;
+	}
+
+	const double seconds = (double) elapsed/1e9;
+	printf("packets:          %llu\n", (unsigned long long) bench.packets);
+	printf("seconds:          %.3f\n", seconds);
+	printf("packets/sec:      %.1f\n", (double) bench.packets/seconds);
+	printf("ns/packet:        %.0f\n", (double) elapsed/(double) bench.packets);
+	printf("read ns/packet:   %.0f\n",
+			(double) bench.read_ns/(double) bench.packets);
+	printf("write ns/packet:  %.0f\n",
+			(double) bench.write_ns/(double) bench.packets);
+	printf("bytes read:       %llu\n", (unsigned long long) bench.bytes_read);
+	printf("bytes written:    %llu\n",
+			(unsigned long long) bench.bytes_written);
+	printf("callback writes:  %llu\n", (unsigned long long) bench.writes);
+	printf("max RSS (KiB):    %ld\n", usage.ru_maxrss);
+	printf("minor faults:     %ld\n", usage.ru_minflt);
+
+	return 0;
+}
+
+static int64_t
+now_ns(void)
+{
+	struct timespec ts;
+	memset(&ts, 0, sizeof(struct timespec));
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		return 0;
+	}
+	return (int64_t) ts.tv_sec*1000000000+(int64_t) ts.tv_nsec;
+}
+
+static void
+sleep_until_ns(const int64_t when)
+{
+	const int64_t wait = when-now_ns();
+	if (wait <= 0) {
+		return;
+	}
+
+	struct timespec ts;
+	ts.tv_sec = (time_t) (wait/1000000000);
+	ts.tv_nsec = (long) (wait%1000000000);
+	(void) nanosleep(&ts, NULL);
+}
+
+// Count what the muxer writes, and discard it.
+static int
+discard_output(void * const opaque, uint8_t * const buf, const int buf_size)
+{
+	(void) buf;
+
+	struct Bench * const bench = opaque;
+	bench->bytes_written += (uint64_t) buf_size;
+	bench->writes++;
+	return buf_size;
+}
+
+// Read the input once, writing its packets to the output. We open the output
+// if it's NULL.
+//
+// We stop at the first failed read. For a file, that's the end of it.
+static int
+run_loop(struct Bench * const bench, const char * const input_format,
+		const char * const input_url, struct VSOutput ** const output,
+		const enum VSFragmentMode fragment_mode, const bool realtime)
+{
+	const bool verbose = false;
+
+	struct VSInput * const input = vs_open_input(input_format, input_url,
+			NULL, NULL, NULL, false, false, 0, verbose);
+	if (!input) {
+		printf("unable to open input\n");
+		return -1;
+	}
+
+	if (!*output) {
+		*output = vs_open_output_callback("mp4", input, discard_output, bench,
+				1024*1024, fragment_mode, 0, verbose);
+		if (!*output) {
+			printf("unable to open output\n");
+			vs_destroy_input(input);
+			return -1;
+		}
+	} else {
+		if (!vs_output_compatible(*output, input)) {
+			printf("input changed between loops\n");
+			vs_destroy_input(input);
+			return -1;
+		}
+		vs_output_rebase(*output);
+	}
+
+	// With realtime, when we started the loop and the timestamp of its first
+	// packet, in nanoseconds.
+	int64_t start = 0;
+	int64_t first_ts = AV_NOPTS_VALUE;
+
+	AVPacket pkt;
+	memset(&pkt, 0, sizeof(AVPacket));
+	uint64_t packets = 0;
+
+	while (1) {
+		int64_t t = now_ns();
+		const int read_res = vs_read_packet(input, &pkt, verbose);
+		bench->read_ns += now_ns()-t;
+		if (read_res == -1) {
+			break;
+		}
+
+		if (read_res == 0) {
+			continue;
+		}
+
+		if (realtime && pkt.dts != AV_NOPTS_VALUE) {
+			const AVStream * const stream =
+				input->format_ctx->streams[pkt.stream_index];
+			const int64_t ts = av_rescale_q(pkt.dts, stream->time_base,
+					(AVRational) {1, 1000000000});
+			if (first_ts == AV_NOPTS_VALUE) {
+				first_ts = ts;
+				start = now_ns();
+			}
+			sleep_until_ns(start+ts-first_ts);
+		}
+
+		bench->bytes_read += (uint64_t) pkt.size;
+
+		t = now_ns();
+		const int write_res = vs_write_packet(input, *output, &pkt, verbose);
+		bench->write_ns += now_ns()-t;
+		av_packet_unref(&pkt);
+		if (write_res == -1) {
+			printf("write failed\n");
+			vs_destroy_input(input);
+			return -1;
+		}
+
+		bench->packets++;
+		packets++;
+	}
+
+	vs_destroy_input(input);
+
+	if (packets == 0) {
+		printf("read no packets\n");
+		return -1;
+	}
+
+	return 0;
+}
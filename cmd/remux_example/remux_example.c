@@ -24,7 +24,7 @@ int main(const int argc, const char * const * const argv)
 	const bool verbose = true;
 
 	struct VSInput * const input = vs_open_input(input_format, input_url,
-			verbose);
+			NULL, NULL, NULL, false, true, 0, verbose);
 	if (!input) {
 		printf("unable to open input\n");
 		return 1;
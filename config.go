@@ -0,0 +1,473 @@
+package main
+
+import (
+	"encoding/json"
+	"fmt"
+	"os"
+	"regexp"
+	"sort"
+	"strings"
+	"time"
+)
+
+// Config holds what we read from the configuration file.
+type Config struct {
+	Inputs []InputConfig `json:"inputs"`
+}
+
+// InputConfig describes one input. We serve it at /stream/{name}.
+type InputConfig struct {
+	Name string `json:"name"`
+
+	// Input format. Example: rtsp for RTSP. relay means another
+	// videostreamer's stream. See Relay.
+	Format string `json:"format"`
+
+	// Input URL valid for the given format. For a relay, the origin's stream,
+	// such as http://origin:8080/stream/front-door.
+	URL string `json:"url"`
+
+	// How long to keep the input open after the last client leaves. This
+	// avoids reopening the input if a client comes along soon, and keeps the
+	// most recent GOP ready for it. If not set, we use the -linger flag.
+	Linger *Duration `json:"linger,omitempty"`
+
+	// How long opening, probing, or reading from the input may block before we
+	// give up on it (and reconnect). 0 means no limit. If not set, we use the
+	// -read-timeout flag.
+	ReadTimeout *Duration `json:"read_timeout,omitempty"`
+
+	// The most clients we stream the input to at once, counting those of its
+	// renditions. 0 means no limit. If not set, we use the -max-input-clients
+	// flag. See Admission.
+	MaxClients *int `json:"max_clients,omitempty"`
+
+	// Open the input at startup and keep it open whether or not there are
+	// clients.
+	AlwaysOn bool `json:"always_on,omitempty"`
+
+	// Options for opening the input. These are format, demuxer, and protocol
+	// options, such as probesize, analyzeduration, fflags, max_delay, or
+	// rtsp_transport.
+	Options map[string]string `json:"options,omitempty"`
+
+	// Carry the input's first audio stream along with its video. We copy it as
+	// is, so the container must be able to hold it (AAC can).
+	Audio bool `json:"audio,omitempty"`
+
+	// Which video and audio stream to read, rather than the first of each.
+	// These are either codec:name (such as codec:h264) or an ffmpeg stream
+	// specifier (such as 2 for the stream with index 2, or v:1 for the second
+	// video stream). We discard the input's other streams.
+	VideoStream string `json:"video_stream,omitempty"`
+	AudioStream string `json:"audio_stream,omitempty"`
+
+	// Open the input quickly. We apply fastStartOptions (Options override them)
+	// and skip probing the stream when opening it told us enough.
+	FastStart bool `json:"fast_start,omitempty"`
+
+	// How we split the output into fragments: "gop" (the default) for a
+	// fragment per GOP, "frame" for a fragment per frame, or "duration" for a
+	// fragment at each keyframe and every FragmentDuration. Smaller fragments
+	// mean less latency.
+	Fragment         string    `json:"fragment,omitempty"`
+	FragmentDuration *Duration `json:"fragment_duration,omitempty"`
+
+	// Read from the input on a dedicated C thread. We take packets from it in
+	// batches, so we call into C less often.
+	ReaderThread bool `json:"reader_thread,omitempty"`
+
+	// Keep this long of the input's most recent output so that clients can
+	// start behind live (with ?offset=-30s). DVRSize bytes (dvrDefaultSize if
+	// 0) is the most this may use. If DVRFile is set, we keep it in a memory
+	// mapped file there.
+	DVR     *Duration `json:"dvr,omitempty"`
+	DVRSize int       `json:"dvr_size,omitempty"`
+	DVRFile string    `json:"dvr_file,omitempty"`
+
+	// Record the input to files in this directory. We start a new file after
+	// RecordDuration (recordDefaultDuration if not set), or once a file reaches
+	// RecordSize bytes if that is set. Recording keeps the input open.
+	Record         string    `json:"record,omitempty"`
+	RecordDuration *Duration `json:"record_duration,omitempty"`
+	RecordSize     int       `json:"record_size,omitempty"`
+
+	// Note when packets and fragments pass each stage of the pipeline. See
+	// Tracer.
+	Trace bool `json:"trace,omitempty"`
+
+	// Also transcode the input's video to these renditions. Clients choose
+	// one with /stream/{name}?q={rendition name}. See Transcoder.
+	Renditions []RenditionConfig `json:"renditions,omitempty"`
+}
+
+// RenditionConfig describes one rendition of an input: its video encoded
+// again at another size and bitrate.
+type RenditionConfig struct {
+	// What clients ask for it by, such as "low".
+	Name string `json:"name"`
+
+	// The size to scale to. If one is 0 we pick it to keep the input's aspect
+	// ratio, and if both are we keep the input's size.
+	Width  int `json:"width,omitempty"`
+	Height int `json:"height,omitempty"`
+
+	// Bits per second.
+	Bitrate int `json:"bitrate"`
+
+	// The ffmpeg encoder to use, such as libx264 (the default), h264_nvenc,
+	// h264_qsv, or h264_vaapi.
+	Encoder string `json:"encoder,omitempty"`
+
+	// To encode on a hardware device, its type (vaapi, cuda, or qsv), and
+	// which device, such as /dev/dri/renderD128 (if not the default). The
+	// encoder must take frames from that kind of device, such as h264_vaapi
+	// for vaapi. h264_nvenc and h264_qsv also work without one.
+	HWDeviceType string `json:"hw_device_type,omitempty"`
+	HWDevice     string `json:"hw_device,omitempty"`
+
+	// How many threads the encoder uses. 0 means as many as there are CPUs.
+	Threads int `json:"threads,omitempty"`
+}
+
+// Options we use to open inputs with fast start. They limit how much we read
+// of the input before streaming, and stop the demuxer buffering.
+var fastStartOptions = map[string]string{
+	"probesize":       "65536",
+	"analyzeduration": "500000",
+	"fflags":          "nobuffer",
+	"max_delay":       "500000",
+}
+
+// Duration is a time.Duration that we read from strings like "30s".
+type Duration time.Duration
+
+// UnmarshalJSON parses a duration string.
+func (d *Duration) UnmarshalJSON(b []byte) error {
+	var str string
+	if err := json.Unmarshal(b, &str); err != nil {
+		return err
+	}
+
+	duration, err := time.ParseDuration(str)
+	if err != nil {
+		return err
+	}
+
+	*d = Duration(duration)
+	return nil
+}
+
+// Input names go in URL paths.
+var inputNameRE = regexp.MustCompile(`^[A-Za-z0-9_.-]+$`)
+
+// readConfig reads and validates a configuration file.
+func readConfig(file string) (Config, error) {
+	fh, err := os.Open(file)
+	if err != nil {
+		return Config{}, err
+	}
+	defer func() {
+		_ = fh.Close()
+	}()
+
+	config := Config{}
+	decoder := json.NewDecoder(fh)
+	decoder.DisallowUnknownFields()
+	if err := decoder.Decode(&config); err != nil {
+		return Config{}, fmt.Errorf("unable to parse %s: %s", file, err)
+	}
+
+	if len(config.Inputs) == 0 {
+		return Config{}, fmt.Errorf("%s has no inputs", file)
+	}
+
+	names := map[string]struct{}{}
+	for _, input := range config.Inputs {
+		if err := input.validate(); err != nil {
+			return Config{}, err
+		}
+
+		if _, ok := names[input.Name]; ok {
+			return Config{}, fmt.Errorf("input %s is listed more than once",
+				input.Name)
+		}
+		names[input.Name] = struct{}{}
+	}
+
+	return config, nil
+}
+
+func (c InputConfig) validate() error {
+	if !inputNameRE.MatchString(c.Name) {
+		return fmt.Errorf("invalid input name: %q", c.Name)
+	}
+
+	if len(c.Format) == 0 {
+		return fmt.Errorf("input %s: you must provide an input format", c.Name)
+	}
+
+	if len(c.URL) == 0 {
+		return fmt.Errorf("input %s: you must provide an input URL", c.Name)
+	}
+
+	if c.isRelay() {
+		if !validRelayURL(c.URL) {
+			return fmt.Errorf("input %s: a relay's URL must be an http or https URL",
+				c.Name)
+		}
+		if len(c.Renditions) > 0 {
+			return fmt.Errorf("input %s: a relay can't have renditions. Relay one of the origin's with ?q= in the URL instead",
+				c.Name)
+		}
+	}
+
+	for key, value := range c.Options {
+		// Any other key or value we can escape. See optionString().
+		if len(key) == 0 {
+			return fmt.Errorf("input %s: invalid option: %s=%s", c.Name, key, value)
+		}
+	}
+
+	if c.Linger != nil && *c.Linger < 0 {
+		return fmt.Errorf("input %s: linger must not be negative", c.Name)
+	}
+
+	if c.MaxClients != nil && *c.MaxClients < 0 {
+		return fmt.Errorf("input %s: max clients must not be negative", c.Name)
+	}
+
+	switch c.Fragment {
+	case "", "gop", "frame":
+	case "duration":
+		if c.FragmentDuration == nil || *c.FragmentDuration <= 0 {
+			return fmt.Errorf("input %s: fragment mode duration needs a fragment duration",
+				c.Name)
+		}
+	default:
+		return fmt.Errorf("input %s: unknown fragment mode: %s", c.Name,
+			c.Fragment)
+	}
+
+	if c.ReadTimeout != nil && *c.ReadTimeout < 0 {
+		return fmt.Errorf("input %s: read timeout must not be negative", c.Name)
+	}
+
+	if c.DVR != nil && *c.DVR < 0 {
+		return fmt.Errorf("input %s: dvr must not be negative", c.Name)
+	}
+
+	if c.DVRSize < 0 {
+		return fmt.Errorf("input %s: dvr size must not be negative", c.Name)
+	}
+
+	if (c.DVRSize != 0 || c.DVRFile != "") && !c.hasDVR() {
+		return fmt.Errorf("input %s: dvr size and file need a dvr duration",
+			c.Name)
+	}
+
+	if c.Record != "" {
+		fi, err := os.Stat(c.Record)
+		if err != nil {
+			return fmt.Errorf("input %s: invalid record directory: %s", c.Name, err)
+		}
+		if !fi.IsDir() {
+			return fmt.Errorf("input %s: %s is not a directory", c.Name, c.Record)
+		}
+	}
+
+	if c.RecordDuration != nil && *c.RecordDuration <= 0 {
+		return fmt.Errorf("input %s: record duration must be positive", c.Name)
+	}
+
+	if c.RecordSize < 0 {
+		return fmt.Errorf("input %s: record size must not be negative", c.Name)
+	}
+
+	renditions := map[string]struct{}{}
+	for _, r := range c.Renditions {
+		if err := r.validate(); err != nil {
+			return fmt.Errorf("input %s: %s", c.Name, err)
+		}
+
+		if _, ok := renditions[r.Name]; ok {
+			return fmt.Errorf("input %s: rendition %s is listed more than once",
+				c.Name, r.Name)
+		}
+		renditions[r.Name] = struct{}{}
+	}
+
+	return nil
+}
+
+func (r RenditionConfig) validate() error {
+	// Rendition names go in metric labels after the input's name.
+	if !inputNameRE.MatchString(r.Name) {
+		return fmt.Errorf("invalid rendition name: %q", r.Name)
+	}
+
+	if r.Width < 0 || r.Height < 0 {
+		return fmt.Errorf("rendition %s: size must not be negative", r.Name)
+	}
+
+	if r.Bitrate <= 0 {
+		return fmt.Errorf("rendition %s: bitrate must be positive", r.Name)
+	}
+
+	if r.HWDevice != "" && r.HWDeviceType == "" {
+		return fmt.Errorf("rendition %s: hw device needs a hw device type",
+			r.Name)
+	}
+
+	if r.Threads < 0 {
+		return fmt.Errorf("rendition %s: threads must not be negative", r.Name)
+	}
+
+	return nil
+}
+
+// optionString returns the options to open the input with, formatted for
+// vs_open_input(): key=value:key2=value2, with keys and values escaped so they
+// may hold : and = (see escapeOption()), such as
+// http_proxy=http\://proxy\:3128.
+func (c InputConfig) optionString() string {
+	options := map[string]string{}
+	if c.FastStart {
+		for key, value := range fastStartOptions {
+			options[key] = value
+		}
+	}
+	for key, value := range c.Options {
+		options[key] = value
+	}
+
+	keys := make([]string, 0, len(options))
+	for key := range options {
+		keys = append(keys, key)
+	}
+	sort.Strings(keys)
+
+	pairs := make([]string, 0, len(keys))
+	for _, key := range keys {
+		pairs = append(pairs, escapeOption(key)+"="+escapeOption(options[key]))
+	}
+	return strings.Join(pairs, ":")
+}
+
+// ringSize returns how many fragments the input's ring holds. It holds
+// fragmentRingSize GOPs, or about that many for smaller fragments.
+func (c InputConfig) ringSize() int {
+	if c.Fragment == "" || c.Fragment == "gop" {
+		return fragmentRingSize
+	}
+	return chunkedRingSize
+}
+
+// hasDVR returns whether we keep a DVR for the input.
+func (c InputConfig) hasDVR() bool {
+	return c.DVR != nil && *c.DVR > 0
+}
+
+// dvrSize returns the most bytes the input's DVR may use.
+func (c InputConfig) dvrSize() int {
+	if c.DVRSize == 0 {
+		return dvrDefaultSize
+	}
+	return c.DVRSize
+}
+
+// recordDuration returns how long each recording file lasts.
+func (c InputConfig) recordDuration() time.Duration {
+	if c.RecordDuration == nil {
+		return recordDefaultDuration
+	}
+	return time.Duration(*c.RecordDuration)
+}
+
+// hasRendition returns whether the input has a rendition with the given name.
+func (c InputConfig) hasRendition(name string) bool {
+	for _, r := range c.Renditions {
+		if r.Name == name {
+			return true
+		}
+	}
+	return false
+}
+
+// lowLatency returns whether the input's fragments are smaller than a GOP. We
+// offer them as LL-HLS parts then.
+func (c InputConfig) lowLatency() bool {
+	return c.Fragment != "" && c.Fragment != "gop"
+}
+
+// parseOptionString parses options like key=value:key2=value2. A backslash
+// escapes the character after it, so keys and values may hold : and =, such as
+// http_proxy=http\://proxy\:3128.
+func parseOptionString(str string) (map[string]string, error) {
+	options := map[string]string{}
+	if len(str) == 0 {
+		return options, nil
+	}
+
+	for _, pair := range splitUnescaped(str, ':', -1) {
+		kv := splitUnescaped(pair, '=', 2)
+		if len(kv) != 2 || len(kv[0]) == 0 {
+			return nil, fmt.Errorf("invalid option: %s", pair)
+		}
+		options[unescapeOption(kv[0])] = unescapeOption(kv[1])
+	}
+
+	return options, nil
+}
+
+// Characters escapeOption() escapes. vs_open_input() parses options with
+// av_dict_parse_string(), which splits pairs at : and keys from values at =,
+// and reads each with av_get_token(). That treats backslashes and single
+// quotes specially, and trims whitespace.
+const optionSpecial = "\\':= \t\r\n"
+
+// escapeOption escapes an option key or value so vs_open_input() reads it as
+// is.
+func escapeOption(s string) string {
+	var b strings.Builder
+	for _, r := range s {
+		if strings.ContainsRune(optionSpecial, r) {
+			b.WriteByte('\\')
+		}
+		b.WriteRune(r)
+	}
+	return b.String()
+}
+
+// unescapeOption drops the backslash before each escaped character.
+func unescapeOption(s string) string {
+	var b strings.Builder
+	for i := 0; i < len(s); i++ {
+		if s[i] == '\\' && i+1 < len(s) {
+			i++
+		}
+		b.WriteByte(s[i])
+	}
+	return b.String()
+}
+
+// splitUnescaped splits s at each sep not escaped with a backslash, into at
+// most n pieces if n > 0. The pieces keep their escapes.
+func splitUnescaped(s string, sep byte, n int) []string {
+	var pieces []string
+	start := 0
+	for i := 0; i < len(s); i++ {
+		if n > 0 && len(pieces) == n-1 {
+			break
+		}
+		if s[i] == '\\' {
+			i++
+			continue
+		}
+		if s[i] == sep {
+			pieces = append(pieces, s[start:i])
+			start = i + 1
+		}
+	}
+	return append(pieces, s[start:])
+}
@@ -0,0 +1,256 @@
+package main
+
+import (
+	"fmt"
+	"os"
+	"sync"
+	"syscall"
+	"time"
+)
+
+// DVR holds the last while of an input's fragments so that clients can start
+// behind live (time shift).
+//
+// The ring only holds the most recent few GOPs. The DVR holds minutes, so
+// rather than keeping each fragment in its own allocation, we copy fragments
+// one after another into a single arena of a fixed size and reuse it. This
+// bounds the memory the DVR uses no matter the bitrate. When the arena is full
+// the oldest fragments go.
+//
+// The arena may be a memory mapped file. The kernel can then write its pages
+// out and drop them, so it does not count against our resident memory.
+type DVR struct {
+	mutex *sync.Mutex
+
+	// Fragments' bytes, one after another. When the next fragment does not fit
+	// at the end, we wrap around to the start.
+	arena []byte
+
+	// The file backing the arena, if it is mapped.
+	file *os.File
+
+	// Where the next fragment goes in the arena.
+	head int
+
+	// The fragments we hold, oldest first.
+	entries []dvrEntry
+
+	// Sequence number of the next fragment.
+	nextSeq uint64
+
+	// How long a time the DVR holds at most.
+	maxAge time.Duration
+
+	closed bool
+}
+
+// dvrEntry is a fragment in the DVR.
+type dvrEntry struct {
+	seq      uint64
+	offset   int
+	size     int
+	keyframe bool
+
+	decodeTime time.Duration
+	duration   time.Duration
+}
+
+// DVRReader reads fragments from a DVR for one client.
+type DVRReader struct {
+	dvr *DVR
+
+	// Sequence number of the next fragment to read.
+	seq uint64
+
+	// We copy fragments here. The arena may overwrite them once we release the
+	// mutex.
+	buf []byte
+}
+
+// errDVRCaughtUp means a reader read every fragment the DVR has. The client
+// can continue from the ring.
+var errDVRCaughtUp = fmt.Errorf("caught up to the DVR")
+
+// newDVR creates a DVR holding up to maxAge of fragments in an arena of size
+// bytes. If file is set, we map the arena from it. We truncate the file to
+// size, and remove it when we close the DVR.
+func newDVR(maxAge time.Duration, size int, file string) (*DVR, error) {
+	d := &DVR{
+		mutex:  &sync.Mutex{},
+		maxAge: maxAge,
+	}
+
+	if file == "" {
+		d.arena = make([]byte, size)
+		return d, nil
+	}
+
+	fh, err := os.OpenFile(file, os.O_RDWR|os.O_CREATE|os.O_TRUNC, 0600)
+	if err != nil {
+		return nil, err
+	}
+
+	if err := fh.Truncate(int64(size)); err != nil {
+		_ = fh.Close()
+		_ = os.Remove(file)
+		return nil, err
+	}
+
+	arena, err := syscall.Mmap(int(fh.Fd()), 0, size,
+		syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+	if err != nil {
+		_ = fh.Close()
+		_ = os.Remove(file)
+		return nil, fmt.Errorf("unable to map %s: %s", file, err)
+	}
+
+	d.arena = arena
+	d.file = fh
+	return d, nil
+}
+
+// Push copies a fragment into the DVR. seq must follow the last fragment's.
+func (d *DVR) Push(seq uint64, data []byte, info fragmentInfo) {
+	d.mutex.Lock()
+	defer d.mutex.Unlock()
+
+	if d.closed {
+		return
+	}
+
+	d.nextSeq = seq + 1
+
+	// It can't fit. Start over, as we can't have a gap.
+	if len(data) > len(d.arena) {
+		d.entries = d.entries[:0]
+		d.head = 0
+		return
+	}
+
+	offset := d.head
+	if offset+len(data) > len(d.arena) {
+		// Wrap around. Fragments at the end of the arena are the oldest, and
+		// the ones we are about to overwrite follow them, so drop them too.
+		offset = 0
+		for len(d.entries) > 0 && d.entries[0].offset >= d.head {
+			d.evict()
+		}
+	}
+
+	// Drop the fragments we overwrite. They're the oldest.
+	for len(d.entries) > 0 && d.entries[0].offset >= offset &&
+		d.entries[0].offset < offset+len(data) {
+		d.evict()
+	}
+
+	copy(d.arena[offset:], data)
+	d.head = offset + len(data)
+
+	d.entries = append(d.entries, dvrEntry{
+		seq:        seq,
+		offset:     offset,
+		size:       len(data),
+		keyframe:   info.Keyframe,
+		decodeTime: info.DecodeTime,
+		duration:   info.Duration,
+	})
+
+	// Drop the fragments that are too old.
+	end := info.DecodeTime + info.Duration
+	for len(d.entries) > 1 && end-d.entries[0].decodeTime > d.maxAge {
+		d.evict()
+	}
+}
+
+// The caller must hold the mutex.
+func (d *DVR) evict() {
+	d.entries[0] = dvrEntry{}
+	d.entries = d.entries[1:]
+}
+
+// Close releases the arena. Readers receive no more fragments.
+func (d *DVR) Close() {
+	d.mutex.Lock()
+	defer d.mutex.Unlock()
+
+	if d.closed {
+		return
+	}
+	d.closed = true
+	d.entries = nil
+
+	if d.file != nil {
+		_ = syscall.Munmap(d.arena)
+		_ = d.file.Close()
+		_ = os.Remove(d.file.Name())
+		d.file = nil
+	}
+	d.arena = nil
+}
+
+// NewReader returns a reader starting offset (which is negative) behind the
+// end of the most recent fragment.
+//
+// We start at a fragment starting with a keyframe: the one closest before
+// that time, or the oldest we have if we don't go back that far. It returns
+// false if we have no such fragment.
+func (d *DVR) NewReader(offset time.Duration) (*DVRReader, bool) {
+	d.mutex.Lock()
+	defer d.mutex.Unlock()
+
+	if len(d.entries) == 0 {
+		return nil, false
+	}
+
+	last := d.entries[len(d.entries)-1]
+	target := last.decodeTime + last.duration + offset
+
+	start := -1
+	for i := len(d.entries) - 1; i >= 0; i-- {
+		if !d.entries[i].keyframe {
+			continue
+		}
+		start = i
+		if d.entries[i].decodeTime <= target {
+			break
+		}
+	}
+
+	if start == -1 {
+		return nil, false
+	}
+
+	return &DVRReader{dvr: d, seq: d.entries[start].seq}, true
+}
+
+// Read returns the next fragment. The bytes are valid until the next call.
+//
+// It returns errDVRCaughtUp once the reader has every fragment the DVR has,
+// and errClientTooSlow if the fragment it needs left the DVR.
+func (dr *DVRReader) Read() ([]byte, error) {
+	d := dr.dvr
+	d.mutex.Lock()
+	defer d.mutex.Unlock()
+
+	if d.closed {
+		return nil, errRingClosed
+	}
+
+	if dr.seq >= d.nextSeq {
+		return nil, errDVRCaughtUp
+	}
+
+	if len(d.entries) == 0 || dr.seq < d.entries[0].seq {
+		return nil, errClientTooSlow
+	}
+
+	entry := d.entries[dr.seq-d.entries[0].seq]
+	dr.buf = append(dr.buf[:0], d.arena[entry.offset:entry.offset+entry.size]...)
+	dr.seq++
+	return dr.buf, nil
+}
+
+// Seq returns the sequence number of the next fragment the reader would read.
+func (dr *DVRReader) Seq() uint64 {
+	return dr.seq
+}
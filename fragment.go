@@ -0,0 +1,678 @@
+package main
+
+import (
+	"encoding/binary"
+	"fmt"
+	"strconv"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Fragment is a piece of an input's shared MP4 output. It is a moof box and
+// the mdat box following it (along with any boxes that came between the prior
+// fragment and the moof). Every client receives the same bytes.
+type Fragment struct {
+	// Sequence number. Fragments from an output count up from 0.
+	Seq uint64
+
+	Data []byte
+
+	// Whether the fragment starts with a video keyframe. A client can start
+	// with it.
+	Keyframe bool
+
+	// The decode time of the fragment's first video frame, and how long its
+	// video lasts.
+	DecodeTime time.Duration
+	Duration   time.Duration
+
+	// If we're tracing, when the fragment passed each stage.
+	Trace *FragmentTrace
+
+	// How many fragments starting with a keyframe the ring had before this one.
+	keyframesBefore uint64
+
+	// The ring holds a reference while the fragment is in it, and so does each
+	// consumer that it handed the fragment to. Once the last is released, the
+	// ring reuses the fragment and its memory for a new one.
+	refs int32
+	ring *FragmentRing
+}
+
+// Fragmenter splits the bytes the muxer writes into the init segment (ftyp and
+// moov boxes) and fragments, and passes them on to a FragmentRing.
+type Fragmenter struct {
+	ring    *FragmentRing
+	metrics *InputMetrics
+
+	// If we're tracing, when we read the first packet we've written since the
+	// last fragment. The muxer sets it.
+	tracing   bool
+	traceRead time.Time
+
+	// Bytes we have not yet seen a whole box of.
+	buf []byte
+
+	// The init segment until we have all of it.
+	init     []byte
+	haveInit bool
+
+	// Tracks from the init segment. We need them to understand fragments.
+	tracks []mp4Track
+
+	// The fragment we are building. We append its boxes to its Data.
+	frag *Fragment
+
+	// If skipping is set, we drop fragments that start at or before this
+	// decode time. A relay reconnecting to its origin sets it, as the origin
+	// starts it again from a GOP that we may already have. See Relay.
+	skipping    bool
+	skipThrough time.Duration
+
+	// The first error Write returned. It's how the encoder finds out why the
+	// muxer's write failed.
+	err error
+}
+
+// FragmentRing holds the most recent fragments of an input's shared output.
+//
+// The encoder adds fragments. Any number of clients read them, each from its
+// own position. We never modify a fragment once it is in the ring, so clients
+// share the same bytes. Once a fragment has left the ring and the last client
+// writing it releases it, we reuse it and its memory for a new fragment, so
+// streaming does not allocate once the ring is full.
+//
+// New clients start at the most recent fragment starting with a keyframe so
+// they can show video right away. Along with the init segment, this means the
+// ring acts as a cache of the most recent GOP.
+type FragmentRing struct {
+	mutex *sync.Mutex
+	cond  *sync.Cond
+
+	// Identifies this ring among the rings an input has over time. Sequence
+	// numbers start over with each ring.
+	epoch string
+
+	initSegment []byte
+
+	// Tracks from the init segment.
+	tracks []mp4Track
+
+	// The wall clock time of decode time 0. We take it from when the first
+	// fragment arrived.
+	startTime time.Time
+
+	fragments []*Fragment
+
+	// Sequence number the next fragment gets.
+	nextSeq uint64
+
+	// Sequence number of the most recent fragment starting with a keyframe.
+	keyframeSeq  uint64
+	haveKeyframe bool
+
+	// How many fragments starting with a keyframe we've had.
+	keyframes uint64
+
+	// If set, we copy fragments here too. It holds more than the ring.
+	dvr *DVR
+
+	closed bool
+
+	// Released fragments for reuse. Consumers release fragments without
+	// holding the ring's mutex, so these have their own.
+	freeMutex *sync.Mutex
+	free      []*Fragment
+}
+
+// RingReader reads fragments from a ring for one client.
+//
+// If the client falls too far behind, rather than dropping it we skip it ahead
+// to the most recent keyframe. It loses some video but keeps its connection.
+// We give up on it if it keeps falling behind.
+type RingReader struct {
+	ring *FragmentRing
+
+	// Sequence number of the next fragment to read.
+	seq uint64
+
+	// How many GOPs the client may be behind before we skip it ahead. This is
+	// how many fragments starting with a keyframe are ahead of it. When each
+	// fragment is a GOP, it's the same as how many fragments.
+	maxLag uint64
+
+	// How many times we may skip the client ahead before giving up. We reset
+	// the count each time it catches up.
+	maxSkips int
+	skips    int
+
+	// Set by Cancel(), under the ring's mutex.
+	cancelled bool
+}
+
+// errRingClosed means the ring will receive no more fragments.
+var errRingClosed = fmt.Errorf("ring closed")
+
+// errReaderCancelled means the reader's client went away. See Cancel().
+var errReaderCancelled = fmt.Errorf("reader cancelled")
+
+// errClientTooSlow means a client is behind and we can't or won't skip it
+// ahead.
+var errClientTooSlow = fmt.Errorf("client too slow")
+
+func newFragmenter(ring *FragmentRing, metrics *InputMetrics) *Fragmenter {
+	return &Fragmenter{ring: ring, metrics: metrics}
+}
+
+// Write takes bytes the muxer wrote. Whenever they complete the init segment
+// or a fragment we pass it to the ring.
+func (f *Fragmenter) Write(p []byte) error {
+	f.buf = append(f.buf, p...)
+
+	offset := 0
+	for {
+		size, _, boxType, ok, err := readBoxHeader(f.buf[offset:])
+		if err != nil {
+			return err
+		}
+		if !ok || uint64(len(f.buf)-offset) < size {
+			break
+		}
+
+		box := f.buf[offset : offset+int(size)]
+		offset += int(size)
+
+		switch boxType {
+		case mp4Ftyp, mp4Moov:
+			if f.haveInit {
+				return fmt.Errorf("unexpected %s box after init segment", boxType)
+			}
+			f.init = append(f.init, box...)
+			if boxType == mp4Moov {
+				tracks, err := parseInitSegment(f.init)
+				if err != nil {
+					return fmt.Errorf("unable to parse init segment: %s", err)
+				}
+				f.tracks = tracks
+				f.haveInit = true
+				f.ring.SetInit(f.init, tracks)
+				f.init = nil
+			}
+		case mp4Mdat:
+			// mdat ends a fragment.
+			f.appendFragment(box)
+			info, err := parseFragment(f.frag.Data, f.tracks)
+			if err != nil {
+				return fmt.Errorf("unable to parse fragment: %s", err)
+			}
+			if f.skipping {
+				if info.DecodeTime <= f.skipThrough {
+					f.frag.Data = f.frag.Data[:0]
+					continue
+				}
+				f.skipping = false
+			}
+			var trace *FragmentTrace
+			if f.tracing {
+				trace = &FragmentTrace{Read: f.traceRead, Fragmented: time.Now()}
+				if !f.traceRead.IsZero() {
+					f.metrics.FragmentTime.Observe(int64(trace.Fragmented.Sub(
+						f.traceRead)))
+				}
+				f.traceRead = time.Time{}
+			}
+			f.ring.Push(f.frag, info, trace)
+			if trace != nil {
+				f.metrics.Traces.add(trace)
+			}
+			f.metrics.Fragments.Inc()
+			f.metrics.FragmentBytes.Observe(int64(len(f.frag.Data)))
+			f.frag = nil
+		case mp4Mfra:
+			// The trailer. It's an index for seekable files. We don't need it.
+		default:
+			// moof, and anything else that comes before it.
+			f.appendFragment(box)
+		}
+	}
+
+	// Keep what's left of a partial box at the start of the buffer.
+	n := copy(f.buf, f.buf[offset:])
+	f.buf = f.buf[:n]
+	return nil
+}
+
+// Add a box to the fragment we are building, starting one if need be.
+func (f *Fragmenter) appendFragment(box []byte) {
+	if f.frag == nil {
+		f.frag = f.ring.newFragment()
+	}
+	f.frag.Data = append(f.frag.Data, box...)
+}
+
+// readBoxHeader reads the header of the MP4 box at the start of b. It returns
+// the box's size and the size of its header.
+//
+// ok is false if b does not hold a whole header yet.
+func readBoxHeader(b []byte) (uint64, int, mp4BoxType, bool, error) {
+	var boxType mp4BoxType
+	if len(b) < 8 {
+		return 0, 0, boxType, false, nil
+	}
+
+	size := uint64(binary.BigEndian.Uint32(b[0:4]))
+	copy(boxType[:], b[4:8])
+	headerSize := 8
+
+	// A size of 1 means the size is in a 64-bit field after the type.
+	if size == 1 {
+		if len(b) < 16 {
+			return 0, 0, boxType, false, nil
+		}
+		size = binary.BigEndian.Uint64(b[8:16])
+		headerSize = 16
+	}
+
+	// A size of 0 means the box extends to the end of the file. We can't know
+	// where that is in a stream.
+	if size < uint64(headerSize) {
+		return 0, 0, boxType, false, fmt.Errorf("invalid size %d for %s box",
+			size, boxType)
+	}
+
+	return size, headerSize, boxType, true, nil
+}
+
+// dvr may be nil.
+func newFragmentRing(size int, dvr *DVR) *FragmentRing {
+	mutex := &sync.Mutex{}
+	return &FragmentRing{
+		mutex:     mutex,
+		cond:      sync.NewCond(mutex),
+		fragments: make([]*Fragment, size),
+		epoch:     strconv.FormatInt(time.Now().UnixNano(), 36),
+		dvr:       dvr,
+		freeMutex: &sync.Mutex{},
+	}
+}
+
+// newFragment returns an empty fragment to fill and Push(), reusing a
+// released one if we can.
+func (r *FragmentRing) newFragment() *Fragment {
+	r.freeMutex.Lock()
+	defer r.freeMutex.Unlock()
+
+	if len(r.free) == 0 {
+		return &Fragment{ring: r}
+	}
+
+	frag := r.free[len(r.free)-1]
+	r.free[len(r.free)-1] = nil
+	r.free = r.free[:len(r.free)-1]
+	return frag
+}
+
+// ref takes a reference to the fragment. The ring's mutex must be held so the
+// fragment can't be released meanwhile.
+func (f *Fragment) ref() {
+	atomic.AddInt32(&f.refs, 1)
+}
+
+// Release drops a reference to a fragment from a RingReader or Segments().
+// The fragment must not be used after.
+func (f *Fragment) Release() {
+	if atomic.AddInt32(&f.refs, -1) != 0 {
+		return
+	}
+
+	r := f.ring
+	*f = Fragment{Data: f.Data[:0], ring: r}
+
+	r.freeMutex.Lock()
+	// Keep as many as there can be in use. Any more are from a burst of
+	// clients we may not see again.
+	if len(r.free) < 2*len(r.fragments) {
+		r.free = append(r.free, f)
+	}
+	r.freeMutex.Unlock()
+}
+
+// releaseFragments releases each fragment and clears it from frags.
+func releaseFragments(frags []*Fragment) {
+	for i, frag := range frags {
+		frag.Release()
+		frags[i] = nil
+	}
+}
+
+// SetInit sets the init segment and the tracks in it. Clients must send it
+// before any fragment.
+func (r *FragmentRing) SetInit(initSegment []byte, tracks []mp4Track) {
+	r.mutex.Lock()
+	r.initSegment = initSegment
+	r.tracks = tracks
+	r.mutex.Unlock()
+	r.cond.Broadcast()
+}
+
+// Push adds a fragment from newFragment() holding the data. The oldest
+// fragment leaves the ring if it is full. trace may be nil.
+func (r *FragmentRing) Push(frag *Fragment, info fragmentInfo,
+	trace *FragmentTrace) {
+	// Only the fragmenter pushes, so the DVR receives fragments in order.
+	if r.dvr != nil {
+		r.dvr.Push(r.nextSeq, frag.Data, info)
+	}
+
+	frag.Keyframe = info.Keyframe
+	frag.DecodeTime = info.DecodeTime
+	frag.Duration = info.Duration
+	frag.Trace = trace
+	frag.refs = 1
+
+	r.mutex.Lock()
+	if r.nextSeq == 0 {
+		r.startTime = time.Now().Add(-info.DecodeTime)
+	}
+	frag.Seq = r.nextSeq
+	frag.keyframesBefore = r.keyframes
+	slot := r.nextSeq % uint64(len(r.fragments))
+	if old := r.fragments[slot]; old != nil {
+		old.Release()
+	}
+	r.fragments[slot] = frag
+	if trace != nil {
+		trace.Seq = r.nextSeq
+	}
+	if info.Keyframe {
+		r.keyframeSeq = r.nextSeq
+		r.haveKeyframe = true
+		r.keyframes++
+	}
+	r.nextSeq++
+	r.mutex.Unlock()
+	r.cond.Broadcast()
+}
+
+// Close wakes any waiting clients. They receive no more fragments.
+func (r *FragmentRing) Close() {
+	r.mutex.Lock()
+	r.closed = true
+	r.mutex.Unlock()
+	r.cond.Broadcast()
+}
+
+// Closed returns whether the ring will receive no more fragments.
+func (r *FragmentRing) Closed() bool {
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+	return r.closed
+}
+
+// Epoch identifies the ring among the rings an input has over time.
+func (r *FragmentRing) Epoch() string {
+	return r.epoch
+}
+
+// DVR returns the ring's DVR, or nil if it has none.
+func (r *FragmentRing) DVR() *DVR {
+	return r.dvr
+}
+
+// LastDecodeTime returns the decode time of the most recent fragment. ok is
+// false if there is none.
+func (r *FragmentRing) LastDecodeTime() (time.Duration, bool) {
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+
+	if r.nextSeq == 0 {
+		return 0, false
+	}
+	frag := r.fragments[(r.nextSeq-1)%uint64(len(r.fragments))]
+	return frag.DecodeTime, true
+}
+
+// Tracks returns the tracks from the init segment. It is nil until we have
+// the init segment.
+func (r *FragmentRing) Tracks() []mp4Track {
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+	return r.tracks
+}
+
+// StartTime returns the wall clock time of decode time 0.
+func (r *FragmentRing) StartTime() time.Time {
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+	return r.startTime
+}
+
+// InitSegment returns the init segment, waiting for it if necessary.
+func (r *FragmentRing) InitSegment() ([]byte, error) {
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+
+	for r.initSegment == nil && !r.closed {
+		r.cond.Wait()
+	}
+
+	if r.closed {
+		return nil, errRingClosed
+	}
+
+	return r.initSegment, nil
+}
+
+// JoinSeq returns the sequence number a new client should start reading from.
+//
+// This is the most recent fragment starting with a keyframe, so the client
+// receives the most recent GOP right away rather than waiting for the next
+// keyframe. If there is no such fragment in the ring, the client waits for the
+// next fragment.
+func (r *FragmentRing) JoinSeq() uint64 {
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+
+	if r.haveKeyframe && r.nextSeq-r.keyframeSeq <= uint64(len(r.fragments)) {
+		return r.keyframeSeq
+	}
+	return r.nextSeq
+}
+
+// NewReader returns a reader for a new client. It starts at JoinSeq().
+func (r *FragmentRing) NewReader(maxLag uint64, maxSkips int) *RingReader {
+	return r.NewReaderAt(r.JoinSeq(), maxLag, maxSkips)
+}
+
+// NewReaderAt returns a reader starting at the given sequence number, such as
+// for a client continuing on from the DVR.
+func (r *FragmentRing) NewReaderAt(seq, maxLag uint64,
+	maxSkips int) *RingReader {
+	return &RingReader{
+		ring:     r,
+		seq:      seq,
+		maxLag:   maxLag,
+		maxSkips: maxSkips,
+	}
+}
+
+// Read appends to frags the fragments the client has not yet read. It waits
+// until there is at least one. The caller must release them once done with
+// them (see releaseFragments()).
+func (rr *RingReader) Read(frags []*Fragment) ([]*Fragment, error) {
+	r := rr.ring
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+
+	if rr.seq >= r.nextSeq {
+		// The client is caught up.
+		rr.skips = 0
+	}
+
+	for rr.seq >= r.nextSeq && !r.closed && !rr.cancelled {
+		r.cond.Wait()
+	}
+
+	if rr.cancelled {
+		return frags, errReaderCancelled
+	}
+	if r.closed {
+		return frags, errRingClosed
+	}
+
+	behind := r.nextSeq-rr.seq > uint64(len(r.fragments))
+	if !behind {
+		frag := r.fragments[rr.seq%uint64(len(r.fragments))]
+		behind = r.keyframes-frag.keyframesBefore > rr.maxLag
+	}
+	if behind {
+		// Skip to the most recent keyframe, if that helps.
+		if rr.skips >= rr.maxSkips || !r.haveKeyframe ||
+			r.keyframeSeq <= rr.seq ||
+			r.nextSeq-r.keyframeSeq > uint64(len(r.fragments)) {
+			return frags, errClientTooSlow
+		}
+		rr.seq = r.keyframeSeq
+		rr.skips++
+	}
+
+	for ; rr.seq < r.nextSeq; rr.seq++ {
+		frag := r.fragments[rr.seq%uint64(len(r.fragments))]
+		frag.ref()
+		frags = append(frags, frag)
+	}
+
+	return frags, nil
+}
+
+// Cancel makes Read() return errReaderCancelled, waking it if it is waiting.
+// A client's HTTP goroutine waits in Read() until a fragment arrives, which
+// may be a long time if the input is down, so whatever notices the client
+// going away calls this.
+func (rr *RingReader) Cancel() {
+	r := rr.ring
+	r.mutex.Lock()
+	rr.cancelled = true
+	r.mutex.Unlock()
+	r.cond.Broadcast()
+}
+
+// Skips returns how many times we skipped the client ahead since it was last
+// caught up.
+func (rr *RingReader) Skips() int {
+	return rr.skips
+}
+
+// Segment is a run of fragments in a ring starting with a keyframe, up to the
+// next fragment starting with a keyframe. With a fragment per GOP, each
+// segment is one fragment. Otherwise the fragments are its parts.
+type Segment struct {
+	// Segments from a ring count up from 0.
+	Seq uint64
+
+	Fragments []*Fragment
+
+	// Whether the segment has all of its fragments. It does once the next
+	// segment starts.
+	Complete bool
+}
+
+// Duration returns how long the segment's video lasts.
+func (s Segment) Duration() time.Duration {
+	d := time.Duration(0)
+	for _, frag := range s.Fragments {
+		d += frag.Duration
+	}
+	return d
+}
+
+// Size returns the segment's size in bytes.
+func (s Segment) Size() int {
+	n := 0
+	for _, frag := range s.Fragments {
+		n += len(frag.Data)
+	}
+	return n
+}
+
+// Segments returns the segments in the ring, oldest first. We skip fragments
+// at the start of the ring before the first keyframe, as those segments are
+// missing their start. The caller must release them once done with them (see
+// releaseSegments()).
+func (r *FragmentRing) Segments() []Segment {
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+
+	first := uint64(0)
+	if r.nextSeq > uint64(len(r.fragments)) {
+		first = r.nextSeq - uint64(len(r.fragments))
+	}
+
+	var segments []Segment
+	for seq := first; seq < r.nextSeq; seq++ {
+		frag := r.fragments[seq%uint64(len(r.fragments))]
+		if frag.Keyframe {
+			if len(segments) > 0 {
+				segments[len(segments)-1].Complete = true
+			}
+			segments = append(segments, Segment{Seq: frag.keyframesBefore})
+		}
+		if len(segments) == 0 {
+			continue
+		}
+		frag.ref()
+		segments[len(segments)-1].Fragments = append(
+			segments[len(segments)-1].Fragments, frag)
+	}
+
+	return segments
+}
+
+// releaseSegments releases the fragments of segments from Segments().
+func releaseSegments(segments []Segment) {
+	for _, segment := range segments {
+		releaseFragments(segment.Fragments)
+	}
+}
+
+// WaitForSegment waits until the ring has all of segment seq or, if part is
+// not negative, at least part+1 of its fragments. It gives up after timeout or
+// if the ring closes.
+//
+// It returns whether the ring has what we waited for.
+func (r *FragmentRing) WaitForSegment(seq uint64, part int,
+	timeout time.Duration) bool {
+	timedOut := false
+	timer := time.AfterFunc(timeout, func() {
+		r.mutex.Lock()
+		timedOut = true
+		r.mutex.Unlock()
+		r.cond.Broadcast()
+	})
+	defer timer.Stop()
+
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+
+	for !r.haveSegment(seq, part) && !r.closed && !timedOut {
+		r.cond.Wait()
+	}
+
+	return r.haveSegment(seq, part)
+}
+
+// The caller must hold the mutex.
+func (r *FragmentRing) haveSegment(seq uint64, part int) bool {
+	// Segment seq is complete once the one after it starts.
+	if r.keyframes > seq+1 {
+		return true
+	}
+
+	// The segment in progress.
+	if r.keyframes == seq+1 && part >= 0 {
+		return r.nextSeq-r.keyframeSeq > uint64(part)
+	}
+
+	return false
+}
@@ -0,0 +1,214 @@
+package main
+
+import (
+	"encoding/binary"
+	"testing"
+	"time"
+)
+
+// The track ID and timescale of the video track in testInitSegment().
+const testTrackID = 1
+const testTimescale = 90000
+
+// testBox returns a box of the type holding the payloads.
+func testBox(boxType string, payloads ...[]byte) []byte {
+	size := 8
+	for _, p := range payloads {
+		size += len(p)
+	}
+
+	b := make([]byte, 8, size)
+	binary.BigEndian.PutUint32(b, uint32(size))
+	copy(b[4:], boxType)
+	for _, p := range payloads {
+		b = append(b, p...)
+	}
+	return b
+}
+
+// testUint32s returns the values as big endian bytes.
+func testUint32s(values ...uint32) []byte {
+	b := make([]byte, 4*len(values))
+	for i, v := range values {
+		binary.BigEndian.PutUint32(b[4*i:], v)
+	}
+	return b
+}
+
+// testInitSegment returns an init segment with one video track.
+func testInitSegment() []byte {
+	hdlr := append(testUint32s(0, 0), []byte("vide\x00\x00\x00\x00\x00\x00\x00\x00"+
+		"\x00\x00\x00\x00\x00")...)
+
+	return append(
+		testBox("ftyp", []byte("isom"), testUint32s(0x200), []byte("isomiso6")),
+		testBox("moov",
+			testBox("trak",
+				// Version 0, creation and modification times, and the track ID.
+				testBox("tkhd", testUint32s(0, 0, 0, testTrackID, 0)),
+				testBox("mdia",
+					// Version 0, creation and modification times, the timescale, and
+					// the duration.
+					testBox("mdhd", testUint32s(0, 0, 0, testTimescale, 0, 0)),
+					testBox("hdlr", hdlr),
+				),
+			),
+			testBox("mvex",
+				// The track's default sample description index, duration, size, and
+				// flags.
+				testBox("trex", testUint32s(0, testTrackID, 1, 3000, 0,
+					mp4SampleIsNonSync)),
+			),
+		)...,
+	)
+}
+
+// testFragment returns a fragment with one video sample of the given
+// duration, starting at the decode time (in the track's timescale).
+func testFragment(decodeTime uint64, duration uint32, keyframe bool,
+	data []byte) []byte {
+	flags := uint32(0)
+	if !keyframe {
+		flags = mp4SampleIsNonSync
+	}
+
+	tfdt := testUint32s(1<<24, 0, 0)
+	binary.BigEndian.PutUint64(tfdt[4:], decodeTime)
+
+	return append(
+		testBox("moof",
+			testBox("mfhd", testUint32s(0, 1)),
+			testBox("traf",
+				testBox("tfhd", testUint32s(0, testTrackID)),
+				testBox("tfdt", tfdt),
+				// First sample flags and a duration for each sample.
+				testBox("trun", testUint32s(0x104, 1, flags, duration)),
+			),
+		),
+		testBox("mdat", data)...,
+	)
+}
+
+func TestFragmenterRing(t *testing.T) {
+	ring := newFragmentRing(4, nil)
+	f := newFragmenter(ring, metricsFor("test-fragmenter-ring"))
+
+	// Write the init segment and the first fragment together, split partway
+	// through a box.
+	stream := append(testInitSegment(),
+		testFragment(0, testTimescale, true, []byte("one"))...)
+	if err := f.Write(stream[:20]); err != nil {
+		t.Fatalf("Write: %s", err)
+	}
+	if err := f.Write(stream[20:]); err != nil {
+		t.Fatalf("Write: %s", err)
+	}
+
+	tracks := ring.Tracks()
+	if len(tracks) != 1 || tracks[0].ID != testTrackID ||
+		tracks[0].Handler != "vide" || tracks[0].Timescale != testTimescale ||
+		tracks[0].DefaultSampleFlags != mp4SampleIsNonSync {
+		t.Fatalf("unexpected tracks: %+v", tracks)
+	}
+
+	if err := f.Write(testFragment(testTimescale, testTimescale/2, false,
+		[]byte("two"))); err != nil {
+		t.Fatalf("Write: %s", err)
+	}
+
+	reader := ring.NewReader(4, 0)
+	frags, err := reader.Read(nil)
+	if err != nil {
+		t.Fatalf("Read: %s", err)
+	}
+	if len(frags) != 2 {
+		t.Fatalf("read %d fragments, wanted 2", len(frags))
+	}
+
+	if !frags[0].Keyframe || frags[0].DecodeTime != 0 ||
+		frags[0].Duration != time.Second {
+		t.Errorf("unexpected first fragment: %+v", frags[0])
+	}
+	if frags[1].Keyframe || frags[1].DecodeTime != time.Second ||
+		frags[1].Duration != time.Second/2 {
+		t.Errorf("unexpected second fragment: %+v", frags[1])
+	}
+	releaseFragments(frags)
+
+	reader.Cancel()
+	if _, err := reader.Read(frags[:0]); err != errReaderCancelled {
+		t.Errorf("Read after Cancel returned %v, wanted %v", err,
+			errReaderCancelled)
+	}
+}
+
+// Set up a ring ready to stream the fragment to a client, and fill it, so
+// any memory it reuses has been allocated.
+func testStreamingRing(t testing.TB, frag []byte) (*Fragmenter, *RingReader) {
+	ring := newFragmentRing(8, nil)
+	f := newFragmenter(ring, metricsFor("test-streaming-ring"))
+	if err := f.Write(testInitSegment()); err != nil {
+		t.Fatalf("Write: %s", err)
+	}
+
+	reader := ring.NewReader(8, 0)
+	var frags []*Fragment
+	for i := 0; i < 32; i++ {
+		if err := f.Write(frag); err != nil {
+			t.Fatalf("Write: %s", err)
+		}
+		var err error
+		frags, err = reader.Read(frags[:0])
+		if err != nil {
+			t.Fatalf("Read: %s", err)
+		}
+		releaseFragments(frags)
+	}
+
+	return f, reader
+}
+
+// Once the ring is full, passing a fragment from the muxer through the ring to
+// a client must not allocate.
+func TestFragmenterRingAllocs(t *testing.T) {
+	frag := testFragment(0, 3000, true, make([]byte, 16*1024))
+	f, reader := testStreamingRing(t, frag)
+
+	frags := make([]*Fragment, 0, 1)
+	allocs := testing.AllocsPerRun(1000, func() {
+		if err := f.Write(frag); err != nil {
+			t.Fatalf("Write: %s", err)
+		}
+		var err error
+		frags, err = reader.Read(frags[:0])
+		if err != nil {
+			t.Fatalf("Read: %s", err)
+		}
+		releaseFragments(frags)
+	})
+	if allocs != 0 {
+		t.Errorf("%v allocations per fragment, wanted 0", allocs)
+	}
+}
+
+func BenchmarkFragmenterRing(b *testing.B) {
+	frag := testFragment(0, 3000, true, make([]byte, 16*1024))
+	f, reader := testStreamingRing(b, frag)
+
+	frags := make([]*Fragment, 0, 1)
+	b.SetBytes(int64(len(frag)))
+	b.ReportAllocs()
+	b.ResetTimer()
+
+	for i := 0; i < b.N; i++ {
+		if err := f.Write(frag); err != nil {
+			b.Fatalf("Write: %s", err)
+		}
+		var err error
+		frags, err = reader.Read(frags[:0])
+		if err != nil {
+			b.Fatalf("Read: %s", err)
+		}
+		releaseFragments(frags)
+	}
+}
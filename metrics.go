@@ -0,0 +1,459 @@
+package main
+
+import (
+	"io"
+	"runtime"
+	"sort"
+	"strconv"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// We keep metrics about each input's pipeline and serve them at /metrics in
+// the Prometheus text format.
+//
+// Updating a metric is an atomic add, so we can update them from the hot path
+// (for every packet and fragment) without locking.
+
+// Counter is a count that only goes up.
+type Counter struct {
+	v uint64
+}
+
+// Gauge is a value that goes up and down.
+type Gauge struct {
+	v int64
+}
+
+// Histogram counts observations in buckets.
+type Histogram struct {
+	// We scale observations by this for output. For example, we observe
+	// durations in nanoseconds and output seconds.
+	scale float64
+
+	// The upper bounds of the buckets in the unit we observe in, in increasing
+	// order.
+	bounds []int64
+
+	// How many observations fell in each bucket. This is not cumulative. The
+	// last one counts those above every bound.
+	counts []uint64
+
+	sum int64
+}
+
+// InputMetrics are the metrics for one input.
+type InputMetrics struct {
+	// What we read from the input, and how long each read of a batch of
+	// packets took.
+	PacketsRead *Counter
+	BytesRead   *Counter
+	ReadTime    *Histogram
+
+	// Packets we dropped before muxing, such as while waiting for a keyframe.
+	PacketsDropped *Counter
+
+	// Packets (for an input) or frames (for a rendition) we did not transcode
+	// because transcoding fell behind. See Transcoder.
+	TranscodeDropped *Counter
+
+	// The fragments the muxer produced, and their sizes.
+	Fragments     *Counter
+	FragmentBytes *Histogram
+
+	// How long opening the input took, and how many times that failed.
+	OpenTime     *Histogram
+	OpenFailures *Counter
+
+	// How many times we reconnected, and how long until we were reading again.
+	Reconnects    *Counter
+	ReconnectTime *Histogram
+
+	// /stream clients, how many fragments were waiting for a client each time
+	// it read, how many times we skipped one ahead, and how many we dropped.
+	Clients        *Gauge
+	ClientQueue    *Histogram
+	ClientSkips    *Counter
+	ClientsDropped *Counter
+
+	// Clients we turned away for being at a limit (see Admission), and the
+	// bytes we sent to clients.
+	ClientsRejected *Counter
+	BytesSent       *Counter
+
+	// With tracing, how long packets waited for the muxer, how long it took
+	// to write them, how long until they were in a fragment, how long until we
+	// wrote the fragment to a client, and how long from reading a fragment's
+	// first packet until we wrote it to a client. See Tracer.
+	MuxQueueTime *Histogram
+	MuxTime      *Histogram
+	FragmentTime *Histogram
+	DeliverTime  *Histogram
+	Latency      *Histogram
+
+	Traces *Tracer
+}
+
+// Metrics holds each input's metrics.
+type Metrics struct {
+	mutex  *sync.Mutex
+	inputs map[string]*InputMetrics
+}
+
+var metrics = &Metrics{
+	mutex:  &sync.Mutex{},
+	inputs: map[string]*InputMetrics{},
+}
+
+// Bucket bounds for durations of I/O, and for opening an input.
+var ioTimeBuckets = durationBuckets(100*time.Microsecond, 1*time.Millisecond,
+	5*time.Millisecond, 10*time.Millisecond, 25*time.Millisecond,
+	50*time.Millisecond, 100*time.Millisecond, 250*time.Millisecond,
+	500*time.Millisecond, time.Second)
+var openTimeBuckets = durationBuckets(100*time.Millisecond,
+	250*time.Millisecond, 500*time.Millisecond, time.Second, 2*time.Second,
+	5*time.Second, 10*time.Second, 30*time.Second, time.Minute)
+
+// Bucket bounds for how long a fragment takes to pass a stage. Fragments
+// holding a GOP take seconds to form.
+var stageTimeBuckets = durationBuckets(time.Millisecond, 10*time.Millisecond,
+	50*time.Millisecond, 100*time.Millisecond, 250*time.Millisecond,
+	500*time.Millisecond, time.Second, 2*time.Second, 5*time.Second,
+	10*time.Second)
+
+var fragmentSizeBuckets = []int64{1 << 10, 4 << 10, 16 << 10, 64 << 10,
+	256 << 10, 1 << 20, 4 << 20}
+var clientQueueBuckets = []int64{1, 2, 4, 8, 16, 32, 64, 128, 256}
+
+func durationBuckets(durations ...time.Duration) []int64 {
+	bounds := make([]int64, len(durations))
+	for i, d := range durations {
+		bounds[i] = int64(d)
+	}
+	return bounds
+}
+
+// metricsFor returns the named input's metrics.
+func metricsFor(name string) *InputMetrics {
+	metrics.mutex.Lock()
+	defer metrics.mutex.Unlock()
+
+	if m, ok := metrics.inputs[name]; ok {
+		return m
+	}
+
+	m := &InputMetrics{
+		PacketsRead:      &Counter{},
+		BytesRead:        &Counter{},
+		ReadTime:         newHistogram(1e-9, ioTimeBuckets),
+		PacketsDropped:   &Counter{},
+		TranscodeDropped: &Counter{},
+		Fragments:        &Counter{},
+		FragmentBytes:    newHistogram(1, fragmentSizeBuckets),
+		OpenTime:         newHistogram(1e-9, openTimeBuckets),
+		OpenFailures:     &Counter{},
+		Reconnects:       &Counter{},
+		ReconnectTime:    newHistogram(1e-9, openTimeBuckets),
+		Clients:          &Gauge{},
+		ClientQueue:      newHistogram(1, clientQueueBuckets),
+		ClientSkips:      &Counter{},
+		ClientsDropped:   &Counter{},
+		ClientsRejected:  &Counter{},
+		BytesSent:        &Counter{},
+		MuxQueueTime:     newHistogram(1e-9, ioTimeBuckets),
+		MuxTime:          newHistogram(1e-9, ioTimeBuckets),
+		FragmentTime:     newHistogram(1e-9, stageTimeBuckets),
+		DeliverTime:      newHistogram(1e-9, stageTimeBuckets),
+		Latency:          newHistogram(1e-9, stageTimeBuckets),
+		Traces:           newTracer(),
+	}
+	metrics.inputs[name] = m
+	return m
+}
+
+// Add adds n to the counter.
+func (c *Counter) Add(n uint64) {
+	atomic.AddUint64(&c.v, n)
+}
+
+// Inc adds 1 to the counter.
+func (c *Counter) Inc() {
+	atomic.AddUint64(&c.v, 1)
+}
+
+// Add adds n (which may be negative) to the gauge.
+func (g *Gauge) Add(n int64) {
+	atomic.AddInt64(&g.v, n)
+}
+
+func newHistogram(scale float64, bounds []int64) *Histogram {
+	return &Histogram{
+		scale:  scale,
+		bounds: bounds,
+		counts: make([]uint64, len(bounds)+1),
+	}
+}
+
+// Observe counts an observation.
+func (h *Histogram) Observe(v int64) {
+	i := 0
+	for i < len(h.bounds) && v > h.bounds[i] {
+		i++
+	}
+	atomic.AddUint64(&h.counts[i], 1)
+	atomic.AddInt64(&h.sum, v)
+}
+
+// ObserveDuration counts the time since start.
+func (h *Histogram) ObserveDuration(start time.Time) {
+	h.Observe(int64(time.Since(start)))
+}
+
+// Each metric we output: its name, type, help, and how to find it in an
+// input's metrics.
+var metricDescs = []struct {
+	name      string
+	kind      string
+	help      string
+	counter   func(*InputMetrics) *Counter
+	gauge     func(*InputMetrics) *Gauge
+	histogram func(*InputMetrics) *Histogram
+}{
+	{
+		name:    "videostreamer_packets_read_total",
+		kind:    "counter",
+		help:    "Packets read from the input.",
+		counter: func(m *InputMetrics) *Counter { return m.PacketsRead },
+	},
+	{
+		name:    "videostreamer_read_bytes_total",
+		kind:    "counter",
+		help:    "Bytes of packets read from the input.",
+		counter: func(m *InputMetrics) *Counter { return m.BytesRead },
+	},
+	{
+		name:      "videostreamer_read_seconds",
+		kind:      "histogram",
+		help:      "Time to read a batch of packets from the input.",
+		histogram: func(m *InputMetrics) *Histogram { return m.ReadTime },
+	},
+	{
+		name:    "videostreamer_packets_dropped_total",
+		kind:    "counter",
+		help:    "Packets read from the input that we did not mux.",
+		counter: func(m *InputMetrics) *Counter { return m.PacketsDropped },
+	},
+	{
+		name:    "videostreamer_transcode_dropped_total",
+		kind:    "counter",
+		help:    "Packets or frames we did not transcode because transcoding fell behind.",
+		counter: func(m *InputMetrics) *Counter { return m.TranscodeDropped },
+	},
+	{
+		name:    "videostreamer_fragments_total",
+		kind:    "counter",
+		help:    "Fragments the muxer produced.",
+		counter: func(m *InputMetrics) *Counter { return m.Fragments },
+	},
+	{
+		name:      "videostreamer_fragment_bytes",
+		kind:      "histogram",
+		help:      "Sizes of fragments the muxer produced.",
+		histogram: func(m *InputMetrics) *Histogram { return m.FragmentBytes },
+	},
+	{
+		name:      "videostreamer_input_open_seconds",
+		kind:      "histogram",
+		help:      "Time to open the input.",
+		histogram: func(m *InputMetrics) *Histogram { return m.OpenTime },
+	},
+	{
+		name:    "videostreamer_input_open_failures_total",
+		kind:    "counter",
+		help:    "Times opening the input failed.",
+		counter: func(m *InputMetrics) *Counter { return m.OpenFailures },
+	},
+	{
+		name:    "videostreamer_reconnects_total",
+		kind:    "counter",
+		help:    "Times we reconnected to the input after reading failed.",
+		counter: func(m *InputMetrics) *Counter { return m.Reconnects },
+	},
+	{
+		name:      "videostreamer_reconnect_seconds",
+		kind:      "histogram",
+		help:      "Time from reading failing until we reconnected.",
+		histogram: func(m *InputMetrics) *Histogram { return m.ReconnectTime },
+	},
+	{
+		name:  "videostreamer_clients",
+		kind:  "gauge",
+		help:  "Clients streaming the input.",
+		gauge: func(m *InputMetrics) *Gauge { return m.Clients },
+	},
+	{
+		name:      "videostreamer_client_queue_fragments",
+		kind:      "histogram",
+		help:      "Fragments waiting for a client each time it read.",
+		histogram: func(m *InputMetrics) *Histogram { return m.ClientQueue },
+	},
+	{
+		name:    "videostreamer_client_skips_total",
+		kind:    "counter",
+		help:    "Times we skipped a client that fell behind ahead to a keyframe.",
+		counter: func(m *InputMetrics) *Counter { return m.ClientSkips },
+	},
+	{
+		name:    "videostreamer_clients_dropped_total",
+		kind:    "counter",
+		help:    "Clients we dropped for being too slow.",
+		counter: func(m *InputMetrics) *Counter { return m.ClientsDropped },
+	},
+	{
+		name:    "videostreamer_clients_rejected_total",
+		kind:    "counter",
+		help:    "Clients and segment requests we turned away for being at a limit.",
+		counter: func(m *InputMetrics) *Counter { return m.ClientsRejected },
+	},
+	{
+		name:    "videostreamer_sent_bytes_total",
+		kind:    "counter",
+		help:    "Bytes sent to clients of the input.",
+		counter: func(m *InputMetrics) *Counter { return m.BytesSent },
+	},
+	{
+		name:      "videostreamer_mux_queue_seconds",
+		kind:      "histogram",
+		help:      "With tracing, time from reading a packet until the muxer took it.",
+		histogram: func(m *InputMetrics) *Histogram { return m.MuxQueueTime },
+	},
+	{
+		name:      "videostreamer_mux_seconds",
+		kind:      "histogram",
+		help:      "With tracing, time to mux a batch of packets.",
+		histogram: func(m *InputMetrics) *Histogram { return m.MuxTime },
+	},
+	{
+		name:      "videostreamer_fragment_seconds",
+		kind:      "histogram",
+		help:      "With tracing, time from reading a fragment's first packet until the muxer produced the fragment.",
+		histogram: func(m *InputMetrics) *Histogram { return m.FragmentTime },
+	},
+	{
+		name:      "videostreamer_deliver_seconds",
+		kind:      "histogram",
+		help:      "With tracing, time from the muxer producing a fragment until we wrote it to a client.",
+		histogram: func(m *InputMetrics) *Histogram { return m.DeliverTime },
+	},
+	{
+		name:      "videostreamer_latency_seconds",
+		kind:      "histogram",
+		help:      "With tracing, time from reading a fragment's first packet until we wrote it to a client.",
+		histogram: func(m *InputMetrics) *Histogram { return m.Latency },
+	},
+}
+
+// WriteTo writes every input's metrics in the Prometheus text format.
+func (ms *Metrics) WriteTo(w io.Writer) (int64, error) {
+	ms.mutex.Lock()
+	names := make([]string, 0, len(ms.inputs))
+	for name := range ms.inputs {
+		names = append(names, name)
+	}
+	inputs := make([]*InputMetrics, 0, len(names))
+	sort.Strings(names)
+	for _, name := range names {
+		inputs = append(inputs, ms.inputs[name])
+	}
+	ms.mutex.Unlock()
+
+	var buf []byte
+	for _, desc := range metricDescs {
+		buf = append(buf, "# HELP "+desc.name+" "+desc.help+"\n"...)
+		buf = append(buf, "# TYPE "+desc.name+" "+desc.kind+"\n"...)
+
+		for i, m := range inputs {
+			label := `input="` + names[i] + `"`
+
+			switch {
+			case desc.counter != nil:
+				buf = appendSample(buf, desc.name, label,
+					float64(atomic.LoadUint64(&desc.counter(m).v)))
+			case desc.gauge != nil:
+				buf = appendSample(buf, desc.name, label,
+					float64(atomic.LoadInt64(&desc.gauge(m).v)))
+			case desc.histogram != nil:
+				buf = desc.histogram(m).append(buf, desc.name, label)
+			}
+		}
+	}
+
+	buf = appendRuntimeMetrics(buf)
+
+	n, err := w.Write(buf)
+	return int64(n), err
+}
+
+// Append the histogram's samples. Buckets are cumulative in the output, and
+// the count is the +Inf bucket, so what we output is consistent even if
+// observations happen while we read the buckets.
+func (h *Histogram) append(buf []byte, name, label string) []byte {
+	cumulative := uint64(0)
+	for i := range h.counts {
+		cumulative += atomic.LoadUint64(&h.counts[i])
+
+		le := "+Inf"
+		if i < len(h.bounds) {
+			le = strconv.FormatFloat(float64(h.bounds[i])*h.scale, 'f', -1, 64)
+		}
+		buf = appendSample(buf, name+"_bucket", label+`,le="`+le+`"`,
+			float64(cumulative))
+	}
+
+	buf = appendSample(buf, name+"_sum", label,
+		float64(atomic.LoadInt64(&h.sum))*h.scale)
+	return appendSample(buf, name+"_count", label, float64(cumulative))
+}
+
+// Append metrics about the Go runtime: how much we allocate and how long
+// garbage collection pauses us. They are for the whole process, so they have
+// no label. Reading them stops the world briefly, which is fine once a scrape.
+func appendRuntimeMetrics(buf []byte) []byte {
+	var mem runtime.MemStats
+	runtime.ReadMemStats(&mem)
+
+	for _, sample := range []struct {
+		name, kind, help string
+		v                float64
+	}{
+		{"videostreamer_go_mallocs_total", "counter",
+			"Heap objects the Go runtime allocated.", float64(mem.Mallocs)},
+		{"videostreamer_go_alloc_bytes_total", "counter",
+			"Bytes the Go runtime allocated for heap objects.",
+			float64(mem.TotalAlloc)},
+		{"videostreamer_go_heap_bytes", "gauge",
+			"Bytes of allocated heap objects.", float64(mem.HeapAlloc)},
+		{"videostreamer_go_gc_total", "counter",
+			"Completed garbage collection cycles.", float64(mem.NumGC)},
+		{"videostreamer_go_gc_pause_seconds_total", "counter",
+			"Time garbage collection stopped the world.",
+			float64(mem.PauseTotalNs) / 1e9},
+	} {
+		buf = append(buf, "# HELP "+sample.name+" "+sample.help+"\n"...)
+		buf = append(buf, "# TYPE "+sample.name+" "+sample.kind+"\n"...)
+		buf = appendSample(buf, sample.name, "", sample.v)
+	}
+	return buf
+}
+
+// label may be empty.
+func appendSample(buf []byte, name, label string, v float64) []byte {
+	if label == "" {
+		buf = append(buf, name+" "...)
+	} else {
+		buf = append(buf, name+"{"+label+"} "...)
+	}
+	buf = strconv.AppendFloat(buf, v, 'f', -1, 64)
+	return append(buf, '\n')
+}
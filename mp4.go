@@ -0,0 +1,595 @@
+package main
+
+import (
+	"encoding/binary"
+	"fmt"
+	"time"
+)
+
+// This file has just enough MP4 parsing to find out what we need about the
+// init segment and fragments the muxer writes. We never change the bytes.
+
+// mp4Track is what we know about a track from the init segment.
+type mp4Track struct {
+	ID uint32
+
+	// Handler type. vide for video, soun for audio.
+	Handler string
+
+	// Ticks per second of the track's timestamps, from mdhd.
+	Timescale uint32
+
+	// From trex. Fragments use them for samples without their own flags or
+	// duration.
+	DefaultSampleFlags    uint32
+	DefaultSampleDuration uint32
+
+	// RFC 6381 codec string, such as avc1.64001f or mp4a.40.2. Empty if we
+	// don't know the codec.
+	Codec string
+}
+
+// fragmentInfo is what we know about a fragment from its moof box.
+type fragmentInfo struct {
+	// Whether the fragment's first video sample is a sync sample (keyframe). A
+	// client can start decoding there.
+	Keyframe bool
+
+	// The decode time of the fragment's first video sample, and how long its
+	// video samples last.
+	DecodeTime time.Duration
+	Duration   time.Duration
+}
+
+// trafInfo is what we know about a track's part of a fragment.
+type trafInfo struct {
+	// nil if we don't know the track.
+	Track *mp4Track
+
+	// The flags of the first sample.
+	FirstFlags uint32
+
+	// In the track's timescale.
+	DecodeTime uint64
+	Duration   uint64
+}
+
+// Sample flags bit saying the sample is not a sync sample.
+const mp4SampleIsNonSync = 0x00010000
+
+// mp4BoxType is the four character type of a box, such as moov. We keep it
+// as bytes rather than a string so reading it doesn't allocate.
+type mp4BoxType [4]byte
+
+// The boxes we look for.
+var (
+	mp4Avc1 = mp4BoxType{'a', 'v', 'c', '1'}
+	mp4Avc3 = mp4BoxType{'a', 'v', 'c', '3'}
+	mp4AvcC = mp4BoxType{'a', 'v', 'c', 'C'}
+	mp4Esds = mp4BoxType{'e', 's', 'd', 's'}
+	mp4Ftyp = mp4BoxType{'f', 't', 'y', 'p'}
+	mp4Hdlr = mp4BoxType{'h', 'd', 'l', 'r'}
+	mp4Mdat = mp4BoxType{'m', 'd', 'a', 't'}
+	mp4Mdhd = mp4BoxType{'m', 'd', 'h', 'd'}
+	mp4Mdia = mp4BoxType{'m', 'd', 'i', 'a'}
+	mp4Mfra = mp4BoxType{'m', 'f', 'r', 'a'}
+	mp4Minf = mp4BoxType{'m', 'i', 'n', 'f'}
+	mp4Moof = mp4BoxType{'m', 'o', 'o', 'f'}
+	mp4Moov = mp4BoxType{'m', 'o', 'o', 'v'}
+	mp4Mp4a = mp4BoxType{'m', 'p', '4', 'a'}
+	mp4Mvex = mp4BoxType{'m', 'v', 'e', 'x'}
+	mp4Stbl = mp4BoxType{'s', 't', 'b', 'l'}
+	mp4Stsd = mp4BoxType{'s', 't', 's', 'd'}
+	mp4Tfdt = mp4BoxType{'t', 'f', 'd', 't'}
+	mp4Tfhd = mp4BoxType{'t', 'f', 'h', 'd'}
+	mp4Tkhd = mp4BoxType{'t', 'k', 'h', 'd'}
+	mp4Traf = mp4BoxType{'t', 'r', 'a', 'f'}
+	mp4Trak = mp4BoxType{'t', 'r', 'a', 'k'}
+	mp4Trex = mp4BoxType{'t', 'r', 'e', 'x'}
+	mp4Trun = mp4BoxType{'t', 'r', 'u', 'n'}
+)
+
+func (t mp4BoxType) String() string {
+	return string(t[:])
+}
+
+// mp4Boxes steps through the boxes in a byte slice:
+//
+//	boxes := mp4Boxes{rest: b}
+//	for boxes.Next() {
+//		// Look at boxes.Type and boxes.Body.
+//	}
+//	if boxes.Err != nil {
+//		// The boxes are invalid.
+//	}
+//
+// This is a plain loop rather than a callback for each box so that parsing
+// each fragment doesn't move what the caller is gathering to the heap.
+type mp4Boxes struct {
+	// What we have yet to step through.
+	rest []byte
+
+	// The current box's type and body (the bytes after its header).
+	Type mp4BoxType
+	Body []byte
+
+	// Why we stopped before the end, if we did.
+	Err error
+}
+
+// Next steps to the next box. It returns false once there are no more, or if
+// the next is invalid, in which case it sets Err.
+func (bs *mp4Boxes) Next() bool {
+	if len(bs.rest) == 0 || bs.Err != nil {
+		return false
+	}
+
+	size, headerSize, boxType, ok, err := readBoxHeader(bs.rest)
+	if err != nil {
+		bs.Err = err
+		return false
+	}
+	if !ok || uint64(len(bs.rest)) < size {
+		bs.Err = fmt.Errorf("truncated %s box", boxType)
+		return false
+	}
+
+	bs.Type = boxType
+	bs.Body = bs.rest[headerSize:size]
+	bs.rest = bs.rest[size:]
+	return true
+}
+
+// parseInitSegment finds the tracks in an init segment.
+func parseInitSegment(initSegment []byte) ([]mp4Track, error) {
+	var tracks []mp4Track
+
+	boxes := mp4Boxes{rest: initSegment}
+	for boxes.Next() {
+		if boxes.Type != mp4Moov {
+			continue
+		}
+
+		var mvex []byte
+		moov := mp4Boxes{rest: boxes.Body}
+		for moov.Next() {
+			switch moov.Type {
+			case mp4Trak:
+				track, err := parseTrak(moov.Body)
+				if err != nil {
+					return nil, err
+				}
+				tracks = append(tracks, track)
+			case mp4Mvex:
+				mvex = moov.Body
+			}
+		}
+		if moov.Err != nil {
+			return nil, moov.Err
+		}
+
+		if err := parseMvex(mvex, tracks); err != nil {
+			return nil, err
+		}
+	}
+	if boxes.Err != nil {
+		return nil, boxes.Err
+	}
+
+	return tracks, nil
+}
+
+func parseTrak(trak []byte) (mp4Track, error) {
+	track := mp4Track{}
+
+	boxes := mp4Boxes{rest: trak}
+	for boxes.Next() {
+		body := boxes.Body
+		switch boxes.Type {
+		case mp4Tkhd:
+			// Version 1 has 64-bit creation and modification times.
+			offset := 12
+			if len(body) > 0 && body[0] == 1 {
+				offset = 20
+			}
+			if len(body) < offset+4 {
+				return track, fmt.Errorf("short tkhd box")
+			}
+			track.ID = binary.BigEndian.Uint32(body[offset:])
+		case mp4Mdia:
+			if err := parseMdia(body, &track); err != nil {
+				return track, err
+			}
+		}
+	}
+
+	return track, boxes.Err
+}
+
+// parseMdia fills in what the mdia box of a track says about it.
+func parseMdia(mdia []byte, track *mp4Track) error {
+	boxes := mp4Boxes{rest: mdia}
+	for boxes.Next() {
+		body := boxes.Body
+		switch boxes.Type {
+		case mp4Hdlr:
+			if len(body) < 12 {
+				return fmt.Errorf("short hdlr box")
+			}
+			track.Handler = string(body[8:12])
+		case mp4Mdhd:
+			// Version 1 has 64-bit creation and modification times.
+			offset := 12
+			if len(body) > 0 && body[0] == 1 {
+				offset = 20
+			}
+			if len(body) < offset+4 {
+				return fmt.Errorf("short mdhd box")
+			}
+			track.Timescale = binary.BigEndian.Uint32(body[offset:])
+		case mp4Minf:
+			codec, err := parseMinfCodec(body)
+			if err != nil {
+				return err
+			}
+			track.Codec = codec
+		}
+	}
+	return boxes.Err
+}
+
+// parseMinfCodec finds the codec string of the first sample entry in a minf
+// box (in minf/stbl/stsd).
+func parseMinfCodec(minf []byte) (string, error) {
+	codec := ""
+	boxes := mp4Boxes{rest: minf}
+	for boxes.Next() {
+		if boxes.Type != mp4Stbl {
+			continue
+		}
+		stbl := mp4Boxes{rest: boxes.Body}
+		for stbl.Next() {
+			if stbl.Type != mp4Stsd {
+				continue
+			}
+			// Skip the version, flags, and entry count.
+			if len(stbl.Body) < 8 {
+				return "", fmt.Errorf("short stsd box")
+			}
+			entries := stbl.Body[8:]
+			if len(entries) < 8 {
+				continue
+			}
+			size, headerSize, entryType, ok, err := readBoxHeader(entries)
+			if err != nil {
+				return "", err
+			}
+			if !ok || uint64(len(entries)) < size {
+				return "", fmt.Errorf("truncated %s box", entryType)
+			}
+			codec = sampleEntryCodec(entryType, entries[headerSize:size])
+		}
+		if stbl.Err != nil {
+			return "", stbl.Err
+		}
+	}
+	return codec, boxes.Err
+}
+
+// sampleEntryCodec returns the codec string for a sample entry, or empty if we
+// don't know it.
+func sampleEntryCodec(entryType mp4BoxType, entry []byte) string {
+	switch entryType {
+	case mp4Avc1, mp4Avc3:
+		// A visual sample entry has 78 bytes of fields before its boxes.
+		if len(entry) < 78 {
+			return ""
+		}
+		codec := ""
+		boxes := mp4Boxes{rest: entry[78:]}
+		for boxes.Next() {
+			if boxes.Type == mp4AvcC && len(boxes.Body) >= 4 {
+				// Profile, profile compatibility, and level.
+				codec = fmt.Sprintf("%s.%02x%02x%02x", entryType, boxes.Body[1],
+					boxes.Body[2], boxes.Body[3])
+			}
+		}
+		return codec
+	case mp4Mp4a:
+		// An audio sample entry has 28 bytes of fields before its boxes.
+		if len(entry) < 28 {
+			return ""
+		}
+		codec := ""
+		boxes := mp4Boxes{rest: entry[28:]}
+		for boxes.Next() {
+			if boxes.Type == mp4Esds && len(boxes.Body) > 4 {
+				codec = esdsCodec(boxes.Body[4:])
+			}
+		}
+		return codec
+	default:
+		return ""
+	}
+}
+
+// esdsCodec returns the codec string for the descriptors in an esds box. For
+// AAC this is mp4a.40 and the audio object type, such as mp4a.40.2 for AAC-LC.
+func esdsCodec(b []byte) string {
+	objectType := byte(0)
+	for len(b) > 0 {
+		tag := b[0]
+		b = b[1:]
+
+		// The size takes 1 to 4 bytes, 7 bits in each.
+		size := 0
+		for i := 0; i < 4 && len(b) > 0; i++ {
+			size = size<<7 | int(b[0]&0x7f)
+			more := b[0]&0x80 != 0
+			b = b[1:]
+			if !more {
+				break
+			}
+		}
+
+		switch tag {
+		case 0x03:
+			// ES descriptor. Skip the ES ID and flags. We assume no optional
+			// fields, which the muxer doesn't write. Its children follow.
+			if len(b) < 3 {
+				return ""
+			}
+			b = b[3:]
+			continue
+		case 0x04:
+			// Decoder config descriptor. Its children follow 13 bytes of fields.
+			if len(b) < 13 {
+				return ""
+			}
+			objectType = b[0]
+			b = b[13:]
+			continue
+		case 0x05:
+			// Decoder specific info. For AAC, the audio specific config. Its first
+			// 5 bits are the audio object type.
+			if objectType != 0x40 || len(b) < 1 || size < 1 {
+				break
+			}
+			return fmt.Sprintf("mp4a.40.%d", b[0]>>3)
+		}
+
+		if size > len(b) {
+			break
+		}
+		b = b[size:]
+	}
+
+	if objectType != 0 {
+		return fmt.Sprintf("mp4a.%02x", objectType)
+	}
+	return ""
+}
+
+// mvex holds a trex box per track.
+func parseMvex(mvex []byte, tracks []mp4Track) error {
+	boxes := mp4Boxes{rest: mvex}
+	for boxes.Next() {
+		if boxes.Type != mp4Trex {
+			continue
+		}
+		body := boxes.Body
+		if len(body) < 24 {
+			return fmt.Errorf("short trex box")
+		}
+
+		trackID := binary.BigEndian.Uint32(body[4:])
+		for i := range tracks {
+			if tracks[i].ID == trackID {
+				tracks[i].DefaultSampleDuration = binary.BigEndian.Uint32(body[12:])
+				tracks[i].DefaultSampleFlags = binary.BigEndian.Uint32(body[20:])
+			}
+		}
+	}
+	return boxes.Err
+}
+
+// parseFragment looks at the moof box of a fragment.
+//
+// We parse each fragment, so this must not allocate.
+func parseFragment(frag []byte, tracks []mp4Track) (fragmentInfo, error) {
+	info := fragmentInfo{}
+
+	boxes := mp4Boxes{rest: frag}
+	for boxes.Next() {
+		if boxes.Type != mp4Moof {
+			continue
+		}
+
+		moof := mp4Boxes{rest: boxes.Body}
+		for moof.Next() {
+			if moof.Type != mp4Traf {
+				continue
+			}
+
+			traf, err := parseTraf(moof.Body, tracks)
+			if err != nil {
+				return info, err
+			}
+
+			if traf.Track != nil && traf.Track.Handler == "vide" {
+				info.Keyframe = traf.FirstFlags&mp4SampleIsNonSync == 0
+				info.DecodeTime = ticksToDuration(traf.DecodeTime,
+					traf.Track.Timescale)
+				info.Duration = ticksToDuration(traf.Duration, traf.Track.Timescale)
+			}
+		}
+		if moof.Err != nil {
+			return info, moof.Err
+		}
+	}
+
+	return info, boxes.Err
+}
+
+func ticksToDuration(ticks uint64, timescale uint32) time.Duration {
+	if timescale == 0 {
+		return 0
+	}
+	seconds := ticks / uint64(timescale)
+	rest := ticks % uint64(timescale)
+	return time.Duration(seconds)*time.Second +
+		time.Duration(rest*uint64(time.Second)/uint64(timescale))
+}
+
+// parseTraf finds the track a traf box is for, the flags of its first sample,
+// and its samples' decode time and duration.
+func parseTraf(traf []byte, tracks []mp4Track) (trafInfo, error) {
+	info := trafInfo{}
+	var defaultFlags, defaultDuration uint32
+	haveDefaultFlags, haveDefaultDuration, haveFirstFlags := false, false, false
+
+	boxes := mp4Boxes{rest: traf}
+	for boxes.Next() {
+		boxType, body := boxes.Type, boxes.Body
+		if boxType != mp4Tfhd && boxType != mp4Trun && boxType != mp4Tfdt {
+			continue
+		}
+		if len(body) < 8 {
+			return trafInfo{}, fmt.Errorf("short %s box", boxType)
+		}
+		boxFlags := binary.BigEndian.Uint32(body[0:4]) & 0xffffff
+
+		switch boxType {
+		case mp4Tfhd:
+			trackID := binary.BigEndian.Uint32(body[4:])
+			for i := range tracks {
+				if tracks[i].ID == trackID {
+					info.Track = &tracks[i]
+				}
+			}
+
+			// Skip base data offset and sample description index if present.
+			offset := 8
+			if boxFlags&0x1 != 0 {
+				offset += 8
+			}
+			if boxFlags&0x2 != 0 {
+				offset += 4
+			}
+
+			if boxFlags&0x8 != 0 {
+				if len(body) < offset+4 {
+					return trafInfo{}, fmt.Errorf("short tfhd box")
+				}
+				defaultDuration = binary.BigEndian.Uint32(body[offset:])
+				haveDefaultDuration = true
+				offset += 4
+			}
+
+			// Skip default sample size.
+			if boxFlags&0x10 != 0 {
+				offset += 4
+			}
+
+			if boxFlags&0x20 != 0 {
+				if len(body) < offset+4 {
+					return trafInfo{}, fmt.Errorf("short tfhd box")
+				}
+				defaultFlags = binary.BigEndian.Uint32(body[offset:])
+				haveDefaultFlags = true
+			}
+		case mp4Tfdt:
+			// Version 1 has a 64-bit decode time.
+			if body[0] == 1 {
+				if len(body) < 12 {
+					return trafInfo{}, fmt.Errorf("short tfdt box")
+				}
+				info.DecodeTime = binary.BigEndian.Uint64(body[4:])
+			} else {
+				info.DecodeTime = uint64(binary.BigEndian.Uint32(body[4:]))
+			}
+		case mp4Trun:
+			// tfhd comes before trun, so we know the defaults by now.
+			if !haveDefaultDuration && info.Track != nil {
+				defaultDuration = info.Track.DefaultSampleDuration
+			}
+			if err := parseTrun(body, boxFlags, defaultDuration, &info,
+				&haveFirstFlags); err != nil {
+				return trafInfo{}, err
+			}
+		}
+	}
+	if boxes.Err != nil {
+		return trafInfo{}, boxes.Err
+	}
+
+	if !haveFirstFlags {
+		if haveDefaultFlags {
+			info.FirstFlags = defaultFlags
+		} else if info.Track != nil {
+			info.FirstFlags = info.Track.DefaultSampleFlags
+		}
+	}
+	return info, nil
+}
+
+// parseTrun adds the trun box's samples' durations to info. If we don't have
+// the first sample's flags yet, it also sets those if the box has them.
+func parseTrun(body []byte, boxFlags, defaultDuration uint32, info *trafInfo,
+	haveFirstFlags *bool) error {
+	sampleCount := binary.BigEndian.Uint32(body[4:])
+
+	// Skip the data offset if present.
+	offset := 8
+	if boxFlags&0x1 != 0 {
+		offset += 4
+	}
+
+	if boxFlags&0x4 != 0 {
+		// First sample flags.
+		if len(body) < offset+4 {
+			return fmt.Errorf("short trun box")
+		}
+		if !*haveFirstFlags {
+			info.FirstFlags = binary.BigEndian.Uint32(body[offset:])
+			*haveFirstFlags = true
+		}
+		offset += 4
+	}
+
+	// Each sample may have a duration, size, flags, and composition time
+	// offset.
+	sampleSize := 0
+	for _, flag := range []uint32{0x100, 0x200, 0x400, 0x800} {
+		if boxFlags&flag != 0 {
+			sampleSize += 4
+		}
+	}
+	if uint64(len(body)-offset) < uint64(sampleCount)*uint64(sampleSize) {
+		return fmt.Errorf("short trun box")
+	}
+
+	for i := uint32(0); i < sampleCount; i++ {
+		sample := body[offset : offset+sampleSize]
+		offset += sampleSize
+
+		field := 0
+		if boxFlags&0x100 != 0 {
+			info.Duration += uint64(binary.BigEndian.Uint32(sample[field:]))
+			field += 4
+		} else {
+			info.Duration += uint64(defaultDuration)
+		}
+
+		if boxFlags&0x200 != 0 {
+			field += 4
+		}
+
+		if boxFlags&0x400 != 0 && !*haveFirstFlags {
+			info.FirstFlags = binary.BigEndian.Uint32(sample[field:])
+			*haveFirstFlags = true
+		}
+	}
+
+	return nil
+}
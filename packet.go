@@ -0,0 +1,116 @@
+package main
+
+import (
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// #include "videostreamer.h"
+import "C"
+
+// SharedPacket is a packet read from an input. We pass the same packet to each
+// of its consumers rather than copying it. Consumers must not change it.
+//
+// Each consumer holds a reference. When the last one releases it, we unref the
+// packet's data and return the shell to its pool.
+type SharedPacket struct {
+	Packet *C.AVPacket
+
+	// When we read the packet, if we're tracing. See Tracer.
+	ReadAt time.Time
+
+	refs int32
+	pool *PacketPool
+}
+
+// PacketPool holds AVPacket shells so that reading a packet does not need to
+// allocate one.
+type PacketPool struct {
+	mutex  *sync.Mutex
+	free   []*SharedPacket
+	closed bool
+}
+
+func newPacketPool(size int) *PacketPool {
+	pool := &PacketPool{
+		mutex: &sync.Mutex{},
+	}
+
+	for i := 0; i < size; i++ {
+		pkt := C.av_packet_alloc()
+		if pkt == nil {
+			break
+		}
+		pool.free = append(pool.free, &SharedPacket{Packet: pkt, pool: pool})
+	}
+
+	return pool
+}
+
+// Get returns an empty packet holding one reference. If the pool is empty, we
+// allocate a new one. It joins the pool when released.
+//
+// It returns nil if we can't allocate a packet.
+func (p *PacketPool) Get() *SharedPacket {
+	p.mutex.Lock()
+	var pkt *SharedPacket
+	if len(p.free) > 0 {
+		pkt = p.free[len(p.free)-1]
+		p.free = p.free[:len(p.free)-1]
+	}
+	p.mutex.Unlock()
+
+	if pkt == nil {
+		avPacket := C.av_packet_alloc()
+		if avPacket == nil {
+			return nil
+		}
+		pkt = &SharedPacket{Packet: avPacket, pool: p}
+	}
+
+	pkt.refs = 1
+	pkt.ReadAt = time.Time{}
+	return pkt
+}
+
+// Close frees the packets in the pool. Packets released after this are freed
+// rather than returned.
+func (p *PacketPool) Close() {
+	p.mutex.Lock()
+	defer p.mutex.Unlock()
+
+	for _, pkt := range p.free {
+		C.av_packet_free(&pkt.Packet)
+	}
+	p.free = nil
+	p.closed = true
+}
+
+func (p *PacketPool) put(pkt *SharedPacket) {
+	p.mutex.Lock()
+	defer p.mutex.Unlock()
+
+	if p.closed {
+		C.av_packet_free(&pkt.Packet)
+		return
+	}
+
+	p.free = append(p.free, pkt)
+}
+
+// Ref takes another reference to the packet for another consumer.
+func (p *SharedPacket) Ref() *SharedPacket {
+	atomic.AddInt32(&p.refs, 1)
+	return p
+}
+
+// Release drops a reference. The packet must not be used after.
+func (p *SharedPacket) Release() {
+	if atomic.AddInt32(&p.refs, -1) != 0 {
+		return
+	}
+
+	C.av_packet_unref(p.Packet)
+	p.pool.put(p)
+}
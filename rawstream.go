@@ -0,0 +1,113 @@
+package main
+
+import (
+	"bufio"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"net"
+	"net/http"
+	"time"
+)
+
+// RawStream is a streaming HTTP response that we write to the connection
+// ourselves rather than through the http.ResponseWriter.
+//
+// The ResponseWriter copies what we write into its buffer, chunk encodes it,
+// and needs a flush of its own, so each fragment costs several writes. We
+// instead write fragments straight from the ring, and write all those ready
+// at once with one writev. The response has no length and no chunking. It
+// ends when we close the connection.
+type RawStream struct {
+	conn net.Conn
+
+	// Reused for each write. Writing consumes pending, so we keep the slice in
+	// bufs too.
+	bufs    net.Buffers
+	pending net.Buffers
+
+	// Closed once the client closes the connection or reading from it fails.
+	done chan struct{}
+}
+
+// How long a write to a client may take before we give up on it.
+const clientWriteTimeout = 30 * time.Second
+
+// startRawStream takes over the connection and sends the response header,
+// with the headers set in rw.Header(). It returns nil if the connection can't
+// be taken over (such as with FastCGI), in which case the caller should
+// respond through rw as usual.
+func startRawStream(rw http.ResponseWriter,
+	r *http.Request) (*RawStream, error) {
+	header := rw.Header()
+	hijacker, ok := rw.(http.Hijacker)
+	if !ok || r.ProtoMajor != 1 {
+		return nil, nil
+	}
+
+	conn, bufrw, err := hijacker.Hijack()
+	if err != nil {
+		return nil, nil
+	}
+
+	s := &RawStream{conn: conn, done: make(chan struct{})}
+
+	// Nothing else writes to the connection, so bufrw's writer is empty and we
+	// can bypass it from here on.
+	_ = conn.SetWriteDeadline(time.Now().Add(clientWriteTimeout))
+	_, err = bufrw.WriteString("HTTP/1.1 200 OK\r\n")
+	if err == nil {
+		err = header.Write(bufrw)
+	}
+	if err == nil {
+		_, err = bufrw.WriteString("Connection: close\r\n\r\n")
+	}
+	if err == nil {
+		err = bufrw.Flush()
+	}
+	if err != nil {
+		_ = conn.Close()
+		return nil, fmt.Errorf("unable to write response header: %s", err)
+	}
+
+	go s.readLoop(bufrw.Reader)
+
+	return s, nil
+}
+
+// Read from the client until it closes the connection or reading fails.
+//
+// The client has nothing more to send us. We read only to notice it going
+// away, as we've taken over the connection from the server, which would
+// otherwise do this for us. r is the connection's reader, which may hold some
+// of what the client sent already.
+func (s *RawStream) readLoop(r *bufio.Reader) {
+	defer close(s.done)
+	_, _ = io.Copy(ioutil.Discard, r)
+}
+
+// Done returns a channel closed once the client is gone.
+func (s *RawStream) Done() <-chan struct{} {
+	return s.done
+}
+
+// Write writes the data in order, in one writev where the kernel takes it
+// all at once.
+func (s *RawStream) Write(data ...[]byte) error {
+	s.bufs = append(s.bufs[:0], data...)
+	s.pending = s.bufs
+
+	_ = s.conn.SetWriteDeadline(time.Now().Add(clientWriteTimeout))
+	_, err := s.pending.WriteTo(s.conn)
+
+	// Don't keep fragments the ring may reuse.
+	for i := range s.bufs {
+		s.bufs[i] = nil
+	}
+	return err
+}
+
+// Close closes the connection, ending the response.
+func (s *RawStream) Close() {
+	_ = s.conn.Close()
+}
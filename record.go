@@ -0,0 +1,200 @@
+package main
+
+import (
+	"bufio"
+	"fmt"
+	"log"
+	"math"
+	"os"
+	"path/filepath"
+	"time"
+)
+
+// Recorder records an input to files while we stream it.
+//
+// It is a client of the input's pipeline like any other, so recording shares
+// the one connection to the input and the one muxer. It writes the init
+// segment and then the fragments from the ring, the same bytes viewers
+// receive. Each file starts with the init segment and a keyframe, so each is
+// a fragmented MP4 that plays by itself. We start a new file at a keyframe
+// once the current one is long or large enough.
+//
+// Writing to disk happens on the recorder's own goroutine. If it falls
+// behind, the ring skips it ahead like any client. It never holds up the
+// encoder or viewers.
+type Recorder struct {
+	streams *Streams
+	config  InputConfig
+	verbose bool
+
+	// The file we are writing, and how much it holds.
+	fh       *os.File
+	writer   *bufio.Writer
+	duration time.Duration
+	size     int
+}
+
+// How much we buffer before writing to a recording file. We write in large
+// pieces rather than a fragment at a time.
+const recordBufferSize = 4 * 1024 * 1024
+
+// How long a recording file lasts by default.
+const recordDefaultDuration = 10 * time.Minute
+
+// How long we wait before rejoining the input's pipeline if it ends.
+const recordRetryDelay = 5 * time.Second
+
+func newRecorder(streams *Streams, config InputConfig,
+	verbose bool) *Recorder {
+	return &Recorder{
+		streams: streams,
+		config:  config,
+		verbose: verbose,
+	}
+}
+
+// Run records the input for as long as we run. If its pipeline ends, such as
+// when the input fails, we start it again.
+func (rec *Recorder) Run() {
+	for {
+		c := &Client{
+			RingChan: make(chan *FragmentRing, 1),
+			Done:     make(chan struct{}),
+		}
+
+		if !rec.streams.Join(rec.config.Name, c) {
+			log.Printf("recorder %s: Unknown input", rec.config.Name)
+			return
+		}
+
+		if ring, ok := <-c.RingChan; ok {
+			if err := rec.record(ring); err != nil {
+				log.Printf("recorder %s: %s", rec.config.Name, err)
+			}
+		}
+
+		if err := rec.closeFile(); err != nil {
+			log.Printf("recorder %s: %s", rec.config.Name, err)
+		}
+
+		close(c.Done)
+		time.Sleep(recordRetryDelay)
+	}
+}
+
+// Write the ring's output to files until it ends.
+func (rec *Recorder) record(ring *FragmentRing) error {
+	initSegment, err := ring.InitSegment()
+	if err != nil {
+		return err
+	}
+
+	// We don't want to lose any video, so never skip ahead unless we have to.
+	reader := ring.NewReader(math.MaxUint64, math.MaxInt32)
+	var frags []*Fragment
+
+	for {
+		skips := reader.Skips()
+		frags, err = reader.Read(frags[:0])
+		if err != nil {
+			return err
+		}
+
+		if reader.Skips() > skips {
+			log.Printf("recorder %s: Behind, skipped ahead to keyframe",
+				rec.config.Name)
+		}
+
+		err = rec.writeFragments(frags, initSegment)
+		releaseFragments(frags)
+		if err != nil {
+			return err
+		}
+	}
+}
+
+// Write the fragments to the current file, starting a new one at a keyframe
+// if need be.
+func (rec *Recorder) writeFragments(frags []*Fragment,
+	initSegment []byte) error {
+	for _, frag := range frags {
+		if frag.Keyframe && (rec.fh == nil || rec.full()) {
+			if err := rec.closeFile(); err != nil {
+				return err
+			}
+			if err := rec.openFile(initSegment); err != nil {
+				return err
+			}
+		}
+
+		// Files start with a keyframe.
+		if rec.fh == nil {
+			continue
+		}
+
+		if _, err := rec.writer.Write(frag.Data); err != nil {
+			return fmt.Errorf("error writing to %s: %s", rec.fh.Name(), err)
+		}
+		rec.duration += frag.Duration
+		rec.size += len(frag.Data)
+	}
+	return nil
+}
+
+// Whether the current file is long or large enough that we should start a
+// new one.
+func (rec *Recorder) full() bool {
+	if rec.duration >= rec.config.recordDuration() {
+		return true
+	}
+	return rec.config.RecordSize > 0 && rec.size >= rec.config.RecordSize
+}
+
+// Start a new file, named for the input and the time.
+func (rec *Recorder) openFile(initSegment []byte) error {
+	name := filepath.Join(rec.config.Record, fmt.Sprintf("%s-%s.mp4",
+		rec.config.Name, time.Now().Format("20060102-150405.000")))
+
+	fh, err := os.OpenFile(name, os.O_WRONLY|os.O_CREATE|os.O_EXCL, 0644)
+	if err != nil {
+		return err
+	}
+
+	rec.fh = fh
+	rec.writer = bufio.NewWriterSize(fh, recordBufferSize)
+	rec.duration = 0
+	rec.size = 0
+
+	if _, err := rec.writer.Write(initSegment); err != nil {
+		return fmt.Errorf("error writing to %s: %s", name, err)
+	}
+
+	log.Printf("recorder %s: Recording to %s", rec.config.Name, name)
+	return nil
+}
+
+// Finish the current file, if we have one.
+func (rec *Recorder) closeFile() error {
+	if rec.fh == nil {
+		return nil
+	}
+
+	fh := rec.fh
+	rec.fh = nil
+
+	if err := rec.writer.Flush(); err != nil {
+		_ = fh.Close()
+		return fmt.Errorf("error writing to %s: %s", fh.Name(), err)
+	}
+	rec.writer = nil
+
+	if err := fh.Close(); err != nil {
+		return fmt.Errorf("error closing %s: %s", fh.Name(), err)
+	}
+
+	if rec.verbose {
+		log.Printf("recorder %s: Finished %s (%s, %d bytes)", rec.config.Name,
+			fh.Name(), rec.duration, rec.size)
+	}
+	return nil
+}
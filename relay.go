@@ -0,0 +1,384 @@
+package main
+
+import (
+	"context"
+	"fmt"
+	"io"
+	"log"
+	"net/http"
+	"net/url"
+	"time"
+)
+
+// Relay reads another videostreamer's /stream of an input and serves it as
+// one of ours. This lets edge nodes serve viewers of an input while only the
+// origin connects to the camera, and edges may relay from other edges in
+// turn.
+//
+// The origin sends the same bytes it sends any client: the init segment, and
+// then fragments starting with its most recent GOP. We split them into the
+// ring with a Fragmenter as if our own muxer had written them, so we neither
+// demux nor mux. Everything that reads from the ring works as for any input:
+// /stream, WebSockets, HLS and DASH, the DVR, and recording. Renditions and
+// snapshots need the input's packets, which we don't have.
+//
+// If the connection to the origin fails, we reconnect with backoff and clients
+// stay connected. The origin sends each stream's ring epoch. If it is the same
+// when we reconnect, the origin's output carried on meanwhile, so we carry on
+// too, dropping the fragments it sends that we already have. If not, the
+// origin's pipeline started over, and so do we.
+type Relay struct {
+	config  InputConfig
+	metrics *InputMetrics
+
+	ring *FragmentRing
+
+	// The origin's epoch for the stream we're filling the ring from.
+	epoch string
+
+	// Reading from the origin happens on its own goroutine, while the relay
+	// looks after clients. cancel ends the request. The goroutine closes done
+	// when it ends, after setting err.
+	cancel context.CancelFunc
+	done   chan struct{}
+	err    error
+}
+
+// The format that makes an input a relay. Its URL is the origin's stream,
+// such as http://origin:8080/stream/front-door.
+const relayFormat = "relay"
+
+// The response header the origin sends its ring's epoch in.
+const relayEpochHeader = "X-Videostreamer-Epoch"
+
+// How much we read from the origin at once.
+const relayReadSize = 64 * 1024
+
+// How often we look after clients while reading.
+const relayPollInterval = 100 * time.Millisecond
+
+// errOriginChanged means the origin's stream started over, so we can't carry
+// on from where we were.
+var errOriginChanged = fmt.Errorf("origin stream changed")
+
+// isRelay returns whether the input is another videostreamer's stream.
+func (c InputConfig) isRelay() bool {
+	return c.Format == relayFormat
+}
+
+// validRelayURL returns whether the URL is one we can relay from.
+func validRelayURL(s string) bool {
+	u, err := url.Parse(s)
+	if err != nil {
+		return false
+	}
+	return (u.Scheme == "http" || u.Scheme == "https") && u.Host != ""
+}
+
+// relay runs a relay input's pipeline, in place of encoder(). It manages
+// clients in the same way.
+func relay(config InputConfig, verbose bool, clientChan <-chan *Client) {
+	clients := []*Client{}
+	var r *Relay
+
+	// When the last client left. We close the relay once it has been idle for
+	// the linger time.
+	var idleSince time.Time
+
+	ticker := time.NewTicker(relayPollInterval)
+	defer ticker.Stop()
+
+	for {
+		if len(clients) == 0 && r == nil && !config.AlwaysOn {
+			log.Printf("relay %s: Waiting for clients...", config.Name)
+			client := <-clientChan
+			log.Printf("relay %s: New client", config.Name)
+			clients = append(clients, client)
+			continue
+		}
+
+		clientCountBefore := len(clients)
+		clients = acceptClients(clientChan, clients)
+		clients = removeDoneClients(clients)
+		clientCountAfter := len(clients)
+
+		if clientCountBefore != clientCountAfter {
+			log.Printf("relay %s: %d clients", config.Name, clientCountAfter)
+		}
+
+		if len(clients) == 0 && r != nil && !config.AlwaysOn {
+			if idleSince.IsZero() {
+				idleSince = time.Now()
+			}
+
+			if time.Since(idleSince) >= time.Duration(*config.Linger) {
+				r.close()
+				r = nil
+				idleSince = time.Time{}
+				log.Printf("relay %s: Closed connection to origin", config.Name)
+				continue
+			}
+		} else {
+			idleSince = time.Time{}
+		}
+
+		if r == nil {
+			r, clients = openRelayRetrying(config, clientChan, clients)
+			if r == nil {
+				log.Printf("relay %s: No clients left, giving up connecting to origin",
+					config.Name)
+				cleanupClients(clients)
+				return
+			}
+
+			if verbose {
+				log.Printf("relay %s: Connected to origin", config.Name)
+			}
+		}
+
+		attachClients(clients, r.ring, nil)
+
+		select {
+		case client := <-clientChan:
+			clients = append(clients, client)
+		case <-ticker.C:
+		case <-r.done:
+			log.Printf("relay %s: Failure reading from origin: %s", config.Name,
+				r.err)
+
+			var err error
+			clients, err = r.reconnect(clientChan, clients)
+			if err != nil {
+				log.Printf("relay %s: Unable to reconnect: %s", config.Name, err)
+				r.close()
+				r = nil
+				cleanupClients(clients)
+				clients = nil
+				continue
+			}
+
+			log.Printf("relay %s: Reconnected", config.Name)
+		}
+	}
+}
+
+// Connect to the origin, retrying with backoff while the input is wanted, as
+// openInputRetrying() does for other inputs.
+//
+// We return nil once no one wants the input.
+func openRelayRetrying(config InputConfig, clientChan <-chan *Client,
+	clients []*Client) (*Relay, []*Client) {
+	backoff := reconnectMinBackoff
+	for {
+		r, err := openRelay(config)
+		if err == nil {
+			return r, clients
+		}
+		log.Printf("relay %s: Unable to connect to origin: %s", config.Name, err)
+
+		log.Printf("relay %s: Connecting in %s", config.Name, backoff)
+		clients = waitForRetry(clientChan, clients, backoff)
+
+		clients = removeDoneClients(clients)
+		if len(clients) == 0 && !config.AlwaysOn {
+			return nil, clients
+		}
+
+		backoff *= 2
+		if backoff > reconnectMaxBackoff {
+			backoff = reconnectMaxBackoff
+		}
+	}
+}
+
+// Connect to the origin and start filling a new ring from it.
+func openRelay(config InputConfig) (*Relay, error) {
+	metrics := metricsFor(config.Name)
+
+	var dvr *DVR
+	if config.hasDVR() {
+		var err error
+		dvr, err = newDVR(time.Duration(*config.DVR), config.dvrSize(),
+			config.DVRFile)
+		if err != nil {
+			return nil, fmt.Errorf("unable to create DVR: %s", err)
+		}
+	}
+
+	r := &Relay{
+		config:  config,
+		metrics: metrics,
+		ring:    newFragmentRing(config.ringSize(), dvr),
+	}
+
+	if err := r.connect(false); err != nil {
+		metrics.OpenFailures.Inc()
+		r.close()
+		return nil, err
+	}
+
+	return r, nil
+}
+
+// Request the stream from the origin, and start reading it into the ring.
+//
+// If resume is set, the ring already holds some of the origin's stream. We
+// carry on from its most recent fragment if the origin's stream is the same
+// one, and fail with errOriginChanged if not.
+func (r *Relay) connect(resume bool) error {
+	defer r.metrics.OpenTime.ObserveDuration(time.Now())
+
+	req, err := http.NewRequest("GET", r.config.URL, nil)
+	if err != nil {
+		return err
+	}
+
+	ctx, cancel := context.WithCancel(context.Background())
+	req = req.WithContext(ctx)
+
+	// Like reading from any input, waiting for the origin may block at most the
+	// read timeout. We start over the wait after each read.
+	timeout := time.Duration(*r.config.ReadTimeout)
+	var timer *time.Timer
+	if timeout > 0 {
+		timer = time.AfterFunc(timeout, cancel)
+	}
+
+	resp, err := http.DefaultClient.Do(req)
+	if err != nil {
+		cancel()
+		return err
+	}
+
+	if resp.StatusCode != http.StatusOK {
+		_ = resp.Body.Close()
+		cancel()
+		return fmt.Errorf("origin responded %s", resp.Status)
+	}
+
+	fragmenter := newFragmenter(r.ring, r.metrics)
+	fragmenter.tracing = r.config.Trace
+
+	epoch := resp.Header.Get(relayEpochHeader)
+	if resume {
+		if epoch == "" || epoch != r.epoch {
+			_ = resp.Body.Close()
+			cancel()
+			return errOriginChanged
+		}
+		fragmenter.skipThrough, fragmenter.skipping = r.ring.LastDecodeTime()
+	}
+
+	r.epoch = epoch
+	r.cancel = cancel
+	r.done = make(chan struct{})
+	r.err = nil
+
+	go r.read(resp.Body, fragmenter, timer, timeout)
+
+	return nil
+}
+
+// Read the origin's stream into the fragmenter until it ends or fails.
+func (r *Relay) read(body io.ReadCloser, fragmenter *Fragmenter,
+	timer *time.Timer, timeout time.Duration) {
+	defer close(r.done)
+	defer func() {
+		_ = body.Close()
+		if timer != nil {
+			timer.Stop()
+		}
+	}()
+
+	buf := make([]byte, relayReadSize)
+	for {
+		n, err := body.Read(buf)
+		if timer != nil {
+			timer.Reset(timeout)
+		}
+
+		if n > 0 {
+			r.metrics.BytesRead.Add(uint64(n))
+			if err := fragmenter.Write(buf[:n]); err != nil {
+				r.err = fmt.Errorf("unable to split stream: %s", err)
+				return
+			}
+		}
+
+		if err == io.EOF {
+			r.err = fmt.Errorf("origin ended the stream")
+			return
+		}
+		if err != nil {
+			r.err = err
+			return
+		}
+	}
+}
+
+// Connect to the origin again after reading from it failed.
+//
+// We keep the ring, so clients stay connected. We retry with backoff,
+// accepting clients meanwhile. We give up if no clients remain (unless the
+// input is always on), or if the origin's stream started over.
+func (r *Relay) reconnect(clientChan <-chan *Client,
+	clients []*Client) ([]*Client, error) {
+	// Release the failed request.
+	r.cancel()
+
+	start := time.Now()
+	backoff := reconnectMinBackoff
+	for {
+		log.Printf("relay %s: Reconnecting in %s", r.config.Name, backoff)
+
+		timer := time.NewTimer(backoff)
+	Wait:
+		for {
+			select {
+			case client := <-clientChan:
+				clients = append(clients, client)
+				attachClients(clients, r.ring, nil)
+			case <-timer.C:
+				break Wait
+			}
+		}
+
+		clients = removeDoneClients(clients)
+		if len(clients) == 0 && !r.config.AlwaysOn {
+			return clients, fmt.Errorf("no clients")
+		}
+
+		if err := r.connect(true); err != nil {
+			if err == errOriginChanged {
+				return clients, err
+			}
+			log.Printf("relay %s: Unable to connect to origin: %s", r.config.Name,
+				err)
+			r.metrics.OpenFailures.Inc()
+			backoff *= 2
+			if backoff > reconnectMaxBackoff {
+				backoff = reconnectMaxBackoff
+			}
+			continue
+		}
+
+		r.metrics.Reconnects.Inc()
+		r.metrics.ReconnectTime.ObserveDuration(start)
+		return clients, nil
+	}
+}
+
+// Stop reading from the origin, and close the ring. Clients receive no more
+// fragments.
+func (r *Relay) close() {
+	if r.cancel != nil {
+		r.cancel()
+		<-r.done
+		r.cancel = nil
+	}
+
+	r.ring.Close()
+	if dvr := r.ring.DVR(); dvr != nil {
+		dvr.Close()
+	}
+}
@@ -0,0 +1,517 @@
+package main
+
+import (
+	"fmt"
+	"log"
+	"math"
+	"net/http"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+)
+
+// SegmentServer serves inputs as HLS (with LL-HLS parts) and DASH.
+//
+// Both use the segments in an input's ring (see Segment). We serve a playlist
+// or manifest listing them, the init segment, and the segments and parts
+// themselves. Every viewer fetches the same bytes, so a CDN or HTTP cache in
+// front of us can serve any number of viewers from one connection to us.
+//
+// Segment URLs include the ring's epoch. If the input restarts, its sequence
+// numbers start over, but its URLs differ, so caches don't serve old media.
+type SegmentServer struct {
+	Streams *Streams
+
+	// We count what we send toward the egress limit, and turn segment and part
+	// requests away while we're at it.
+	Admission *Admission
+
+	mutex    *sync.Mutex
+	sessions map[string]*segmentSession
+}
+
+// segmentSession keeps an input's pipeline running for segment viewers. These
+// viewers don't hold a connection open, so we hold a client open for them
+// until no requests have come for a while.
+type segmentSession struct {
+	client *Client
+
+	// Closed once we have the ring (or know we can't get it).
+	ready chan struct{}
+	ring  *FragmentRing
+
+	// Only access these with the server's mutex held.
+	lastRequest time.Time
+
+	// We never make these smaller. Players don't expect them to change.
+	targetDuration int
+	partTarget     time.Duration
+}
+
+// How long we keep a session without requests.
+const segmentSessionIdle = 30 * time.Second
+
+// How long we hold a request for a segment or part that doesn't exist yet,
+// at most.
+const segmentWait = 10 * time.Second
+
+// How many segments at the end of the playlist we list parts for.
+const partSegments = 3
+
+func newSegmentServer(streams *Streams, admission *Admission) *SegmentServer {
+	s := &SegmentServer{
+		Streams:   streams,
+		Admission: admission,
+		mutex:     &sync.Mutex{},
+		sessions:  map[string]*segmentSession{},
+	}
+
+	go s.expireSessions()
+
+	return s
+}
+
+// Serve handles a request under /hls/ or /dash/. rest is the path after that
+// prefix.
+func (s *SegmentServer) Serve(rw http.ResponseWriter, r *http.Request,
+	dash bool, rest string) {
+	pieces := strings.Split(rest, "/")
+
+	name := pieces[0]
+	config, ok := s.Streams.Config(name)
+	if !ok {
+		notFound(rw)
+		return
+	}
+
+	m := metricsFor(name)
+	rw = s.Admission.CountSent(rw, m)
+
+	// Segments and parts are most of what we send segment viewers. Players
+	// retry them, so while we're at the egress limit we ask them to wait. We
+	// still serve playlists, manifests, and init segments, which are small.
+	if len(pieces) == 3 && pieces[2] != "init.mp4" {
+		if err := s.Admission.AdmitRequest(); err != nil {
+			log.Printf("%s: Turning segment request away: %s", r.RemoteAddr, err)
+			m.ClientsRejected.Inc()
+			retryLater(rw)
+			return
+		}
+	}
+
+	session, ok := s.session(name)
+	if !ok {
+		log.Printf("%s: No output available for %s", r.RemoteAddr, name)
+		unavailable(rw)
+		return
+	}
+
+	if len(pieces) == 2 && !dash && pieces[1] == "index.m3u8" {
+		s.servePlaylist(rw, r, session, config.lowLatency())
+		return
+	}
+
+	if len(pieces) == 2 && dash && pieces[1] == "manifest.mpd" {
+		s.serveManifest(rw, session)
+		return
+	}
+
+	if len(pieces) == 3 && pieces[1] == session.ring.Epoch() {
+		serveMedia(rw, session.ring, pieces[2])
+		return
+	}
+
+	notFound(rw)
+}
+
+// session returns the session for the input, starting one if there is none.
+func (s *SegmentServer) session(name string) (*segmentSession, bool) {
+	s.mutex.Lock()
+	session, ok := s.sessions[name]
+	if ok {
+		select {
+		case <-session.ready:
+			if session.ring == nil || session.ring.Closed() {
+				// The pipeline ended. Start over.
+				close(session.client.Done)
+				delete(s.sessions, name)
+				ok = false
+			}
+		default:
+		}
+	}
+
+	if !ok {
+		session = &segmentSession{
+			client: &Client{
+				RingChan: make(chan *FragmentRing, 1),
+				Done:     make(chan struct{}),
+			},
+			ready: make(chan struct{}),
+		}
+		s.sessions[name] = session
+
+		go func() {
+			if s.Streams.Join(name, session.client) {
+				session.ring = <-session.client.RingChan
+			}
+			close(session.ready)
+		}()
+	}
+
+	session.lastRequest = time.Now()
+	s.mutex.Unlock()
+
+	// The input may be failing to open. Its encoder keeps trying while the
+	// session lasts, but we don't hold the request that long.
+	timer := time.NewTimer(segmentWait)
+	defer timer.Stop()
+	select {
+	case <-session.ready:
+		return session, session.ring != nil
+	case <-timer.C:
+		return nil, false
+	}
+}
+
+// Hold keeps the input's pipeline running as if it had a segment viewer, until
+// no requests have come for a while. Other kinds of polling clients use this
+// too (see snapshotRequest()). It returns false if the input has no output.
+func (s *SegmentServer) Hold(name string) bool {
+	_, ok := s.session(name)
+	return ok
+}
+
+// Drop sessions that have had no requests for a while. Their pipelines stop
+// once they have no other clients.
+func (s *SegmentServer) expireSessions() {
+	for range time.Tick(segmentSessionIdle / 2) {
+		s.mutex.Lock()
+		for name, session := range s.sessions {
+			// This includes sessions still waiting for the input to open. Once
+			// no one asks for it, the encoder stops trying.
+			if time.Since(session.lastRequest) < segmentSessionIdle {
+				continue
+			}
+
+			close(session.client.Done)
+			delete(s.sessions, name)
+		}
+		s.mutex.Unlock()
+	}
+}
+
+// The playlist is a media playlist for the one rendition we have.
+//
+// For LL-HLS we list each segment's parts and support blocking playlist
+// reload: with _HLS_msn (and _HLS_part), we hold the request until the
+// playlist would have that segment (or part).
+func (s *SegmentServer) servePlaylist(rw http.ResponseWriter, r *http.Request,
+	session *segmentSession, lowLatency bool) {
+	ring := session.ring
+
+	if lowLatency && r.URL.Query().Get("_HLS_msn") != "" {
+		msn, err := strconv.ParseUint(r.URL.Query().Get("_HLS_msn"), 10, 64)
+		if err != nil {
+			badRequest(rw)
+			return
+		}
+
+		part := -1
+		if r.URL.Query().Get("_HLS_part") != "" {
+			part, err = strconv.Atoi(r.URL.Query().Get("_HLS_part"))
+			if err != nil || part < 0 {
+				badRequest(rw)
+				return
+			}
+		}
+
+		_ = ring.WaitForSegment(msn, part, segmentWait)
+	}
+
+	segments := waitForSegments(ring, lowLatency)
+	if segments == nil {
+		unavailable(rw)
+		return
+	}
+	defer releaseSegments(segments)
+
+	s.mutex.Lock()
+	for _, segment := range segments {
+		if !segment.Complete {
+			continue
+		}
+		target := int(math.Round(segment.Duration().Seconds()))
+		if target > session.targetDuration {
+			session.targetDuration = target
+		}
+	}
+	if session.targetDuration < 1 {
+		session.targetDuration = 1
+	}
+	for _, segment := range segments {
+		for _, frag := range segment.Fragments {
+			if frag.Duration > session.partTarget {
+				session.partTarget = frag.Duration
+			}
+		}
+	}
+	targetDuration, partTarget := session.targetDuration, session.partTarget
+	s.mutex.Unlock()
+
+	epoch := ring.Epoch()
+
+	b := &strings.Builder{}
+	b.WriteString("#EXTM3U\n")
+	if lowLatency {
+		b.WriteString("#EXT-X-VERSION:9\n")
+	} else {
+		b.WriteString("#EXT-X-VERSION:7\n")
+	}
+	fmt.Fprintf(b, "#EXT-X-TARGETDURATION:%d\n", targetDuration)
+	fmt.Fprintf(b, "#EXT-X-MEDIA-SEQUENCE:%d\n", segments[0].Seq)
+	if lowLatency {
+		fmt.Fprintf(b,
+			"#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=%.3f\n",
+			3*partTarget.Seconds())
+		fmt.Fprintf(b, "#EXT-X-PART-INF:PART-TARGET=%.3f\n", partTarget.Seconds())
+	}
+	fmt.Fprintf(b, "#EXT-X-MAP:URI=\"%s/init.mp4\"\n", epoch)
+
+	for i, segment := range segments {
+		if lowLatency && i >= len(segments)-partSegments {
+			for j, frag := range segment.Fragments {
+				independent := ""
+				if frag.Keyframe {
+					independent = ",INDEPENDENT=YES"
+				}
+				fmt.Fprintf(b, "#EXT-X-PART:DURATION=%.3f,URI=\"%s/%d.%d.m4s\"%s\n",
+					frag.Duration.Seconds(), epoch, segment.Seq, j, independent)
+			}
+		}
+
+		if segment.Complete {
+			fmt.Fprintf(b, "#EXTINF:%.3f,\n%s/%d.m4s\n",
+				segment.Duration().Seconds(), epoch, segment.Seq)
+		}
+	}
+
+	// The playlist changes with each segment (or part), so caches may only
+	// keep it briefly.
+	rw.Header().Set("Content-Type", "application/vnd.apple.mpegurl")
+	rw.Header().Set("Cache-Control", "public, max-age=1")
+	_, _ = rw.Write([]byte(b.String()))
+}
+
+// The manifest is a dynamic MPD with a SegmentTimeline listing the complete
+// segments.
+func (s *SegmentServer) serveManifest(rw http.ResponseWriter,
+	session *segmentSession) {
+	ring := session.ring
+
+	segments := waitForSegments(ring, false)
+	if segments == nil {
+		unavailable(rw)
+		return
+	}
+	defer releaseSegments(segments)
+
+	var complete []Segment
+	for _, segment := range segments {
+		if segment.Complete {
+			complete = append(complete, segment)
+		}
+	}
+
+	codecs := []string{}
+	for _, track := range ring.Tracks() {
+		if track.Codec != "" {
+			codecs = append(codecs, track.Codec)
+		}
+	}
+
+	window := time.Duration(0)
+	maxDuration := time.Duration(0)
+	size := 0
+	for _, segment := range complete {
+		window += segment.Duration()
+		if segment.Duration() > maxDuration {
+			maxDuration = segment.Duration()
+		}
+		size += segment.Size()
+	}
+
+	bandwidth := 0
+	if window > 0 {
+		bandwidth = int(float64(size*8) / window.Seconds())
+	}
+
+	epoch := ring.Epoch()
+
+	b := &strings.Builder{}
+	b.WriteString(`<?xml version="1.0" encoding="UTF-8"?>` + "\n")
+	fmt.Fprintf(b, `<MPD xmlns="urn:mpeg:dash:schema:mpd:2011" `+
+		`profiles="urn:mpeg:dash:profile:isoff-live:2011" type="dynamic" `+
+		`availabilityStartTime="%s" publishTime="%s" `+
+		`minimumUpdatePeriod="PT%.3fS" minBufferTime="PT%.3fS" `+
+		`timeShiftBufferDepth="PT%.3fS" suggestedPresentationDelay="PT%.3fS">`+
+		"\n",
+		ring.StartTime().UTC().Format(time.RFC3339Nano),
+		time.Now().UTC().Format(time.RFC3339Nano), maxDuration.Seconds(),
+		maxDuration.Seconds(), window.Seconds(), 2*maxDuration.Seconds())
+	fmt.Fprintf(b, `  <Period id="%s" start="PT0S">`+"\n", epoch)
+	b.WriteString(`    <AdaptationSet mimeType="video/mp4" ` +
+		`segmentAlignment="true" startWithSAP="1">` + "\n")
+	fmt.Fprintf(b, `      <Representation id="0" codecs="%s" bandwidth="%d">`+
+		"\n", strings.Join(codecs, ","), bandwidth)
+	fmt.Fprintf(b, `        <SegmentTemplate timescale="1000" `+
+		`initialization="%s/init.mp4" media="%s/$Number$.m4s" `+
+		`startNumber="%d">`+"\n", epoch, epoch, complete[0].Seq)
+	b.WriteString("          <SegmentTimeline>\n")
+	for _, segment := range complete {
+		fmt.Fprintf(b, `            <S t="%d" d="%d"/>`+"\n",
+			segment.Fragments[0].DecodeTime/time.Millisecond,
+			segment.Duration()/time.Millisecond)
+	}
+	b.WriteString("          </SegmentTimeline>\n")
+	b.WriteString("        </SegmentTemplate>\n")
+	b.WriteString("      </Representation>\n")
+	b.WriteString("    </AdaptationSet>\n")
+	b.WriteString("  </Period>\n")
+	b.WriteString("</MPD>\n")
+
+	rw.Header().Set("Content-Type", "application/dash+xml")
+	rw.Header().Set("Cache-Control", "public, max-age=1")
+	_, _ = rw.Write([]byte(b.String()))
+}
+
+// Wait for the ring to have something to list: a complete segment, or for
+// LL-HLS, a part. Returns nil if it does not in time. Otherwise the caller
+// must release the segments.
+func waitForSegments(ring *FragmentRing, parts bool) []Segment {
+	part := -1
+	if parts {
+		part = 0
+	}
+
+	if !ring.WaitForSegment(0, part, segmentWait) {
+		return nil
+	}
+
+	segments := ring.Segments()
+	if len(segments) == 0 {
+		return nil
+	}
+
+	if !parts && !segments[0].Complete {
+		releaseSegments(segments)
+		return nil
+	}
+
+	return segments
+}
+
+// Serve the init segment (init.mp4), a segment ({seq}.m4s), or a part
+// ({seq}.{part}.m4s). These never change, so caches may keep them.
+//
+// We hold requests for segments and parts that don't exist yet for a while,
+// as LL-HLS players request them ahead of time.
+func serveMedia(rw http.ResponseWriter, ring *FragmentRing, file string) {
+	if file == "init.mp4" {
+		initSegment, err := ring.InitSegment()
+		if err != nil {
+			unavailable(rw)
+			return
+		}
+		rw.Header().Set("Content-Type", "video/mp4")
+		rw.Header().Set("Cache-Control", "public, max-age=3600")
+		rw.Header().Set("Content-Length", strconv.Itoa(len(initSegment)))
+		_, _ = rw.Write(initSegment)
+		return
+	}
+
+	if !strings.HasSuffix(file, ".m4s") {
+		notFound(rw)
+		return
+	}
+
+	pieces := strings.Split(strings.TrimSuffix(file, ".m4s"), ".")
+	if len(pieces) > 2 {
+		notFound(rw)
+		return
+	}
+
+	seq, err := strconv.ParseUint(pieces[0], 10, 64)
+	if err != nil {
+		notFound(rw)
+		return
+	}
+
+	part := -1
+	if len(pieces) == 2 {
+		part, err = strconv.Atoi(pieces[1])
+		if err != nil || part < 0 {
+			notFound(rw)
+			return
+		}
+	}
+
+	if !ring.WaitForSegment(seq, part, segmentWait) {
+		notFound(rw)
+		return
+	}
+
+	segments := ring.Segments()
+	defer releaseSegments(segments)
+
+	var fragments []*Fragment
+	for _, segment := range segments {
+		if segment.Seq != seq {
+			continue
+		}
+		if part == -1 {
+			fragments = segment.Fragments
+		} else if part < len(segment.Fragments) {
+			fragments = segment.Fragments[part : part+1]
+		}
+	}
+
+	// It may have left the ring.
+	if fragments == nil {
+		notFound(rw)
+		return
+	}
+
+	size := 0
+	for _, frag := range fragments {
+		size += len(frag.Data)
+	}
+
+	rw.Header().Set("Content-Type", "video/iso.segment")
+	rw.Header().Set("Cache-Control", "public, max-age=3600")
+	rw.Header().Set("Content-Length", strconv.Itoa(size))
+	for _, frag := range fragments {
+		if _, err := rw.Write(frag.Data); err != nil {
+			return
+		}
+	}
+}
+
+func notFound(rw http.ResponseWriter) {
+	rw.Header().Set("Cache-Control", "no-cache")
+	rw.WriteHeader(http.StatusNotFound)
+	_, _ = rw.Write([]byte("<h1>404 Not found</h1>"))
+}
+
+func badRequest(rw http.ResponseWriter) {
+	rw.Header().Set("Cache-Control", "no-cache")
+	rw.WriteHeader(http.StatusBadRequest)
+	_, _ = rw.Write([]byte("<h1>400 Bad request</h1>"))
+}
+
+func unavailable(rw http.ResponseWriter) {
+	rw.Header().Set("Cache-Control", "no-cache")
+	rw.WriteHeader(http.StatusServiceUnavailable)
+	_, _ = rw.Write([]byte("<h1>503 Service unavailable</h1>"))
+}
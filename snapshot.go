@@ -0,0 +1,232 @@
+package main
+
+import (
+	"fmt"
+	"log"
+	"net/http"
+	"sync"
+	"time"
+	"unsafe"
+)
+
+// #include "videostreamer.h"
+import "C"
+
+// Snapshot holds an input's most recent keyframe so that we can serve it as a
+// JPEG at /snapshot/{name}.
+//
+// The encoder hands us each keyframe it reads, which costs us a reference to
+// the packet. We decode it and encode the JPEG only when a client asks, and
+// keep the JPEG until the next keyframe replaces it. Clients polling for
+// snapshots then share the one connection to the input, and we decode at most
+// once per keyframe however many there are.
+type Snapshot struct {
+	mutex *sync.Mutex
+	cond  *sync.Cond
+
+	// The input's video codec parameters and its most recent keyframe. They are
+	// nil while the input is closed. seq counts the keyframes we've had.
+	codecpar *C.AVCodecParameters
+	keyframe *SharedPacket
+	seq      uint64
+
+	// The JPEG of keyframe jpegSeq, if we made one. We set decoding while a
+	// client makes one. Others wait for it.
+	jpeg     []byte
+	jpegSeq  uint64
+	decoding bool
+}
+
+// The JPEG quantizer scale we encode snapshots with, from 2 (best) to 31.
+const snapshotQuality = 5
+
+// How long a snapshot request waits for a keyframe if we don't have one, such
+// as when the input is just opening.
+const snapshotWait = 10 * time.Second
+
+// Snapshots by input name. We keep them as inputs open and close.
+var snapshots = struct {
+	mutex  *sync.Mutex
+	inputs map[string]*Snapshot
+}{
+	mutex:  &sync.Mutex{},
+	inputs: map[string]*Snapshot{},
+}
+
+// snapshotFor returns the named input's snapshot.
+func snapshotFor(name string) *Snapshot {
+	snapshots.mutex.Lock()
+	defer snapshots.mutex.Unlock()
+
+	if s, ok := snapshots.inputs[name]; ok {
+		return s
+	}
+
+	s := &Snapshot{mutex: &sync.Mutex{}}
+	s.cond = sync.NewCond(s.mutex)
+	snapshots.inputs[name] = s
+	return s
+}
+
+// SetInput notes the codec parameters of the input's video. The encoder calls
+// this when it opens (or reopens) the input. Nothing may be reading from it
+// then, as reading may add streams.
+func (s *Snapshot) SetInput(vsInput *C.struct_VSInput) error {
+	streams := (*[1 << 20]*C.AVStream)(unsafe.Pointer(vsInput.format_ctx.streams))
+	stream := streams[vsInput.video_stream_index]
+
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+
+	if s.codecpar == nil {
+		s.codecpar = C.avcodec_parameters_alloc()
+		if s.codecpar == nil {
+			return fmt.Errorf("unable to allocate codec parameters")
+		}
+	}
+
+	if C.avcodec_parameters_copy(s.codecpar, stream.codecpar) < 0 {
+		return fmt.Errorf("unable to copy codec parameters")
+	}
+	return nil
+}
+
+// SetKeyframe takes a reference to a keyframe from the input, replacing the
+// one we had.
+func (s *Snapshot) SetKeyframe(pkt *SharedPacket) {
+	pkt.Ref()
+
+	s.mutex.Lock()
+	old := s.keyframe
+	s.keyframe = pkt
+	s.seq++
+	s.jpeg = nil
+	s.mutex.Unlock()
+	s.cond.Broadcast()
+
+	if old != nil {
+		old.Release()
+	}
+}
+
+// Clear drops the keyframe and codec parameters. The encoder calls this when it
+// closes the input.
+func (s *Snapshot) Clear() {
+	s.mutex.Lock()
+	old := s.keyframe
+	s.keyframe = nil
+	s.jpeg = nil
+	if s.codecpar != nil {
+		C.avcodec_parameters_free(&s.codecpar)
+	}
+	s.mutex.Unlock()
+	s.cond.Broadcast()
+
+	if old != nil {
+		old.Release()
+	}
+}
+
+// JPEG returns the most recent keyframe as a JPEG, making it if no one has.
+// If we have no keyframe we wait up to timeout for one.
+func (s *Snapshot) JPEG(timeout time.Duration) ([]byte, error) {
+	timedOut := false
+	timer := time.AfterFunc(timeout, func() {
+		s.mutex.Lock()
+		timedOut = true
+		s.mutex.Unlock()
+		s.cond.Broadcast()
+	})
+	defer timer.Stop()
+
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+
+	for {
+		if s.jpeg != nil && s.jpegSeq == s.seq {
+			return s.jpeg, nil
+		}
+		if s.keyframe != nil && s.codecpar != nil && !s.decoding {
+			break
+		}
+		if timedOut {
+			return nil, fmt.Errorf("no keyframe")
+		}
+		s.cond.Wait()
+	}
+
+	// Decode without the mutex so we don't hold up the encoder. We hold our own
+	// references to the packet and codec parameters meanwhile.
+	s.decoding = true
+	seq := s.seq
+	pkt := s.keyframe.Ref()
+	codecpar := C.avcodec_parameters_alloc()
+	if codecpar == nil || C.avcodec_parameters_copy(codecpar, s.codecpar) < 0 {
+		C.avcodec_parameters_free(&codecpar)
+		pkt.Release()
+		s.decoding = false
+		s.cond.Broadcast()
+		return nil, fmt.Errorf("unable to copy codec parameters")
+	}
+	s.mutex.Unlock()
+
+	jpeg := C.vs_snapshot(codecpar, pkt.Packet, snapshotQuality, C.bool(false))
+	C.avcodec_parameters_free(&codecpar)
+	pkt.Release()
+
+	var buf []byte
+	if jpeg != nil {
+		buf = C.GoBytes(unsafe.Pointer(jpeg.data), jpeg.size)
+		C.av_packet_free(&jpeg)
+	}
+
+	s.mutex.Lock()
+	s.decoding = false
+	s.cond.Broadcast()
+
+	if buf == nil {
+		return nil, fmt.Errorf("unable to make snapshot")
+	}
+
+	// A newer keyframe may have arrived meanwhile. This one is still the most
+	// recent the client could have had, so return it, but don't keep it.
+	if seq == s.seq {
+		s.jpeg = buf
+		s.jpegSeq = seq
+	}
+	return buf, nil
+}
+
+// Serve the input's most recent keyframe as a JPEG.
+//
+// We keep the input's pipeline running between requests in the same way as
+// for HLS and DASH viewers, so clients polling for snapshots don't reopen the
+// input each time.
+func (h HTTPHandler) snapshotRequest(rw http.ResponseWriter, r *http.Request,
+	name string) {
+	if _, ok := h.Streams.Config(name); !ok {
+		notFound(rw)
+		return
+	}
+
+	rw = h.Admission.CountSent(rw, metricsFor(name))
+
+	if !h.Segments.Hold(name) {
+		log.Printf("%s: No output available for %s", r.RemoteAddr, name)
+		unavailable(rw)
+		return
+	}
+
+	jpeg, err := snapshotFor(name).JPEG(snapshotWait)
+	if err != nil {
+		log.Printf("%s: Unable to get snapshot of %s: %s", r.RemoteAddr, name, err)
+		unavailable(rw)
+		return
+	}
+
+	rw.Header().Set("Content-Type", "image/jpeg")
+	rw.Header().Set("Cache-Control", "no-cache")
+	if _, err := rw.Write(jpeg); err != nil {
+		log.Printf("%s: Write error: %s", r.RemoteAddr, err)
+	}
+}
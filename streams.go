@@ -0,0 +1,138 @@
+package main
+
+import (
+	"log"
+	"sync"
+)
+
+// Streams knows about every input we may serve, and the encoder pipelines we
+// have running. We start an input's pipeline when a client first asks for it.
+type Streams struct {
+	mutex *sync.Mutex
+
+	// Inputs by name, in the order configured.
+	configs map[string]InputConfig
+	names   []string
+
+	// Running pipelines by input name.
+	running map[string]*Stream
+
+	verbose        bool
+	avioBufferSize int
+}
+
+// Stream is a running encoder pipeline for one input.
+type Stream struct {
+	Config InputConfig
+
+	// Clients provide the encoder info about themselves when they start up.
+	ClientChan chan *Client
+
+	// Closed when the encoder ends. It no longer accepts clients then.
+	Done chan struct{}
+}
+
+func newStreams(inputs []InputConfig, verbose bool,
+	avioBufferSize int) *Streams {
+	s := &Streams{
+		mutex:          &sync.Mutex{},
+		configs:        map[string]InputConfig{},
+		running:        map[string]*Stream{},
+		verbose:        verbose,
+		avioBufferSize: avioBufferSize,
+	}
+
+	for _, input := range inputs {
+		s.configs[input.Name] = input
+		s.names = append(s.names, input.Name)
+	}
+
+	for _, input := range inputs {
+		if input.AlwaysOn {
+			_, _ = s.Get(input.Name)
+		}
+		if input.Record != "" {
+			go newRecorder(s, input, verbose).Run()
+		}
+	}
+
+	return s
+}
+
+// DefaultName returns the name of the input we serve at /stream.
+func (s *Streams) DefaultName() string {
+	return s.names[0]
+}
+
+// Config returns the named input's configuration.
+//
+// It returns false if there is no such input.
+func (s *Streams) Config(name string) (InputConfig, bool) {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+
+	config, ok := s.configs[name]
+	return config, ok
+}
+
+// Get returns the running pipeline for the named input, starting it if it is
+// not running.
+//
+// It returns false if there is no such input.
+func (s *Streams) Get(name string) (*Stream, bool) {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+
+	if stream, ok := s.running[name]; ok {
+		return stream, true
+	}
+
+	config, ok := s.configs[name]
+	if !ok {
+		return nil, false
+	}
+
+	stream := &Stream{
+		Config:     config,
+		ClientChan: make(chan *Client),
+		Done:       make(chan struct{}),
+	}
+	s.running[name] = stream
+
+	go func() {
+		if config.isRelay() {
+			relay(config, s.verbose, stream.ClientChan)
+		} else {
+			encoder(config, s.verbose, s.avioBufferSize, stream.ClientChan)
+		}
+
+		s.mutex.Lock()
+		delete(s.running, name)
+		s.mutex.Unlock()
+
+		close(stream.Done)
+	}()
+
+	log.Printf("Started pipeline for input %s", name)
+	return stream, true
+}
+
+// Join hands a new client to the named input's encoder, starting the pipeline
+// if necessary.
+//
+// It returns false if there is no such input.
+func (s *Streams) Join(name string, client *Client) bool {
+	for {
+		stream, ok := s.Get(name)
+		if !ok {
+			return false
+		}
+
+		select {
+		case stream.ClientChan <- client:
+			return true
+		case <-stream.Done:
+			// The encoder ended before it took the client. Start a new one.
+		}
+	}
+}
@@ -0,0 +1,122 @@
+package main
+
+import (
+	"encoding/json"
+	"io"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// When tracing an input, we note when its packets and fragments pass each
+// stage of the pipeline:
+//
+// 1. We read a packet from the input (SharedPacket.ReadAt).
+// 2. The muxer goroutine takes it from its queue.
+// 3. The muxer writes it.
+// 4. The muxer produces the fragment holding it.
+// 5. We write the fragment to each client.
+//
+// We observe the time between stages in histograms (see InputMetrics), and
+// keep the most recent fragments' traces to serve at /trace/{name}.
+
+// FragmentTrace records when a fragment passed each stage.
+type FragmentTrace struct {
+	Seq uint64 `json:"seq"`
+
+	// When we read the first packet in the fragment. This is approximate: we
+	// take it from the first packet of the first batch the muxer wrote since
+	// the last fragment.
+	Read time.Time `json:"read"`
+
+	// When the muxer produced the fragment.
+	Fragmented time.Time `json:"fragmented"`
+
+	// When we first and last wrote the fragment to a client (Unix
+	// nanoseconds), and how many times. Clients update these concurrently.
+	firstWrite int64
+	lastWrite  int64
+	writes     int64
+}
+
+// Tracer holds an input's most recent fragment traces.
+type Tracer struct {
+	mutex  *sync.Mutex
+	traces []*FragmentTrace
+	next   int
+}
+
+// How many fragment traces we keep for each input.
+const traceSize = 256
+
+func newTracer() *Tracer {
+	return &Tracer{
+		mutex:  &sync.Mutex{},
+		traces: make([]*FragmentTrace, traceSize),
+	}
+}
+
+// add keeps a trace, replacing the oldest.
+func (t *Tracer) add(trace *FragmentTrace) {
+	t.mutex.Lock()
+	t.traces[t.next%len(t.traces)] = trace
+	t.next++
+	t.mutex.Unlock()
+}
+
+// wrote notes that we wrote the fragment to a client at now.
+func (ft *FragmentTrace) wrote(now time.Time) {
+	ns := now.UnixNano()
+	atomic.CompareAndSwapInt64(&ft.firstWrite, 0, ns)
+	atomic.StoreInt64(&ft.lastWrite, ns)
+	atomic.AddInt64(&ft.writes, 1)
+}
+
+// WriteTo writes the traces, oldest first, as JSON. Each includes how long it
+// took to reach each stage after the one before, in seconds.
+func (t *Tracer) WriteTo(w io.Writer) (int64, error) {
+	type traceJSON struct {
+		*FragmentTrace
+		FirstWrite        *time.Time `json:"first_write,omitempty"`
+		LastWrite         *time.Time `json:"last_write,omitempty"`
+		Writes            int64      `json:"writes"`
+		FragmentSeconds   float64    `json:"fragment_seconds"`
+		FirstWriteSeconds *float64   `json:"first_write_seconds,omitempty"`
+		LastWriteSeconds  *float64   `json:"last_write_seconds,omitempty"`
+	}
+
+	t.mutex.Lock()
+	traces := make([]traceJSON, 0, len(t.traces))
+	for i := t.next - len(t.traces); i < t.next; i++ {
+		if i < 0 {
+			continue
+		}
+		traces = append(traces, traceJSON{FragmentTrace: t.traces[i%len(t.traces)]})
+	}
+	t.mutex.Unlock()
+
+	for i := range traces {
+		trace := &traces[i]
+		trace.Writes = atomic.LoadInt64(&trace.writes)
+		if !trace.Read.IsZero() {
+			trace.FragmentSeconds = trace.Fragmented.Sub(trace.Read).Seconds()
+		}
+		if ns := atomic.LoadInt64(&trace.firstWrite); ns != 0 {
+			first := time.Unix(0, ns)
+			seconds := first.Sub(trace.Fragmented).Seconds()
+			trace.FirstWrite, trace.FirstWriteSeconds = &first, &seconds
+		}
+		if ns := atomic.LoadInt64(&trace.lastWrite); ns != 0 {
+			last := time.Unix(0, ns)
+			seconds := last.Sub(trace.Fragmented).Seconds()
+			trace.LastWrite, trace.LastWriteSeconds = &last, &seconds
+		}
+	}
+
+	buf, err := json.MarshalIndent(traces, "", "  ")
+	if err != nil {
+		return 0, err
+	}
+	n, err := w.Write(append(buf, '\n'))
+	return int64(n), err
+}
@@ -0,0 +1,404 @@
+package main
+
+import (
+	"fmt"
+	"log"
+	"unsafe"
+)
+
+// #include "videostreamer.h"
+// #include <stdlib.h>
+import "C"
+
+// Transcoder decodes an input's video and encodes it again to each of the
+// input's renditions (such as a smaller, lower bitrate one for clients with
+// less bandwidth).
+//
+// We decode each packet once, on the transcoder's goroutine, and pass each
+// rendition a reference to the frame. Each rendition encodes on its own
+// goroutine, so the renditions encode in parallel, and each encoder may use
+// several threads too. Then, as for the input's own output, each rendition
+// has one muxer, fragmenter, and ring that all of its clients share.
+//
+// Transcoding must not hold up the input's own output. If the transcoder falls
+// behind, we drop packets rather than wait for it, and then the packets after
+// until a keyframe as it could not decode them. If a rendition's encoder falls
+// behind, we drop frames for it.
+type Transcoder struct {
+	name    string
+	verbose bool
+	metrics *InputMetrics
+
+	decoder    *C.struct_VSDecoder
+	renditions []*Rendition
+
+	// The encoder passes packets through this. A nil packet means the input is
+	// done. We signal flushed once we've decoded every packet before it. We
+	// close done when we end, after setting err if we failed.
+	pktChan chan *SharedPacket
+	flushed chan struct{}
+	done    chan struct{}
+	err     error
+
+	// Whether we drop video packets until a keyframe. We do after dropping one.
+	// Only the encoder goroutine accesses this.
+	waitKeyframe bool
+
+	// Set once we start running.
+	started bool
+}
+
+// Rendition is one of an input's renditions. See Transcoder.
+type Rendition struct {
+	config  RenditionConfig
+	name    string
+	metrics *InputMetrics
+
+	encoder *C.struct_VSEncoder
+
+	// The encoder's packets go to the output. The muxer passes what it writes
+	// to the fragmenter, which stores fragments in the ring.
+	output     *C.struct_VSOutput
+	outputID   *C.uintptr_t
+	fragmenter *Fragmenter
+	ring       *FragmentRing
+
+	// The transcoder passes frames through this, and closes it when it ends. We
+	// free the frames. We close done when we end, after setting err if we
+	// failed.
+	frames chan *C.AVFrame
+	done   chan struct{}
+	err    error
+}
+
+// How many packets may wait for the transcoder, and frames for each
+// rendition's encoder, before we drop them.
+const transcodeQueueSize = 64
+const renditionQueueSize = 8
+
+// Open a decoder for the input's video and an encoder and output for each of
+// its renditions. Start them with Start().
+func openTranscoder(config InputConfig, vsInput *C.struct_VSInput,
+	verbose bool, avioBufferSize int) (*Transcoder, error) {
+	t := &Transcoder{
+		name:    config.Name,
+		verbose: verbose,
+		metrics: metricsFor(config.Name),
+		pktChan: make(chan *SharedPacket, transcodeQueueSize),
+		flushed: make(chan struct{}),
+		done:    make(chan struct{}),
+	}
+
+	t.decoder = C.vs_decoder_open(vsInput, 0, C.bool(verbose))
+	if t.decoder == nil {
+		return nil, fmt.Errorf("unable to open decoder")
+	}
+
+	for _, rc := range config.Renditions {
+		r, err := openRendition(config, rc, t.decoder, verbose, avioBufferSize)
+		if err != nil {
+			t.close()
+			return nil, fmt.Errorf("rendition %s: %s", rc.Name, err)
+		}
+		t.renditions = append(t.renditions, r)
+	}
+
+	return t, nil
+}
+
+func openRendition(config InputConfig, rc RenditionConfig,
+	decoder *C.struct_VSDecoder, verbose bool,
+	avioBufferSize int) (*Rendition, error) {
+	name := renditionName(config.Name, rc.Name)
+	ring := newFragmentRing(config.ringSize(), nil)
+	metrics := metricsFor(name)
+
+	r := &Rendition{
+		config:     rc,
+		name:       name,
+		metrics:    metrics,
+		fragmenter: newFragmenter(ring, metrics),
+		ring:       ring,
+		frames:     make(chan *C.AVFrame, renditionQueueSize),
+		done:       make(chan struct{}),
+	}
+
+	encoderC := C.CString(rc.Encoder)
+	hwDeviceTypeC := C.CString(rc.HWDeviceType)
+	hwDeviceC := C.CString(rc.HWDevice)
+	r.encoder = C.vs_encoder_open(decoder, encoderC, hwDeviceTypeC, hwDeviceC,
+		C.int(rc.Width), C.int(rc.Height), C.int64_t(rc.Bitrate),
+		C.int(rc.Threads), C.bool(verbose))
+	C.free(unsafe.Pointer(encoderC))
+	C.free(unsafe.Pointer(hwDeviceTypeC))
+	C.free(unsafe.Pointer(hwDeviceC))
+	if r.encoder == nil {
+		r.close()
+		return nil, fmt.Errorf("unable to open encoder")
+	}
+
+	r.output, r.outputID = openOutput(config, verbose, avioBufferSize,
+		r.encoder.stream, r.fragmenter)
+	if r.output == nil {
+		r.close()
+		return nil, fmt.Errorf("unable to open output")
+	}
+
+	return r, nil
+}
+
+// renditionName returns the name we give the rendition's metrics.
+func renditionName(input, rendition string) string {
+	return input + "/" + rendition
+}
+
+// Ring returns the ring holding the named rendition's output, or nil if there
+// is no such rendition.
+func (t *Transcoder) Ring(rendition string) *FragmentRing {
+	for _, r := range t.renditions {
+		if r.config.Name == rendition {
+			return r.ring
+		}
+	}
+	return nil
+}
+
+// Send hands the transcoder a reference to the packet if it is video. We don't
+// wait for the transcoder. See Transcoder for when we drop packets instead.
+func (t *Transcoder) Send(vsInput *C.struct_VSInput, pkt *SharedPacket) {
+	if pkt.Packet.stream_index != vsInput.video_stream_index {
+		return
+	}
+
+	select {
+	case <-t.done:
+		return
+	default:
+	}
+
+	if t.waitKeyframe && pkt.Packet.flags&C.AV_PKT_FLAG_KEY == 0 {
+		t.metrics.TranscodeDropped.Inc()
+		return
+	}
+
+	pkt.Ref()
+	select {
+	case t.pktChan <- pkt:
+		t.waitKeyframe = false
+	default:
+		pkt.Release()
+		t.metrics.TranscodeDropped.Inc()
+		t.waitKeyframe = true
+	}
+}
+
+// Flush waits until the transcoder has decoded every packet we sent it, and
+// passed on every frame. The decoder then takes packets from a new input. Its
+// frames follow on from the old input's, so the renditions' clients see one
+// continuous stream.
+func (t *Transcoder) Flush() {
+	select {
+	case t.pktChan <- nil:
+	case <-t.done:
+		return
+	}
+
+	select {
+	case <-t.flushed:
+	case <-t.done:
+	}
+
+	t.waitKeyframe = false
+}
+
+// Start the transcoder and its renditions. They run until we close them.
+func (t *Transcoder) Start(input *Input) {
+	t.started = true
+	for _, r := range t.renditions {
+		go r.run(t.verbose)
+	}
+	go t.run(input)
+}
+
+// Decode packets and pass the frames to the renditions.
+//
+// The transcoder runs alongside reading from the input. As with muxer(), that
+// is safe as decoding only uses the time base VSInput copied when we opened
+// the input, not the input's streams. When the encoder replaces the input, it
+// first waits for us to finish with the old one (see Flush()).
+func (t *Transcoder) run(input *Input) {
+	defer close(t.done)
+	defer func() {
+		for _, r := range t.renditions {
+			close(r.frames)
+		}
+	}()
+
+	for pkt := range t.pktChan {
+		var pktC *C.AVPacket
+		var vsInput *C.struct_VSInput
+		if pkt != nil {
+			pktC = pkt.Packet
+			vsInput = input.vsInput
+		}
+
+		sendRes := C.vs_decoder_send(t.decoder, vsInput, pktC, C.bool(t.verbose))
+		if pkt != nil {
+			pkt.Release()
+		}
+		if sendRes != 0 {
+			t.fail(fmt.Errorf("failure decoding packet"))
+			return
+		}
+
+		for {
+			receiveRes := C.vs_decoder_receive(t.decoder, C.bool(t.verbose))
+			if receiveRes == -1 {
+				t.fail(fmt.Errorf("failure decoding frame"))
+				return
+			}
+			if receiveRes == 0 {
+				break
+			}
+			t.distribute(t.decoder.frame)
+		}
+
+		if pkt == nil {
+			t.flushed <- struct{}{}
+		}
+	}
+}
+
+func (t *Transcoder) fail(err error) {
+	log.Printf("transcoder %s: %s", t.name, err)
+	t.err = err
+}
+
+// Pass each rendition a reference to the frame.
+func (t *Transcoder) distribute(frame *C.AVFrame) {
+	for _, r := range t.renditions {
+		select {
+		case <-r.done:
+			continue
+		default:
+		}
+
+		ref := C.av_frame_clone(frame)
+		if ref == nil {
+			log.Printf("transcoder %s: Unable to reference frame", t.name)
+			continue
+		}
+
+		select {
+		case r.frames <- ref:
+		default:
+			C.av_frame_free(&ref)
+			r.metrics.TranscodeDropped.Inc()
+		}
+	}
+}
+
+// Encode frames and write the packets to the rendition's output until the
+// transcoder closes the channel, or we fail. If we fail, the rendition's
+// clients see it end. The input's other outputs carry on.
+func (r *Rendition) run(verbose bool) {
+	defer close(r.done)
+	defer r.ring.Close()
+
+	pkt := C.av_packet_alloc()
+	if pkt == nil {
+		r.err = fmt.Errorf("unable to allocate packet")
+		log.Printf("rendition %s: %s", r.name, r.err)
+		return
+	}
+	defer C.av_packet_free(&pkt)
+
+	for frame := range r.frames {
+		if err := r.encode(frame, pkt, verbose); err != nil {
+			r.err = err
+			log.Printf("rendition %s: %s", r.name, err)
+			return
+		}
+	}
+}
+
+// Encode the frame, taking it, and write what the encoder gives us.
+func (r *Rendition) encode(frame *C.AVFrame, pkt *C.AVPacket,
+	verbose bool) error {
+	sendRes := C.vs_encoder_send(r.encoder, frame, C.bool(verbose))
+	C.av_frame_free(&frame)
+	if sendRes != 0 {
+		return fmt.Errorf("failure encoding frame")
+	}
+
+	for {
+		receiveRes := C.vs_encoder_receive(r.encoder, pkt, C.bool(verbose))
+		if receiveRes == -1 {
+			return fmt.Errorf("failure encoding frame")
+		}
+		if receiveRes == 0 {
+			return nil
+		}
+
+		writeRes := C.vs_write_packet(r.encoder.stream, r.output, pkt,
+			C.bool(verbose))
+		C.av_packet_unref(pkt)
+		if r.fragmenter.err != nil {
+			return r.fragmenter.err
+		}
+		if writeRes != 1 {
+			return fmt.Errorf("failure writing packet")
+		}
+	}
+}
+
+// Stop the transcoder and its renditions if they are running, and free them.
+// Their clients see their output end.
+func (t *Transcoder) close() {
+	if t.started {
+		close(t.pktChan)
+		<-t.done
+		for pkt := range t.pktChan {
+			if pkt != nil {
+				pkt.Release()
+			}
+		}
+
+		// The transcoder closed their channels as it ended.
+		for _, r := range t.renditions {
+			<-r.done
+		}
+	}
+
+	for _, r := range t.renditions {
+		r.close()
+	}
+	t.renditions = nil
+
+	C.vs_decoder_close(t.decoder)
+	t.decoder = nil
+}
+
+// Free the rendition, and any frames waiting for it. It must not be running.
+func (r *Rendition) close() {
+Drain:
+	for {
+		select {
+		case frame, ok := <-r.frames:
+			if !ok {
+				break Drain
+			}
+			C.av_frame_free(&frame)
+		default:
+			break Drain
+		}
+	}
+
+	closeOutput(r.output, r.outputID)
+	r.output = nil
+	r.outputID = nil
+	r.ring.Close()
+
+	C.vs_encoder_close(r.encoder)
+	r.encoder = nil
+}
@@ -3,23 +3,221 @@
 // an MP4 container. It writes a fragmented MP4 so that it can be streamed to a
 // pipe.
 //
-// There is no re-encoding. The stream is copied as is.
+// There is no re-encoding. The stream is copied as is. Optionally, we also
+// decode the video and encode it again at other sizes and bitrates (see
+// vs_decoder_open() and vs_encoder_open()).
 //
 // The logic here is heavily based on remuxing.c by Stefano Sabatini.
 //
 
+// For pthreads and clock_gettime().
+#define _POSIX_C_SOURCE 200809L
+
 #include <errno.h>
 #include <libavdevice/avdevice.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/time.h>
 #include <libavutil/timestamp.h>
+#include <libswscale/swscale.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "videostreamer.h"
 
+// A reader reads packets from an input on its own thread and queues them. The
+// caller collects them in batches with vs_reader_read().
+//
+// The queue has a single producer (the thread) and a single consumer, so it
+// needs no lock. The thread reads each packet straight into the slot at tail,
+// and the consumer moves packets out from head. Each side only advances its
+// own index. We lock the mutex only to sleep when the queue is empty (the
+// consumer) or full (the thread), and to wake a sleeper.
+struct VSReader {
+	struct VSInput * input;
+	bool verbose;
+
+	pthread_t thread;
+
+	// size is a power of 2. head and tail count up without wrapping at size.
+	AVPacket ** slots;
+	size_t size;
+	atomic_size_t head;
+	atomic_size_t tail;
+
+	// The thread sets done when it stops reading, after a read error (including
+	// after vs_reader_stop() cancels the input). stop asks it to stop.
+	atomic_bool done;
+	atomic_bool stop;
+
+	// How many are sleeping on cond. We check it to avoid locking when no one
+	// needs waking.
+	atomic_int waiting;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+// Where log messages go. See vs_set_log_callback().
+//
+// Messages above level are disabled. We check it before formatting anything,
+// so a disabled message costs an atomic load. Past rate messages in a second,
+// we drop messages, and count them in the window. Errors don't count and are
+// never dropped, so a flood of warnings can't hide them. Of per packet
+// messages, we log one in every sample.
+static struct {
+	vs_log_cb cb;
+	void * opaque;
+	atomic_int level;
+	int rate;
+	int sample;
+
+	atomic_int_least64_t window;
+	atomic_int count;
+	atomic_int dropped;
+	atomic_uint packets;
+} __vs_log_sink = {
+	.level = VS_LOG_TRACE,
+};
+
+// How long a log message may be. We truncate longer ones.
+#define VS_LOG_MESSAGE_SIZE 1024
+
+// avio buffers of closed callback outputs, kept to reuse for outputs we open
+// later. Outputs come and go as inputs reconnect and as HLS, snapshot, and
+// rendition sessions start and end, and each buffer is large (a MiB by
+// default). Outputs open and close on many threads, so we hold the mutex to
+// use the pool.
+#define VS_AVIO_POOL_SIZE 8
+
+static struct {
+	pthread_mutex_t mutex;
+	unsigned char * buffers[VS_AVIO_POOL_SIZE];
+	int sizes[VS_AVIO_POOL_SIZE];
+	int count;
+} __vs_avio_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static bool
+__vs_log_enabled(const enum VSLogLevel);
+
+static bool
+__vs_log_packet_enabled(const bool);
+
+static void
+__vs_log(const enum VSLogLevel, const char * const, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void
+__vs_log_emit(const enum VSLogLevel, const char * const, va_list)
+	__attribute__((format(printf, 2, 0)));
+
+static int
+__vs_interrupt(void * const);
+
+static void
+__vs_start_deadline(struct VSInput * const);
+
+static int
+__vs_read_packet(struct VSInput * const, AVPacket * const, const bool);
+
+static void
+__vs_fix_timestamps(struct VSInput * const, AVPacket * const);
+
+static int
+__vs_write_packet(const struct VSInput * const, struct VSOutput * const,
+		const AVPacket * const, const bool);
+
+static void *
+__vs_reader_run(void * const);
+
+static bool
+__vs_reader_wait_space(struct VSReader * const, const size_t);
+
+static void
+__vs_reader_wake(struct VSReader * const);
+
+static void
+__vs_reader_free(struct VSReader * const);
+
+static int
+__vs_find_stream(AVFormatContext * const, const enum AVMediaType,
+		const char * const, const bool);
+
+static int
+__vs_match_stream(AVFormatContext * const, AVStream * const,
+		const char * const);
+
+static bool
+__vs_have_stream_info(AVCodecParameters * const);
+
+static bool
+__vs_have_audio_info(const AVCodecParameters * const);
+
+static int
+__vs_h264_dimensions(const uint8_t * const, const size_t, int * const,
+		int * const);
+
+static unsigned char *
+__vs_avio_buffer_get(const int);
+
+static void
+__vs_avio_buffer_put(unsigned char * const, const int);
+
+static struct VSOutput *
+__vs_alloc_output(const char * const, const struct VSInput * const);
+
+static int
+__vs_add_stream(struct VSOutput * const, const AVStream * const);
+
+static bool
+__vs_same_codec(const AVCodecParameters * const,
+		const AVCodecParameters * const);
+
+static int
+__vs_output_stream_index(const struct VSInput * const,
+		const struct VSOutput * const, const int);
+
+static void
+__vs_set_rescale(struct VSOutputStream * const, const AVRational * const,
+		const AVRational * const);
+
+static int64_t
+__vs_rescale(const struct VSOutputStream * const, const int64_t);
+
+static void
+__vs_rebase(struct VSOutput * const, const int, const int64_t, const bool);
+
+static int
+__vs_write_header(struct VSOutput * const);
+
 static void
 __vs_log_packet(const AVFormatContext * const,
 		const AVPacket * const, const char * const);
 
+static void
+__vs_decoder_set_pts(struct VSDecoder * const, AVFrame * const, const bool);
+
+static int
+__vs_encoder_hw_setup(struct VSEncoder * const, const char * const,
+		const char * const);
+
+static enum AVPixelFormat
+__vs_hw_pix_fmt(const enum AVHWDeviceType);
+
+static int
+__vs_encoder_stream(struct VSEncoder * const);
+
+static int
+__vs_snapshot_decode(const AVCodecParameters * const, const AVPacket * const,
+		AVFrame * const);
+
+static int
+__vs_snapshot_encode(const AVFrame * const, const int, AVPacket * const);
+
 void
 vs_setup(void)
 {
@@ -34,40 +232,220 @@ vs_setup(void)
 	avformat_network_init();
 }
 
+// Send log messages to cb rather than printing them to stdout. cb may be NULL
+// to print them again. Call this before anything else uses the library, as we
+// don't synchronize with threads using it.
+//
+// We log messages up to level. We log at most rate messages a second other than
+// errors (0 means no limit), and then report how many we dropped. We always log
+// errors. Of the messages we log for each packet, we log one in every sample (1
+// or less means all).
+void
+vs_set_log_callback(const vs_log_cb cb, void * const opaque,
+		const enum VSLogLevel level, const int rate, const int sample)
+{
+	__vs_log_sink.cb = cb;
+	__vs_log_sink.opaque = opaque;
+	__vs_log_sink.rate = rate;
+	__vs_log_sink.sample = sample;
+	atomic_store(&__vs_log_sink.level, (int) level);
+}
+
+static bool
+__vs_log_enabled(const enum VSLogLevel level)
+{
+	return (int) level <= atomic_load_explicit(&__vs_log_sink.level,
+			memory_order_relaxed);
+}
+
+// Whether to log a per packet message for this packet. We sample them.
+static bool
+__vs_log_packet_enabled(const bool verbose)
+{
+	if (!verbose || !__vs_log_enabled(VS_LOG_TRACE)) {
+		return false;
+	}
+
+	if (__vs_log_sink.sample <= 1) {
+		return true;
+	}
+
+	return atomic_fetch_add_explicit(&__vs_log_sink.packets, 1,
+			memory_order_relaxed) % (unsigned int) __vs_log_sink.sample == 0;
+}
+
+static void
+__vs_log(const enum VSLogLevel level, const char * const fmt, ...)
+{
+	if (!__vs_log_enabled(level)) {
+		return;
+	}
+
+	if (__vs_log_sink.rate > 0 && level != VS_LOG_ERROR) {
+		// Start a new window each second. Whoever starts it reports what the last
+		// one dropped.
+		const int64_t now = av_gettime_relative()/1000000;
+		int_least64_t window = atomic_load_explicit(&__vs_log_sink.window,
+				memory_order_relaxed);
+		if (now != window && atomic_compare_exchange_strong(
+					&__vs_log_sink.window, &window, now)) {
+			atomic_store(&__vs_log_sink.count, 0);
+			const int dropped = atomic_exchange(&__vs_log_sink.dropped, 0);
+			if (dropped > 0) {
+				char msg[64];
+				snprintf(msg, sizeof(msg), "dropped %d log messages", dropped);
+				if (__vs_log_sink.cb) {
+					__vs_log_sink.cb(__vs_log_sink.opaque, VS_LOG_WARNING, msg);
+				} else {
+					printf("%s\n", msg);
+				}
+			}
+		}
+
+		if (atomic_fetch_add(&__vs_log_sink.count, 1) >= __vs_log_sink.rate) {
+			atomic_fetch_add(&__vs_log_sink.dropped, 1);
+			return;
+		}
+	}
+
+	va_list ap;
+	va_start(ap, fmt);
+	__vs_log_emit(level, fmt, ap);
+	va_end(ap);
+}
+
+static void
+__vs_log_emit(const enum VSLogLevel level, const char * const fmt,
+		va_list ap)
+{
+	if (!__vs_log_sink.cb) {
+		vprintf(fmt, ap);
+		printf("\n");
+		return;
+	}
+
+	char msg[VS_LOG_MESSAGE_SIZE];
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	__vs_log_sink.cb(__vs_log_sink.opaque, level, msg);
+}
+
+// Open an input.
+//
+// options may be NULL. Otherwise it holds options for the format context, the
+// demuxer, and the protocol, such as probesize, fflags, or rtsp_transport. It
+// looks like key=value:key2=value2, as av_dict_parse_string() reads it. Escape
+// :, =, and \ in keys and values with \.
+//
+// If skip_probe is set, we skip avformat_find_stream_info() when opening the
+// input told us enough about the video stream already (for example, RTSP when
+// the SDP includes the H.264 SPS/PPS). This saves reading and decoding the
+// start of the stream.
+//
+// If audio is set, we read the first audio stream as well as the first video
+// stream, so outputs can carry it too.
+//
+// video_select and audio_select choose which video and audio stream we read
+// rather than the first of each. They may be NULL. See __vs_match_stream().
+// We tell the demuxer to discard every stream we don't read.
+//
+// timeout is how long, in microseconds, we let opening the input, probing it,
+// and each read wait before giving up. 0 means no limit.
 struct VSInput *
 vs_open_input(const char * const input_format_name,
-		const char * const input_url, const bool verbose)
+		const char * const input_url, const char * const options,
+		const char * const video_select, const char * const audio_select,
+		const bool skip_probe, const bool audio, const int64_t timeout,
+		const bool verbose)
 {
 	if (!input_format_name || strlen(input_format_name) == 0 ||
 			!input_url || strlen(input_url) == 0) {
-		printf("%s\n", strerror(EINVAL));
+		__vs_log(VS_LOG_ERROR, "%s", strerror(EINVAL));
 		return NULL;
 	}
 
 	struct VSInput * const input = calloc(1, sizeof(struct VSInput));
 	if (!input) {
-		printf("%s\n", strerror(errno));
+		__vs_log(VS_LOG_ERROR, "%s", strerror(errno));
+		return NULL;
+	}
+
+	input->timeout = timeout;
+	input->video_stream_index = -1;
+	input->audio_stream_index = -1;
+	for (int i = 0; i < VS_MAX_STREAMS; i++) {
+		input->last_dts[i] = AV_NOPTS_VALUE;
+	}
+
+
+	// We allocate the format context ourselves so that the interrupt callback
+	// applies while opening the input too.
+	input->format_ctx = avformat_alloc_context();
+	if (!input->format_ctx) {
+		__vs_log(VS_LOG_ERROR, "unable to allocate format context");
+		vs_destroy_input(input);
 		return NULL;
 	}
 
+	input->format_ctx->interrupt_callback.callback = __vs_interrupt;
+	input->format_ctx->interrupt_callback.opaque = input;
+
 
 	AVInputFormat * const input_format = av_find_input_format(input_format_name);
 	if (!input_format) {
-		printf("input format not found\n");
+		__vs_log(VS_LOG_ERROR, "input format not found");
 		vs_destroy_input(input);
 		return NULL;
 	}
 
+	AVDictionary * opts = NULL;
+	if (options && strlen(options) > 0) {
+		if (av_dict_parse_string(&opts, options, "=", ":", 0) < 0) {
+			__vs_log(VS_LOG_ERROR, "unable to parse input options: %s", options);
+			av_dict_free(&opts);
+			vs_destroy_input(input);
+			return NULL;
+		}
+	}
+
+	// avformat_open_input() frees the format context if it fails.
+	__vs_start_deadline(input);
 	int const open_status = avformat_open_input(&input->format_ctx, input_url,
-			input_format, NULL);
+			input_format, &opts);
 	if (open_status != 0) {
-		printf("unable to open input: %s\n", av_err2str(open_status));
+		__vs_log(VS_LOG_ERROR, "unable to open input: %s", av_err2str(open_status));
+		av_dict_free(&opts);
 		vs_destroy_input(input);
 		return NULL;
 	}
 
-	if (avformat_find_stream_info(input->format_ctx, NULL) < 0) {
-		printf("failed to find stream info\n");
+	// Anything left is an option nothing recognized. This is likely a mistake
+	// but not one that stops us from streaming.
+	AVDictionaryEntry * unused = NULL;
+	while ((unused = av_dict_get(opts, "", unused, AV_DICT_IGNORE_SUFFIX))) {
+		__vs_log(VS_LOG_WARNING, "input option not recognized: %s", unused->key);
+	}
+	av_dict_free(&opts);
+
+
+	bool probe = true;
+	if (skip_probe) {
+		int const stream_index = __vs_find_stream(input->format_ctx,
+				AVMEDIA_TYPE_VIDEO, video_select, false);
+		int const audio_index = audio ? __vs_find_stream(input->format_ctx,
+				AVMEDIA_TYPE_AUDIO, audio_select, false) : -1;
+		if (stream_index != -1 && __vs_have_stream_info(
+					input->format_ctx->streams[stream_index]->codecpar) &&
+				(audio_index == -1 || __vs_have_audio_info(
+					input->format_ctx->streams[audio_index]->codecpar))) {
+			probe = false;
+		} else if (verbose) {
+			__vs_log(VS_LOG_DEBUG, "not enough stream info to skip probing");
+		}
+	}
+
+	__vs_start_deadline(input);
+	if (probe && avformat_find_stream_info(input->format_ctx, NULL) < 0) {
+		__vs_log(VS_LOG_ERROR, "failed to find stream info");
 		vs_destroy_input(input);
 		return NULL;
 	}
@@ -78,397 +456,2583 @@ vs_open_input(const char * const input_format_name,
 	}
 
 
-	// Find the first video stream.
+	// Find the video stream.
 
-	input->video_stream_index = -1;
+	input->video_stream_index = __vs_find_stream(input->format_ctx,
+			AVMEDIA_TYPE_VIDEO, video_select, verbose);
 
-	for (unsigned int i = 0; i < input->format_ctx->nb_streams; i++) {
-		AVStream * const in_stream = input->format_ctx->streams[i];
+	if (input->video_stream_index == -1) {
+		__vs_log(VS_LOG_ERROR, "no video stream found");
+		vs_destroy_input(input);
+		return NULL;
+	}
 
-		if (in_stream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
-			if (verbose) {
-				printf("skip non-video stream %u\n", i);
-			}
+	// And the audio stream if we want it. We carry on without it if there is
+	// none.
+	if (audio) {
+		input->audio_stream_index = __vs_find_stream(input->format_ctx,
+				AVMEDIA_TYPE_AUDIO, audio_select, verbose);
+
+		if (input->audio_stream_index == -1) {
+			__vs_log(VS_LOG_WARNING, "no audio stream found");
+		}
+	}
+
+
+	// Have the demuxer drop the other streams (such as camera metadata or
+	// ONVIF data tracks) rather than passing us packets we throw away.
+	int discarded = 0;
+	for (unsigned int i = 0; i < input->format_ctx->nb_streams; i++) {
+		if ((int) i == input->video_stream_index ||
+				(int) i == input->audio_stream_index) {
 			continue;
 		}
+		input->format_ctx->streams[i]->discard = AVDISCARD_ALL;
+		discarded++;
+	}
 
-		input->video_stream_index = (int) i;
-		break;
+	if (verbose && discarded > 0) {
+		__vs_log(VS_LOG_DEBUG, "discarding %d streams we don't read", discarded);
 	}
 
-	if (input->video_stream_index == -1) {
-		printf("no video stream found\n");
-		vs_destroy_input(input);
-		return NULL;
+	input->time_base[0] =
+		input->format_ctx->streams[input->video_stream_index]->time_base;
+	if (input->audio_stream_index != -1) {
+		input->time_base[1] =
+			input->format_ctx->streams[input->audio_stream_index]->time_base;
 	}
 
 
+	input->deadline = 0;
 	return input;
 }
 
+// libavformat calls this while it waits on the input. Returning 1 makes what
+// it is doing fail with AVERROR_EXIT.
+static int
+__vs_interrupt(void * const opaque)
+{
+	struct VSInput * const input = opaque;
+
+	if (__atomic_load_n(&input->cancelled, __ATOMIC_RELAXED)) {
+		return 1;
+	}
+
+	if (input->deadline != 0 && av_gettime_relative() > input->deadline) {
+		return 1;
+	}
+
+	return 0;
+}
+
+// Give the next blocking operation on the input its timeout.
+static void
+__vs_start_deadline(struct VSInput * const input)
+{
+	if (input->timeout <= 0) {
+		input->deadline = 0;
+		return;
+	}
+
+	input->deadline = av_gettime_relative()+input->timeout;
+}
+
+// Make what the input is doing fail, and anything it does after. Opening,
+// probing, and reading the input all return errors once they notice.
+//
+// Unlike the other functions, you may call this from any thread while another
+// uses the input.
 void
-vs_destroy_input(struct VSInput * const input)
+vs_cancel_input(struct VSInput * const input)
 {
 	if (!input) {
 		return;
 	}
 
-	if (input->format_ctx) {
-		avformat_close_input(&input->format_ctx);		
+	__atomic_store_n(&input->cancelled, 1, __ATOMIC_RELAXED);
+}
+
+// Return the index of the first stream of the given type that select matches
+// (any if select is NULL), or -1 if there is none.
+static int
+__vs_find_stream(AVFormatContext * const format_ctx,
+		const enum AVMediaType type, const char * const select,
+		const bool verbose)
+{
+	for (unsigned int i = 0; i < format_ctx->nb_streams; i++) {
+		AVStream * const in_stream = format_ctx->streams[i];
+
+		if (in_stream->codecpar->codec_type != type) {
+			if (verbose) {
+				__vs_log(VS_LOG_DEBUG, "skip non-%s stream %u", av_get_media_type_string(type), i);
+			}
+			continue;
+		}
+
+		if (select && strlen(select) > 0) {
+			const int match = __vs_match_stream(format_ctx, in_stream, select);
+			if (match < 0) {
+				__vs_log(VS_LOG_ERROR, "invalid stream selector: %s", select);
+				return -1;
+			}
+
+			if (match == 0) {
+				if (verbose) {
+					__vs_log(VS_LOG_DEBUG, "skip %s stream %u: not %s",
+							av_get_media_type_string(type), i, select);
+				}
+				continue;
+			}
+		}
+
+		return (int) i;
 	}
 
-	free(input);
+	return -1;
 }
 
-struct VSOutput *
-vs_open_output(const char * const output_format_name,
-		const char * const output_url, const struct VSInput * const input,
-		const bool verbose)
+// Check whether select matches the stream. select is either codec:name, such
+// as codec:h264, or an ffmpeg stream specifier, such as 2 (the stream with
+// index 2), v:1 (the second video stream), or #0x101 (the stream with that
+// ID).
+//
+// Returns 1 if it matches, 0 if not, or a negative AVERROR if select is
+// invalid.
+static int
+__vs_match_stream(AVFormatContext * const format_ctx, AVStream * const stream,
+		const char * const select)
 {
-	if (!output_format_name || strlen(output_format_name) == 0 ||
-			!output_url || strlen(output_url) == 0 ||
-			!input) {
-		printf("%s\n", strerror(EINVAL));
+	const char * const codec_prefix = "codec:";
+	if (strncmp(select, codec_prefix, strlen(codec_prefix)) == 0) {
+		const char * const codec = select+strlen(codec_prefix);
+		return strcmp(avcodec_get_name(stream->codecpar->codec_id), codec) == 0;
+	}
+
+	return avformat_match_stream_specifier(format_ctx, stream, select);
+}
+
+// Check whether we know enough about an audio stream to mux it without
+// probing. For AAC, the RTSP SDP tells us all of this.
+static bool
+__vs_have_audio_info(const AVCodecParameters * const codecpar)
+{
+	return codecpar->sample_rate > 0 && codecpar->channels > 0;
+}
+
+// Check whether we know enough about a video stream to mux it without
+// probing: its codec's extradata (e.g., SPS/PPS) and dimensions.
+//
+// Opening an RTSP input gives us the extradata from the SDP, but not the
+// dimensions. For H.264 we fill those in from the SPS.
+static bool
+__vs_have_stream_info(AVCodecParameters * const codecpar)
+{
+	if (!codecpar->extradata || codecpar->extradata_size <= 0) {
+		return false;
+	}
+
+	if (codecpar->width > 0 && codecpar->height > 0) {
+		return true;
+	}
+
+	if (codecpar->codec_id != AV_CODEC_ID_H264) {
+		return false;
+	}
+
+	int width = 0, height = 0;
+	if (__vs_h264_dimensions(codecpar->extradata,
+				(size_t) codecpar->extradata_size, &width, &height) != 0) {
+		return false;
+	}
+
+	codecpar->width = width;
+	codecpar->height = height;
+
+	return true;
+}
+
+// Reads bits from an H.264 NAL unit with emulation prevention bytes removed.
+struct __vs_bits {
+	const uint8_t * buf;
+	size_t size;
+	size_t pos;
+};
+
+static unsigned int
+__vs_read_bit(struct __vs_bits * const bits)
+{
+	if (bits->pos >= bits->size*8) {
+		// Reading past the end. The caller checks for this.
+		bits->pos++;
+		return 0;
+	}
+
+	unsigned int const bit = (bits->buf[bits->pos/8] >> (7-bits->pos%8)) & 1;
+	bits->pos++;
+	return bit;
+}
+
+static unsigned int
+__vs_read_bits(struct __vs_bits * const bits, int const n)
+{
+	unsigned int value = 0;
+	for (int i = 0; i < n; i++) {
+		value = (value << 1) | __vs_read_bit(bits);
+	}
+	return value;
+}
+
+// Read an unsigned Exp-Golomb code.
+static unsigned int
+__vs_read_ue(struct __vs_bits * const bits)
+{
+	int zeros = 0;
+	while (__vs_read_bit(bits) == 0) {
+		zeros++;
+		if (zeros > 31) {
+			return 0;
+		}
+	}
+
+	return (1U << zeros) - 1 + __vs_read_bits(bits, zeros);
+}
+
+// Read a signed Exp-Golomb code. We only ever skip these.
+static void
+__vs_skip_se(struct __vs_bits * const bits)
+{
+	(void) __vs_read_ue(bits);
+}
+
+// Find the first SPS in H.264 extradata and work out the picture dimensions
+// from it.
+//
+// The extradata is either an avcC box (mp4 style) or Annex B NAL units with
+// start codes (which is what RTSP gives us).
+//
+// Returns 0 on success, -1 on error.
+static int
+__vs_h264_dimensions(const uint8_t * const extradata,
+		const size_t extradata_size, int * const width, int * const height)
+{
+	const uint8_t * nal = NULL;
+	size_t nal_size = 0;
+
+	if (extradata_size > 8 && extradata[0] == 1) {
+		// avcC. The first SPS follows the 6 byte header and its 2 byte length.
+		nal_size = (size_t) (extradata[6] << 8 | extradata[7]);
+		nal = extradata+8;
+		if (nal_size > extradata_size-8) {
+			return -1;
+		}
+	} else {
+		// Annex B. Find a start code followed by an SPS NAL header (type 7).
+		for (size_t i = 0; i+3 < extradata_size; i++) {
+			if (extradata[i] != 0 || extradata[i+1] != 0 || extradata[i+2] != 1 ||
+					(extradata[i+3] & 0x1f) != 7) {
+				continue;
+			}
+
+			nal = extradata+i+3;
+			nal_size = extradata_size-i-3;
+
+			// It ends at the next start code.
+			for (size_t j = 0; j+2 < nal_size; j++) {
+				if (nal[j] == 0 && nal[j+1] == 0 && nal[j+2] <= 1) {
+					nal_size = j;
+					break;
+				}
+			}
+			break;
+		}
+	}
+
+	if (!nal || nal_size < 4 || (nal[0] & 0x1f) != 7) {
+		return -1;
+	}
+
+
+	// Remove emulation prevention bytes (00 00 03 becomes 00 00). Skip the NAL
+	// header.
+	uint8_t rbsp[256] = {0};
+	size_t rbsp_size = 0;
+	int zeros = 0;
+	for (size_t i = 1; i < nal_size && rbsp_size < sizeof(rbsp); i++) {
+		if (zeros >= 2 && nal[i] == 3) {
+			zeros = 0;
+			continue;
+		}
+
+		rbsp[rbsp_size++] = nal[i];
+		zeros = nal[i] == 0 ? zeros+1 : 0;
+	}
+
+	struct __vs_bits bits = { .buf = rbsp, .size = rbsp_size, .pos = 0 };
+
+
+	unsigned int const profile_idc = __vs_read_bits(&bits, 8);
+	(void) __vs_read_bits(&bits, 8); // Constraint flags.
+	(void) __vs_read_bits(&bits, 8); // Level.
+	(void) __vs_read_ue(&bits); // SPS ID.
+
+	unsigned int chroma_format_idc = 1;
+	unsigned int separate_colour_plane = 0;
+
+	if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 ||
+			profile_idc == 244 || profile_idc == 44 || profile_idc == 83 ||
+			profile_idc == 86 || profile_idc == 118 || profile_idc == 128 ||
+			profile_idc == 138 || profile_idc == 139 || profile_idc == 134 ||
+			profile_idc == 135) {
+		chroma_format_idc = __vs_read_ue(&bits);
+		if (chroma_format_idc == 3) {
+			separate_colour_plane = __vs_read_bit(&bits);
+		}
+		(void) __vs_read_ue(&bits); // Luma bit depth.
+		(void) __vs_read_ue(&bits); // Chroma bit depth.
+		(void) __vs_read_bit(&bits); // qpprime_y_zero_transform_bypass_flag.
+
+		if (__vs_read_bit(&bits)) {
+			// Scaling matrices. We skip over them.
+			int const lists = chroma_format_idc == 3 ? 12 : 8;
+			for (int i = 0; i < lists; i++) {
+				if (!__vs_read_bit(&bits)) {
+					continue;
+				}
+
+				int const size = i < 6 ? 16 : 64;
+				int last = 8, next = 8;
+				for (int j = 0; j < size; j++) {
+					if (next != 0) {
+						// delta_scale is se(v). We need its value to know when the list
+						// ends.
+						unsigned int const code = __vs_read_ue(&bits);
+						int const delta = code & 1 ? (int) ((code+1)/2) :
+							-(int) (code/2);
+						next = (last+delta+256) % 256;
+					}
+					last = next == 0 ? last : next;
+				}
+			}
+		}
+	}
+
+	(void) __vs_read_ue(&bits); // log2_max_frame_num_minus4.
+
+	unsigned int const poc_type = __vs_read_ue(&bits);
+	if (poc_type == 0) {
+		(void) __vs_read_ue(&bits); // log2_max_pic_order_cnt_lsb_minus4.
+	} else if (poc_type == 1) {
+		(void) __vs_read_bit(&bits); // delta_pic_order_always_zero_flag.
+		__vs_skip_se(&bits); // offset_for_non_ref_pic.
+		__vs_skip_se(&bits); // offset_for_top_to_bottom_field.
+		unsigned int const cycle = __vs_read_ue(&bits);
+		for (unsigned int i = 0; i < cycle && i < 256; i++) {
+			__vs_skip_se(&bits);
+		}
+	}
+
+	(void) __vs_read_ue(&bits); // max_num_ref_frames.
+	(void) __vs_read_bit(&bits); // gaps_in_frame_num_value_allowed_flag.
+
+	unsigned int const width_mbs = __vs_read_ue(&bits)+1;
+	unsigned int const height_map_units = __vs_read_ue(&bits)+1;
+	unsigned int const frame_mbs_only = __vs_read_bit(&bits);
+	if (!frame_mbs_only) {
+		(void) __vs_read_bit(&bits); // mb_adaptive_frame_field_flag.
+	}
+	(void) __vs_read_bit(&bits); // direct_8x8_inference_flag.
+
+	unsigned int crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+	if (__vs_read_bit(&bits)) {
+		crop_left = __vs_read_ue(&bits);
+		crop_right = __vs_read_ue(&bits);
+		crop_top = __vs_read_ue(&bits);
+		crop_bottom = __vs_read_ue(&bits);
+	}
+
+	if (bits.pos > bits.size*8) {
+		return -1;
+	}
+
+
+	// Cropping is in units that depend on the chroma format.
+	unsigned int crop_unit_x = 1, crop_unit_y = 2-frame_mbs_only;
+	if (!separate_colour_plane && chroma_format_idc != 0) {
+		crop_unit_x = chroma_format_idc == 3 ? 1 : 2;
+		crop_unit_y *= chroma_format_idc == 1 ? 2 : 1;
+	}
+
+	unsigned int const full_width = width_mbs*16;
+	unsigned int const full_height = (2-frame_mbs_only)*height_map_units*16;
+	unsigned int const crop_x = crop_unit_x*(crop_left+crop_right);
+	unsigned int const crop_y = crop_unit_y*(crop_top+crop_bottom);
+
+	if (crop_x >= full_width || crop_y >= full_height ||
+			full_width > 16384 || full_height > 16384) {
+		return -1;
+	}
+
+	*width = (int) (full_width-crop_x);
+	*height = (int) (full_height-crop_y);
+
+	return 0;
+}
+
+void
+vs_destroy_input(struct VSInput * const input)
+{
+	if (!input) {
+		return;
+	}
+
+	if (input->format_ctx) {
+		avformat_close_input(&input->format_ctx);		
+	}
+
+	free(input);
+}
+
+struct VSOutput *
+vs_open_output(const char * const output_format_name,
+		const char * const output_url, const struct VSInput * const input,
+		const bool verbose)
+{
+	if (!output_format_name || strlen(output_format_name) == 0 ||
+			!output_url || strlen(output_url) == 0 ||
+			!input) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(EINVAL));
+		return NULL;
+	}
+
+	struct VSOutput * const output = __vs_alloc_output(output_format_name,
+			input);
+	if (!output) {
+		return NULL;
+	}
+
+
+	if (verbose) {
+		av_dump_format(output->format_ctx, 0, output_url, 1);
+	}
+
+
+	// Open output file.
+	if (avio_open(&output->format_ctx->pb, output_url, AVIO_FLAG_WRITE) < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to open output file");
+		vs_destroy_output(output);
+		return NULL;
+	}
+
+
+	if (__vs_write_header(output) != 0) {
+		vs_destroy_output(output);
+		return NULL;
+	}
+
+	return output;
+}
+
+// Open an output that passes what the muxer writes to a callback rather than
+// writing to a URL.
+//
+// avio buffers up to buffer_size bytes before calling write_cb, and it calls
+// it after each packet we write. The header is passed to it before this
+// returns.
+//
+// fragment_mode says how to fragment the output. Smaller fragments reach
+// clients sooner. For VS_FRAGMENT_DURATION, fragment_duration is the most a
+// fragment may last, in microseconds.
+struct VSOutput *
+vs_open_output_callback(const char * const output_format_name,
+		const struct VSInput * const input, const vs_write_cb write_cb,
+		void * const opaque, const int buffer_size,
+		const enum VSFragmentMode fragment_mode, const int64_t fragment_duration,
+		const bool verbose)
+{
+	if (!output_format_name || strlen(output_format_name) == 0 || !input ||
+			!write_cb || buffer_size <= 0 ||
+			(fragment_mode == VS_FRAGMENT_DURATION && fragment_duration <= 0)) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(EINVAL));
+		return NULL;
+	}
+
+	struct VSOutput * const output = __vs_alloc_output(output_format_name,
+			input);
+	if (!output) {
+		return NULL;
+	}
+
+	output->custom_io = true;
+	output->fragment_mode = fragment_mode;
+	output->fragment_duration = fragment_duration;
+
+
+	if (verbose) {
+		av_dump_format(output->format_ctx, 0, "callback", 1);
+	}
+
+
+	unsigned char * const avio_buf = __vs_avio_buffer_get(buffer_size);
+	if (!avio_buf) {
+		__vs_log(VS_LOG_ERROR, "unable to allocate avio buffer");
+		vs_destroy_output(output);
+		return NULL;
+	}
+
+	// We have no seek callback, so the muxer sees the output as non-seekable,
+	// the same as a pipe.
+	output->format_ctx->pb = avio_alloc_context(avio_buf, buffer_size, 1,
+			opaque, NULL, write_cb, NULL);
+	if (!output->format_ctx->pb) {
+		__vs_log(VS_LOG_ERROR, "unable to allocate avio context");
+		__vs_avio_buffer_put(avio_buf, buffer_size);
+		vs_destroy_output(output);
+		return NULL;
+	}
+
+
+	if (__vs_write_header(output) != 0) {
+		vs_destroy_output(output);
+		return NULL;
+	}
+
+	return output;
+}
+
+// Take a buffer of the size from the pool, or allocate one if there is none.
+static unsigned char *
+__vs_avio_buffer_get(const int size)
+{
+	unsigned char * buf = NULL;
+
+	pthread_mutex_lock(&__vs_avio_pool.mutex);
+	for (int i = 0; i < __vs_avio_pool.count; i++) {
+		if (__vs_avio_pool.sizes[i] != size) {
+			continue;
+		}
+
+		buf = __vs_avio_pool.buffers[i];
+		__vs_avio_pool.count--;
+		__vs_avio_pool.buffers[i] = __vs_avio_pool.buffers[__vs_avio_pool.count];
+		__vs_avio_pool.sizes[i] = __vs_avio_pool.sizes[__vs_avio_pool.count];
+		break;
+	}
+	pthread_mutex_unlock(&__vs_avio_pool.mutex);
+
+	if (buf) {
+		return buf;
+	}
+
+	return av_malloc((size_t) size);
+}
+
+// Return a buffer to the pool, or free it if the pool is full. buf may be
+// NULL.
+static void
+__vs_avio_buffer_put(unsigned char * const buf, const int size)
+{
+	if (!buf) {
+		return;
+	}
+
+	pthread_mutex_lock(&__vs_avio_pool.mutex);
+	if (__vs_avio_pool.count < VS_AVIO_POOL_SIZE) {
+		__vs_avio_pool.buffers[__vs_avio_pool.count] = buf;
+		__vs_avio_pool.sizes[__vs_avio_pool.count] = size;
+		__vs_avio_pool.count++;
+		pthread_mutex_unlock(&__vs_avio_pool.mutex);
+		return;
+	}
+	pthread_mutex_unlock(&__vs_avio_pool.mutex);
+
+	av_free(buf);
+}
+
+// Create the output context and copy the input's video stream to it.
+static struct VSOutput *
+__vs_alloc_output(const char * const output_format_name,
+		const struct VSInput * const input)
+{
+	struct VSOutput * const output = calloc(1, sizeof(struct VSOutput));
+	if (!output) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(errno));
+		return NULL;
+	}
+
+	output->pkt = av_packet_alloc();
+	if (!output->pkt) {
+		__vs_log(VS_LOG_ERROR, "unable to allocate packet");
+		vs_destroy_output(output);
+		return NULL;
+	}
+
+
+	AVOutputFormat * const output_format = av_guess_format(output_format_name,
+			NULL, NULL);
+	if (!output_format) {
+		__vs_log(VS_LOG_ERROR, "output format not found");
+		vs_destroy_output(output);
+		return NULL;
+	}
+
+	if (avformat_alloc_output_context2(&output->format_ctx, output_format,
+				NULL, NULL) < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to create output context");
+		vs_destroy_output(output);
+		return NULL;
+	}
+
+
+	// Copy the video stream. It is always output stream 0.
+
+	if (__vs_add_stream(output,
+				input->format_ctx->streams[input->video_stream_index]) != 0) {
+		vs_destroy_output(output);
+		return NULL;
+	}
+
+
+	// Copy the audio stream, if the input has one and the format can hold
+	// it. It is output stream 1.
+
+	if (input->audio_stream_index != -1) {
+		const AVStream * const in_stream = input->format_ctx->streams[
+			input->audio_stream_index];
+
+		if (avformat_query_codec(output_format, in_stream->codecpar->codec_id,
+					FF_COMPLIANCE_NORMAL) != 1) {
+			__vs_log(VS_LOG_WARNING, "not carrying audio: output format %s can't hold %s",
+					output_format->name,
+					avcodec_get_name(in_stream->codecpar->codec_id));
+		} else if (__vs_add_stream(output, in_stream) != 0) {
+			vs_destroy_output(output);
+			return NULL;
+		}
+	}
+
+	// With more than one stream we let libavformat interleave packets by dts
+	// (see vs_write_packet()). Don't let it hold video long waiting on audio.
+	if (output->nb_streams > 1) {
+		output->format_ctx->max_interleave_delta = 500000;
+	}
+
+	return output;
+}
+
+// Add an output stream copying the input stream.
+//
+// Returns 0 on success, -1 on error.
+static int
+__vs_add_stream(struct VSOutput * const output,
+		const AVStream * const in_stream)
+{
+	if (output->nb_streams == VS_MAX_STREAMS) {
+		__vs_log(VS_LOG_ERROR, "too many streams");
+		return -1;
+	}
+
+	AVStream * const out_stream = avformat_new_stream(output->format_ctx, NULL);
+	if (!out_stream) {
+		__vs_log(VS_LOG_ERROR, "unable to add stream");
+		return -1;
+	}
+
+	if (avcodec_parameters_copy(out_stream->codecpar,
+				in_stream->codecpar) < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to copy codec parameters");
+		return -1;
+	}
+
+	struct VSOutputStream * const stream = &output->streams[output->nb_streams];
+	stream->last_dts = AV_NOPTS_VALUE;
+	stream->last_duration = 0;
+	stream->ts_offset = 0;
+	stream->in_time_base.num = 0;
+	stream->in_time_base.den = 0;
+	stream->rescale_mul = 1;
+	stream->rescale_div = 1;
+	output->nb_streams++;
+
+	return 0;
+}
+
+// Write the file header. The output must be open.
+//
+// Returns 0 on success, -1 on error.
+static int
+__vs_write_header(struct VSOutput * const output)
+{
+	AVDictionary * opts = NULL;
+
+	// -movflags frag_keyframe tells the mp4 muxer to fragment at each video
+	// keyframe. This is necessary for it to support output to a non-seekable
+	// file (e.g., pipe).
+	//
+	// -movflags isml+frag_keyframe is the same, except isml appears to be to
+	// make the output a live smooth streaming feed (as opposed to not live). I'm
+	// not sure the difference, but isml appears to be a microsoft
+	// format/protocol.
+	//
+	// To specify both, use isml+frag_keyframe as the value.
+	//
+	// I found that while Chrome had no trouble displaying the resulting mp4 with
+	// just frag_keyframe, Firefox would not until I also added empty_moov.
+	// empty_moov apparently writes some info at the start of the file.
+	//
+	// For smaller fragments, frag_custom has the muxer fragment only when we
+	// tell it to (see vs_write_packet()), and frag_duration makes it fragment
+	// after a duration too. default_base_moof makes each fragment's offsets
+	// relative to its own moof, as CMAF and MSE prefer for small fragments.
+	const char * movflags = "frag_keyframe+empty_moov";
+	switch (output->fragment_mode) {
+	case VS_FRAGMENT_GOP:
+		break;
+	case VS_FRAGMENT_FRAME:
+		movflags = "frag_custom+empty_moov+default_base_moof";
+		break;
+	case VS_FRAGMENT_DURATION:
+		movflags = "frag_keyframe+empty_moov+default_base_moof";
+		if (av_dict_set_int(&opts, "frag_duration", output->fragment_duration,
+					0) < 0) {
+			__vs_log(VS_LOG_ERROR, "unable to set frag_duration opt");
+			return -1;
+		}
+		break;
+	default:
+		__vs_log(VS_LOG_ERROR, "unknown fragment mode");
+		return -1;
+	}
+
+	if (av_dict_set(&opts, "movflags", movflags, 0) < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to set movflags opt");
+		av_dict_free(&opts);
+		return -1;
+	}
+
+	if (av_dict_set_int(&opts, "flush_packets", 1, 0) < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to set flush_packets opt");
+		av_dict_free(&opts);
+		return -1;
+	}
+
+	if (avformat_write_header(output->format_ctx, &opts) < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to write header");
+		av_dict_free(&opts);
+		return -1;
+	}
+
+
+	// Check any options that were not set. Because I'm not sure if all are
+	// appropriate to set through the avformat_write_header().
+	if (av_dict_count(opts) != 0) {
+		__vs_log(VS_LOG_ERROR, "some options not set");
+		av_dict_free(&opts);
+		return -1;
+	}
+
+	av_dict_free(&opts);
+
+
+	// Make sure the header reaches the output now rather than with the first
+	// packet.
+	avio_flush(output->format_ctx->pb);
+
+	return 0;
+}
+
+void
+vs_destroy_output(struct VSOutput * const output)
+{
+	if (!output) {
+		return;
+	}
+
+	if (output->format_ctx) {
+		// We might not have gotten as far as opening the output.
+		if (output->format_ctx->pb) {
+			if (av_write_trailer(output->format_ctx) != 0) {
+				__vs_log(VS_LOG_ERROR, "unable to write trailer");
+			}
+
+			if (output->custom_io) {
+				// We allocated the AVIOContext ourselves, so we free it rather than
+				// closing it. Its buffer goes back to the pool.
+				__vs_avio_buffer_put(output->format_ctx->pb->buffer,
+						output->format_ctx->pb->buffer_size);
+				output->format_ctx->pb->buffer = NULL;
+				avio_context_free(&output->format_ctx->pb);
+			} else if (avio_closep(&output->format_ctx->pb) != 0) {
+				__vs_log(VS_LOG_ERROR, "avio_closep failed");
+			}
+		}
+
+		avformat_free_context(output->format_ctx);
+	}
+
+	av_packet_free(&output->pkt);
+
+	free(output);
+}
+
+// Make the next packet we write follow on from the last one we wrote,
+// whatever its timestamps.
+//
+// Use this when the output's packets start coming from a new input, such as
+// after reopening the input. Clients of the output see one continuous stream.
+void
+vs_output_rebase(struct VSOutput * const output)
+{
+	if (!output) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(EINVAL));
+		return;
+	}
+
+	output->rebase = true;
+}
+
+// Check whether the output can take packets from the input. This is so if the
+// input's video stream (and audio stream, if we carry audio) has the same codec
+// parameters as the output's stream.
+bool
+vs_output_compatible(const struct VSOutput * const output,
+		const struct VSInput * const input)
+{
+	if (!output || !input) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(EINVAL));
+		return false;
+	}
+
+	if (!__vs_same_codec(input->format_ctx->streams[
+				input->video_stream_index]->codecpar,
+				output->format_ctx->streams[0]->codecpar)) {
+		return false;
+	}
+
+	// If we carry audio, the input must still have the same audio. If we don't,
+	// we just won't carry any it has now.
+	if (output->nb_streams > 1) {
+		if (input->audio_stream_index == -1) {
+			return false;
+		}
+
+		if (!__vs_same_codec(input->format_ctx->streams[
+					input->audio_stream_index]->codecpar,
+					output->format_ctx->streams[1]->codecpar)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool
+__vs_same_codec(const AVCodecParameters * const a,
+		const AVCodecParameters * const b)
+{
+	if (a->codec_id != b->codec_id ||
+			a->width != b->width ||
+			a->height != b->height ||
+			a->sample_rate != b->sample_rate ||
+			a->channels != b->channels ||
+			a->extradata_size != b->extradata_size) {
+		return false;
+	}
+
+	if (a->extradata_size > 0 && memcmp(a->extradata, b->extradata,
+				(size_t) a->extradata_size) != 0) {
+		return false;
+	}
+
+	return true;
+}
+
+// Return the output stream carrying the input stream, or -1 if none does.
+//
+// Output stream 0 carries the input's video, and output stream 1 (if there is
+// one) its audio. We go by which input streams are video and audio rather than
+// by index, as the indexes may change when we switch inputs.
+static int
+__vs_output_stream_index(const struct VSInput * const input,
+		const struct VSOutput * const output, const int input_index)
+{
+	if (input_index == input->video_stream_index) {
+		return 0;
+	}
+
+	if (output->nb_streams > 1 && input_index == input->audio_stream_index) {
+		return 1;
+	}
+
+	return -1;
+}
+
+// Read a compressed and encoded frame as a packet.
+//
+// Returns:
+// -1 if error
+// 0 if nothing useful read (e.g., a packet from a stream we don't read)
+// 1 if read a packet
+//
+// We give up if the read takes longer than the input's timeout, or if the
+// input is cancelled.
+int
+vs_read_packet(struct VSInput * const input, AVPacket * const pkt,
+		const bool verbose)
+{
+	if (!input || !pkt) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(errno));
+		return -1;
+	}
+
+	memset(pkt, 0, sizeof(AVPacket));
+
+	return __vs_read_packet(input, pkt, verbose);
+}
+
+// Read up to n packets from the input's video stream and, if it has one, its
+// audio stream into pkts, which must hold n empty packets. Check each packet's
+// stream_index to tell which it is.
+//
+// This is like calling vs_read_packet() until it returns n packets, but in one
+// call. We discard the input's other streams when opening it. If a demuxer
+// returns packets from them anyway, we drop those without counting them or
+// returning. Once we have a packet, we keep reading only until max_wait microseconds have passed since
+// the call began. Each read blocks until there is a packet, so waiting longer
+// means delaying the packets we have. 0 means return after the first.
+//
+// Returns:
+// -1 if error and we read no packets
+// Otherwise how many packets we read
+//
+// If a read fails after we read some packets, we return those. This and later
+// calls then return -1.
+int
+vs_read_packets(struct VSInput * const input, AVPacket ** const pkts,
+		const int n, const int64_t max_wait, const bool verbose)
+{
+	if (!input || !pkts || n <= 0) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(EINVAL));
+		return -1;
+	}
+
+	if (input->read_failed) {
+		return -1;
+	}
+
+	int64_t const start = av_gettime_relative();
+	int count = 0;
+
+	while (count < n) {
+		const int read_res = __vs_read_packet(input, pkts[count], verbose);
+		if (read_res == -1) {
+			input->read_failed = true;
+			return count > 0 ? count : -1;
+		}
+
+		if (read_res == 0) {
+			continue;
+		}
+
+		count++;
+
+		if (av_gettime_relative()-start >= max_wait) {
+			break;
+		}
+	}
+
+	return count;
+}
+
+// Read a packet into pkt, which must be empty. See vs_read_packet().
+static int
+__vs_read_packet(struct VSInput * const input, AVPacket * const pkt,
+		const bool verbose)
+{
+	// Read encoded frame (as a packet).
+
+	__vs_start_deadline(input);
+	int const read_res = av_read_frame(input->format_ctx, pkt);
+	if (read_res != 0) {
+		if (read_res == AVERROR_EXIT) {
+			if (__atomic_load_n(&input->cancelled, __ATOMIC_RELAXED)) {
+				__vs_log(VS_LOG_ERROR, "unable to read frame: input cancelled");
+			} else {
+				__vs_log(VS_LOG_ERROR, "unable to read frame: timed out");
+			}
+			return -1;
+		}
+
+		__vs_log(VS_LOG_ERROR, "unable to read frame: %s", av_err2str(read_res));
+		return -1;
+	}
+
+
+	// Ignore it if it's not our video or audio stream. We discard the other
+	// streams, but not every demuxer honours that.
+
+	if (pkt->stream_index != input->video_stream_index &&
+			pkt->stream_index != input->audio_stream_index) {
+		if (__vs_log_packet_enabled(verbose)) {
+			__vs_log(VS_LOG_TRACE, "skipping packet from input stream %d, our video is from stream %d",
+					pkt->stream_index, input->video_stream_index);
+		}
+
+		av_packet_unref(pkt);
+		return 0;
+	}
+
+
+	if (__vs_log_packet_enabled(verbose)) {
+		__vs_log_packet(input->format_ctx, pkt, "in");
+	}
+
+	__vs_fix_timestamps(input, pkt);
+
+	return 1;
+}
+
+// Make the packet's dts strictly increase on its stream, and set any unset
+// timestamps. We do this once as we read the packet, so every consumer of it
+// (the muxer, the transcoder, snapshots) sees the same timestamps.
+//
+// It is possible that the input is not well formed. Its dts (decompression
+// timestamp) may fluctuate. av_write_frame() says that the dts must be
+// strictly increasing.
+//
+// Packets from such inputs might look like:
+//
+// in: pts:18750 pts_time:0.208333 dts:18750 dts_time:0.208333 duration:3750 duration_time:0.0416667 stream_index:1
+// in: pts:0 pts_time:0 dts:0 dts_time:0 duration:3750 duration_time:0.0416667 stream_index:1
+//
+// dts here is 18750 and then 0.
+//
+// If we try to write the second packet as is, we'll see this error:
+// [mp4 @ 0x10f1ae0] Application provided invalid, non monotonically increasing dts to muxer in stream 1: 18750 >= 0
+//
+// This is apparently a fairly common problem. In ffmpeg.c (as of ffmpeg 3.2.4
+// at least) there is logic to rewrite the dts and warn if it happens. Let's do
+// the same.
+static void
+__vs_fix_timestamps(struct VSInput * const input, AVPacket * const pkt)
+{
+	const int slot = pkt->stream_index == input->video_stream_index ? 0 : 1;
+	int64_t * const last_dts = &input->last_dts[slot];
+	int * const dts_fixes = &input->dts_fixes[slot];
+
+	bool fix_dts = pkt->dts != AV_NOPTS_VALUE &&
+		*last_dts != AV_NOPTS_VALUE && pkt->dts <= *last_dts;
+
+	// It is also possible for input streams to include a packet with
+	// dts/pts=NOPTS after packets with dts/pts set. These won't be caught by the
+	// prior case. If we try to send these to the muxer however, we'll generate
+	// the same error (non monotonically increasing DTS) since the output packet
+	// will have dts/pts=0.
+	fix_dts |= pkt->dts == AV_NOPTS_VALUE && *last_dts != AV_NOPTS_VALUE;
+
+	// A broken input tends to need fixing for many packets in a row. We warn at
+	// the first of them, and say how many there were once it's over.
+	if (!fix_dts && *dts_fixes > 0) {
+		if (*dts_fixes > 1) {
+			__vs_log(VS_LOG_WARNING, "fixed non-monotonous DTS of %d packets in a row in input stream %d",
+					*dts_fixes, pkt->stream_index);
+		}
+		*dts_fixes = 0;
+	}
+
+	if (fix_dts) {
+		int64_t const next_dts = *last_dts+1;
+
+		__vs_log(*dts_fixes == 0 ? VS_LOG_WARNING : VS_LOG_TRACE,
+				"non-monotonous DTS in input stream %d. Previous: %" PRId64 " current: %" PRId64 ". changing to %" PRId64 ".",
+				pkt->stream_index, *last_dts, pkt->dts, next_dts);
+		(*dts_fixes)++;
+
+		// We also apparently (ffmpeg.c does this too) need to update the pts.
+		// Otherwise we see an error like:
+		//
+		// [mp4 @ 0x555e6825ea60] pts (3780) < dts (22531) in stream 0
+
+		if (pkt->pts != AV_NOPTS_VALUE && pkt->pts >= pkt->dts) {
+			pkt->pts = FFMAX(pkt->pts, next_dts);
+		}
+		// In the case where pkt->dts was AV_NOPTS_VALUE, pkt->pts can be
+		// AV_NOPTS_VALUE too which we fix as well.
+		if (pkt->pts == AV_NOPTS_VALUE) {
+			pkt->pts = next_dts;
+		}
+
+		pkt->dts = next_dts;
+	}
+
+	if (pkt->dts != AV_NOPTS_VALUE) {
+		*last_dts = pkt->dts;
+	}
+}
+
+// Start a thread reading packets from the input. The reader queues up to
+// queue_size packets (rounded up to a power of 2). Take them with
+// vs_reader_read().
+//
+// The thread stops once a read fails. Until you stop the reader, only its
+// thread may read from the input or look at its streams, as reading may add
+// streams. You may still write and decode its packets, which only use what we
+// copied from the streams when opening it (see VSInput).
+struct VSReader *
+vs_reader_start(struct VSInput * const input, const int queue_size,
+		const bool verbose)
+{
+	if (!input || queue_size <= 0) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(EINVAL));
+		return NULL;
+	}
+
+	struct VSReader * const reader = calloc(1, sizeof(struct VSReader));
+	if (!reader) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(errno));
+		return NULL;
+	}
+
+	reader->input = input;
+	reader->verbose = verbose;
+
+	reader->size = 1;
+	while (reader->size < (size_t) queue_size) {
+		reader->size *= 2;
+	}
+
+	atomic_init(&reader->head, 0);
+	atomic_init(&reader->tail, 0);
+	atomic_init(&reader->done, false);
+	atomic_init(&reader->stop, false);
+	atomic_init(&reader->waiting, 0);
+
+	reader->slots = calloc(reader->size, sizeof(AVPacket *));
+	if (!reader->slots) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(errno));
+		free(reader);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < reader->size; i++) {
+		reader->slots[i] = av_packet_alloc();
+		if (!reader->slots[i]) {
+			__vs_log(VS_LOG_ERROR, "unable to allocate packet");
+			__vs_reader_free(reader);
+			return NULL;
+		}
+	}
+
+	if (pthread_mutex_init(&reader->mutex, NULL) != 0) {
+		__vs_log(VS_LOG_ERROR, "unable to initialize mutex");
+		__vs_reader_free(reader);
+		return NULL;
+	}
+
+	if (pthread_cond_init(&reader->cond, NULL) != 0) {
+		__vs_log(VS_LOG_ERROR, "unable to initialize condition variable");
+		pthread_mutex_destroy(&reader->mutex);
+		__vs_reader_free(reader);
+		return NULL;
+	}
+
+	const int create_res = pthread_create(&reader->thread, NULL,
+			__vs_reader_run, reader);
+	if (create_res != 0) {
+		__vs_log(VS_LOG_ERROR, "unable to create reader thread: %s", strerror(create_res));
+		pthread_cond_destroy(&reader->cond);
+		pthread_mutex_destroy(&reader->mutex);
+		__vs_reader_free(reader);
+		return NULL;
+	}
+
+	return reader;
+}
+
+// Stop the reader's thread and free the reader, along with any packets it
+// still holds.
+//
+// This cancels the input (see vs_cancel_input()) to interrupt a read in
+// progress. The input is no good for reading after, but you must still destroy
+// it.
+void
+vs_reader_stop(struct VSReader * const reader)
+{
+	if (!reader) {
+		return;
+	}
+
+	atomic_store(&reader->stop, true);
+	vs_cancel_input(reader->input);
+
+	pthread_mutex_lock(&reader->mutex);
+	pthread_cond_broadcast(&reader->cond);
+	pthread_mutex_unlock(&reader->mutex);
+
+	pthread_join(reader->thread, NULL);
+
+	pthread_cond_destroy(&reader->cond);
+	pthread_mutex_destroy(&reader->mutex);
+	__vs_reader_free(reader);
+}
+
+// Take up to n packets the reader has read, moving them into pkts. pkts must
+// hold n empty packets. If there are none yet, we wait up to timeout
+// microseconds for some.
+//
+// Returns:
+// -1 if the reader stopped reading and we have taken every packet it read
+// 0 if there were no packets before the timeout
+// Otherwise how many packets we took
+int
+vs_reader_read(struct VSReader * const reader, AVPacket ** const pkts,
+		const int n, const int64_t timeout)
+{
+	if (!reader || !pkts || n <= 0) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(EINVAL));
+		return -1;
+	}
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += (time_t) (timeout/1000000);
+	deadline.tv_nsec += (long) (timeout%1000000)*1000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	size_t head = atomic_load_explicit(&reader->head, memory_order_relaxed);
+	bool timed_out = false;
+
+	while (1) {
+		// done must be loaded before tail. Once we see done, tail is final.
+		const bool done = atomic_load(&reader->done);
+		const size_t tail = atomic_load(&reader->tail);
+
+		int count = 0;
+		while (head != tail && count < n) {
+			av_packet_move_ref(pkts[count], reader->slots[head&(reader->size-1)]);
+			head++;
+			count++;
+		}
+
+		if (count > 0) {
+			atomic_store(&reader->head, head);
+			// The thread may be waiting for space.
+			__vs_reader_wake(reader);
+			return count;
+		}
+
+		if (done) {
+			return -1;
+		}
+
+		if (timed_out) {
+			return 0;
+		}
+
+		pthread_mutex_lock(&reader->mutex);
+		atomic_fetch_add(&reader->waiting, 1);
+		if (atomic_load(&reader->tail) == head && !atomic_load(&reader->done)) {
+			timed_out = pthread_cond_timedwait(&reader->cond, &reader->mutex,
+					&deadline) == ETIMEDOUT;
+		}
+		atomic_fetch_sub(&reader->waiting, 1);
+		pthread_mutex_unlock(&reader->mutex);
+	}
+}
+
+static void *
+__vs_reader_run(void * const arg)
+{
+	struct VSReader * const reader = arg;
+
+	while (1) {
+		const size_t tail = atomic_load_explicit(&reader->tail,
+				memory_order_relaxed);
+
+		if (!__vs_reader_wait_space(reader, tail)) {
+			break;
+		}
+
+		AVPacket * const pkt = reader->slots[tail&(reader->size-1)];
+		const int read_res = __vs_read_packet(reader->input, pkt, reader->verbose);
+		if (read_res == -1) {
+			break;
+		}
+
+		if (read_res == 0) {
+			continue;
+		}
+
+		atomic_store(&reader->tail, tail+1);
+		__vs_reader_wake(reader);
+	}
+
+	atomic_store(&reader->done, true);
+
+	pthread_mutex_lock(&reader->mutex);
+	pthread_cond_broadcast(&reader->cond);
+	pthread_mutex_unlock(&reader->mutex);
+
+	return NULL;
+}
+
+// Wait until the slot at tail is free. Returns false if we should stop
+// instead.
+static bool
+__vs_reader_wait_space(struct VSReader * const reader, const size_t tail)
+{
+	while (1) {
+		if (atomic_load(&reader->stop)) {
+			return false;
+		}
+
+		if (tail-atomic_load(&reader->head) < reader->size) {
+			return true;
+		}
+
+		pthread_mutex_lock(&reader->mutex);
+		atomic_fetch_add(&reader->waiting, 1);
+		if (tail-atomic_load(&reader->head) == reader->size &&
+				!atomic_load(&reader->stop)) {
+			pthread_cond_wait(&reader->cond, &reader->mutex);
+		}
+		atomic_fetch_sub(&reader->waiting, 1);
+		pthread_mutex_unlock(&reader->mutex);
+	}
+}
+
+// Wake the other side if it is sleeping. The sleeper increments waiting and
+// then checks the queue, and we update the queue and then check waiting. Both
+// are sequentially consistent, so either it sees our update or we see it
+// waiting. It holds the mutex from its check until it sleeps, so we can't
+// signal in between.
+static void
+__vs_reader_wake(struct VSReader * const reader)
+{
+	if (atomic_load(&reader->waiting) == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&reader->mutex);
+	pthread_cond_broadcast(&reader->cond);
+	pthread_mutex_unlock(&reader->mutex);
+}
+
+static void
+__vs_reader_free(struct VSReader * const reader)
+{
+	if (reader->slots) {
+		for (size_t i = 0; i < reader->size; i++) {
+			av_packet_free(&reader->slots[i]);
+		}
+		free(reader->slots);
+	}
+
+	free(reader);
+}
+
+// We do not change the packet or unref it. We change the pts, dts, duration,
+// and pos of a new reference to it. This means the caller may share the packet
+// with other consumers while we write it. Making the reference does not copy
+// the packet's data.
+//
+// Returns:
+// -1 if error
+// 1 if we wrote the packet
+int
+vs_write_packet(const struct VSInput * const input,
+		struct VSOutput * const output, const AVPacket * const in_pkt,
+		const bool verbose)
+{
+	if (!input || !output || !in_pkt) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(EINVAL));
+		return -1;
+	}
+
+	return __vs_write_packet(input, output, in_pkt, verbose);
+}
+
+// Write n packets, like calling vs_write_packet() for each, but in one call.
+//
+// Returns how many packets we wrote. If this is less than n, writing the next
+// one failed.
+int
+vs_write_packets(const struct VSInput * const input,
+		struct VSOutput * const output, const AVPacket * const * const pkts,
+		const int n, const bool verbose)
+{
+	if (!input || !output || !pkts || n < 0) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(EINVAL));
+		return 0;
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (__vs_write_packet(input, output, pkts[i], verbose) != 1) {
+			return i;
+		}
+	}
+
+	return n;
+}
+
+static int
+__vs_write_packet(const struct VSInput * const input,
+		struct VSOutput * const output, const AVPacket * const in_pkt,
+		const bool verbose)
+{
+	// The packet's stream index is its input stream's. We need the output
+	// stream's. If we don't carry the stream (e.g., audio the output format
+	// can't hold), there is nothing to write.
+	const int out_index = __vs_output_stream_index(input, output,
+			in_pkt->stream_index);
+	if (out_index == -1) {
+		if (__vs_log_packet_enabled(verbose)) {
+			__vs_log(VS_LOG_TRACE, "skipping packet from input stream %d, we don't output it",
+					in_pkt->stream_index);
+		}
+		return 1;
+	}
+
+	struct VSOutputStream * const stream = &output->streams[out_index];
+
+	// The input may be reading meanwhile, so we don't look at its streams. See
+	// VSInput. Its time base for the output stream's is at the same index.
+	const AVRational * const in_time_base = &input->time_base[out_index];
+
+	AVPacket * const pkt = output->pkt;
+	if (av_packet_ref(pkt, in_pkt) != 0) {
+		__vs_log(VS_LOG_ERROR, "unable to reference packet");
+		return -1;
+	}
+
+
+	if (pkt->stream_index != out_index) {
+		if (__vs_log_packet_enabled(verbose)) {
+			__vs_log(VS_LOG_TRACE, "updating packet stream index to %d (from %d)",
+					out_index, pkt->stream_index);
+		}
+
+		pkt->stream_index = out_index;
+	}
+
+
+	AVStream * const out_stream = output->format_ctx->streams[pkt->stream_index];
+	if (!out_stream) {
+		__vs_log(VS_LOG_ERROR, "output stream not found with stream index %d", pkt->stream_index);
+		av_packet_unref(pkt);
+		return -1;
+	}
+
+	// Convert timestamps to the output stream's time base. We leave unset ones
+	// unset for now.
+	if (stream->in_time_base.num != in_time_base->num ||
+			stream->in_time_base.den != in_time_base->den) {
+		__vs_set_rescale(stream, in_time_base, &out_stream->time_base);
+	}
+
+	if (pkt->pts != AV_NOPTS_VALUE) {
+		pkt->pts = __vs_rescale(stream, pkt->pts);
+	}
+
+	if (pkt->dts != AV_NOPTS_VALUE) {
+		pkt->dts = __vs_rescale(stream, pkt->dts);
+	}
+
+	pkt->duration = __vs_rescale(stream, pkt->duration);
+
+
+	// If we switched inputs (see vs_output_rebase()), the new input's
+	// timestamps have nothing to do with what we've written so far. Shift them
+	// so that the first packet from it follows on from the last one we wrote.
+	if (output->rebase && pkt->dts != AV_NOPTS_VALUE) {
+		__vs_rebase(output, out_index, pkt->dts, verbose);
+	}
+
+	if (pkt->pts != AV_NOPTS_VALUE) {
+		pkt->pts += stream->ts_offset;
+	}
+	if (pkt->dts != AV_NOPTS_VALUE) {
+		pkt->dts += stream->ts_offset;
+	}
+
+
+	// We fixed up the input's timestamps as we read them (see
+	// __vs_fix_timestamps()). Converting them to a coarser time base can still
+	// make two packets' dts the same, so keep dts strictly increasing here too.
+	// This compares in the output's time base, after any rebasing.
+	bool fix_dts = pkt->dts != AV_NOPTS_VALUE &&
+		stream->last_dts != AV_NOPTS_VALUE &&
+		pkt->dts <= stream->last_dts;
+
+	fix_dts |= pkt->dts == AV_NOPTS_VALUE && stream->last_dts != AV_NOPTS_VALUE;
+
+	if (fix_dts) {
+		int64_t const next_dts = stream->last_dts+1;
+
+		if (__vs_log_packet_enabled(verbose)) {
+			__vs_log(VS_LOG_TRACE, "dts %" PRId64 " is not after %" PRId64 " in the output's time base. changing to %" PRId64 ".",
+					pkt->dts, stream->last_dts, next_dts);
+		}
+
+		if (pkt->pts != AV_NOPTS_VALUE && pkt->pts >= pkt->dts) {
+			pkt->pts = FFMAX(pkt->pts, next_dts);
+		}
+		if (pkt->pts == AV_NOPTS_VALUE) {
+			pkt->pts = next_dts;
+		}
+
+		pkt->dts = next_dts;
+	}
+
+
+	// Set pts/dts if not set. Otherwise we will receive warnings like
+	//
+	// [mp4 @ 0x55688397bc40] Timestamps are unset in a packet for stream 0. This
+	// is deprecated and will stop working in the future. Fix your code to set
+	// the timestamps properly
+	//
+	// [mp4 @ 0x55688397bc40] Encoder did not produce proper pts, making some up.
+	if (pkt->pts == AV_NOPTS_VALUE) {
+		pkt->pts = 0;
+	}
+
+	if (pkt->dts == AV_NOPTS_VALUE) {
+		pkt->dts = 0;
+	}
+
+	pkt->pos = -1;
+
+
+	if (__vs_log_packet_enabled(verbose)) {
+		__vs_log_packet(output->format_ctx, pkt, "out");
+	}
+
+
+	// Track last dts we see (see where we use it for why).
+	stream->last_dts = pkt->dts;
+	stream->last_duration = pkt->duration;
+
+
+	// Write encoded frame (as a packet).
+
+	// With only video, av_write_frame() is enough, and skips buffering. With
+	// audio too, av_interleaved_write_frame() orders the streams' packets by
+	// dts for us. When we fragment every frame we don't, as it would hold the
+	// frame back. The muxer keeps each track's samples apart within a
+	// fragment anyway.
+	int write_res = 0;
+	if (output->nb_streams > 1 && output->fragment_mode != VS_FRAGMENT_FRAME) {
+		write_res = av_interleaved_write_frame(output->format_ctx, pkt);
+	} else {
+		write_res = av_write_frame(output->format_ctx, pkt);
+	}
+	av_packet_unref(pkt);
+	if (write_res != 0) {
+		__vs_log(VS_LOG_ERROR, "unable to write frame: %s", av_err2str(write_res));
+		return -1;
+	}
+
+	// Send the frame out in its own fragment right away, rather than when the
+	// next one arrives. Writing a NULL packet makes the muxer write the
+	// fragment it has.
+	if (output->fragment_mode == VS_FRAGMENT_FRAME && out_index == 0) {
+		const int flush_res = av_write_frame(output->format_ctx, NULL);
+		if (flush_res < 0) {
+			__vs_log(VS_LOG_ERROR, "unable to flush fragment: %s", av_err2str(flush_res));
+			return -1;
+		}
+		avio_flush(output->format_ctx->pb);
+	}
+
+	return 1;
+}
+
+// Work out how to convert timestamps from in to out, the stream's time base.
+static void
+__vs_set_rescale(struct VSOutputStream * const stream,
+		const AVRational * const in, const AVRational * const out)
+{
+	int64_t mul = (int64_t) in->num*out->den;
+	int64_t div = (int64_t) in->den*out->num;
+	const int64_t gcd = av_gcd(mul, div);
+	if (gcd > 1) {
+		mul /= gcd;
+		div /= gcd;
+	}
+
+	stream->in_time_base = *in;
+	stream->rescale_mul = mul;
+	stream->rescale_div = div;
+}
+
+// Convert a timestamp or duration to the stream's time base, rounding to the
+// nearest, as av_rescale_q_rnd() with AV_ROUND_NEAR_INF would.
+//
+// Time bases are often the same (such as 1/90000 for RTSP video and the MP4
+// muxer), or one is a whole multiple of the other. Then there is no rounding
+// and we need only multiply.
+static int64_t
+__vs_rescale(const struct VSOutputStream * const stream, const int64_t ts)
+{
+	if (stream->rescale_div == 1 && ts <= INT64_MAX/stream->rescale_mul &&
+			ts >= -INT64_MAX/stream->rescale_mul) {
+		return ts*stream->rescale_mul;
+	}
+
+	return av_rescale_rnd(ts, stream->rescale_mul, stream->rescale_div,
+			AV_ROUND_NEAR_INF);
+}
+
+// Set each output stream's timestamp offset so that the packet with the given
+// dts (on the given output stream, after rescaling) follows on from the last
+// packet we wrote on any stream. We use the same offset on every stream to keep
+// them in sync.
+static void
+__vs_rebase(struct VSOutput * const output, const int out_index,
+		const int64_t dts, const bool verbose)
+{
+	const AVRational time_base =
+		output->format_ctx->streams[out_index]->time_base;
+
+	bool have_next = false;
+	int64_t next = 0;
+	for (int i = 0; i < output->nb_streams; i++) {
+		const struct VSOutputStream * const stream = &output->streams[i];
+		if (stream->last_dts == AV_NOPTS_VALUE) {
+			continue;
+		}
+
+		const int64_t stream_next = av_rescale_q(
+				stream->last_dts+FFMAX(stream->last_duration, 1),
+				output->format_ctx->streams[i]->time_base, AV_TIME_BASE_Q);
+		if (!have_next || stream_next > next) {
+			next = stream_next;
+			have_next = true;
+		}
+	}
+
+	const int64_t offset = have_next ?
+		next-av_rescale_q(dts, time_base, AV_TIME_BASE_Q) : 0;
+
+	for (int i = 0; i < output->nb_streams; i++) {
+		output->streams[i].ts_offset = av_rescale_q(offset, AV_TIME_BASE_Q,
+				output->format_ctx->streams[i]->time_base);
+	}
+
+	if (verbose) {
+		__vs_log(VS_LOG_DEBUG, "rebasing timestamps by %" PRId64 " microseconds", offset);
+	}
+
+	output->rebase = false;
+}
+
+static void
+__vs_log_packet(const AVFormatContext * const format_ctx,
+		const AVPacket * const pkt, const char * const tag)
+{
+		AVRational * const time_base = &format_ctx->streams[pkt->stream_index]->time_base;
+
+		__vs_log(VS_LOG_TRACE, "%s: pts:%s pts_time:%s dts:%s dts_time:%s duration:%s duration_time:%s stream_index:%d",
+				tag, av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, time_base),
+				av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, time_base),
+				av_ts2str(pkt->duration), av_ts2timestr(pkt->duration, time_base),
+				pkt->stream_index);
+}
+
+// Open a decoder for the input's video stream.
+//
+// threads is how many threads to decode with, or 0 for as many as there are
+// CPUs. We have the decoder work on several frames at once (frame threading)
+// if the codec can.
+//
+// We decode in software. The encoders scale what we decode, which needs the
+// frames in memory anyway.
+struct VSDecoder *
+vs_decoder_open(const struct VSInput * const input, const int threads,
+		const bool verbose)
+{
+	if (!input || threads < 0) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(EINVAL));
+		return NULL;
+	}
+
+	const AVStream * const in_stream = input->format_ctx->streams[
+		input->video_stream_index];
+
+	struct VSDecoder * const decoder = calloc(1, sizeof(struct VSDecoder));
+	if (!decoder) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(errno));
+		return NULL;
+	}
+
+	decoder->time_base = in_stream->time_base;
+	decoder->last_pts = AV_NOPTS_VALUE;
+
+	const AVCodec * const codec = avcodec_find_decoder(
+			in_stream->codecpar->codec_id);
+	if (!codec) {
+		__vs_log(VS_LOG_ERROR, "no decoder for %s",
+				avcodec_get_name(in_stream->codecpar->codec_id));
+		vs_decoder_close(decoder);
+		return NULL;
+	}
+
+	decoder->codec_ctx = avcodec_alloc_context3(codec);
+	if (!decoder->codec_ctx) {
+		__vs_log(VS_LOG_ERROR, "unable to allocate decoder context");
+		vs_decoder_close(decoder);
+		return NULL;
+	}
+
+	if (avcodec_parameters_to_context(decoder->codec_ctx,
+				in_stream->codecpar) < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to copy codec parameters to decoder");
+		vs_decoder_close(decoder);
+		return NULL;
+	}
+
+	decoder->codec_ctx->pkt_timebase = decoder->time_base;
+	decoder->codec_ctx->framerate = in_stream->avg_frame_rate.num > 0 ?
+		in_stream->avg_frame_rate : in_stream->r_frame_rate;
+	decoder->codec_ctx->thread_count = threads;
+	decoder->codec_ctx->thread_type = FF_THREAD_FRAME|FF_THREAD_SLICE;
+
+	const int open_res = avcodec_open2(decoder->codec_ctx, codec, NULL);
+	if (open_res < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to open decoder: %s", av_err2str(open_res));
+		vs_decoder_close(decoder);
+		return NULL;
+	}
+
+	// Until a frame tells us how long it lasts, assume it lasts as long as the
+	// frame rate says.
+	const AVRational framerate = decoder->codec_ctx->framerate;
+	if (framerate.num > 0 && framerate.den > 0) {
+		decoder->last_duration = av_rescale(framerate.den, decoder->time_base.den,
+				(int64_t) framerate.num*decoder->time_base.num);
+	}
+
+	decoder->pkt = av_packet_alloc();
+	decoder->frame = av_frame_alloc();
+	if (!decoder->pkt || !decoder->frame) {
+		__vs_log(VS_LOG_ERROR, "unable to allocate decoder packet or frame");
+		vs_decoder_close(decoder);
+		return NULL;
+	}
+
+	if (verbose) {
+		__vs_log(VS_LOG_DEBUG, "decoding %s %dx%d with %d threads (0 is auto)",
+				codec->name, decoder->codec_ctx->width, decoder->codec_ctx->height,
+				threads);
+	}
+
+	return decoder;
+}
+
+void
+vs_decoder_close(struct VSDecoder * const decoder)
+{
+	if (!decoder) {
+		return;
+	}
+
+	avcodec_free_context(&decoder->codec_ctx);
+	av_packet_free(&decoder->pkt);
+	av_frame_free(&decoder->frame);
+
+	free(decoder);
+}
+
+// Pass the decoder a packet from the input. We decode only the input's video
+// stream, and ignore packets from its other streams. Like vs_write_packet(),
+// we do not change the packet.
+//
+// A NULL packet (and input) means the input is done. vs_decoder_receive()
+// then returns the frames the decoder still holds. After that the decoder
+// takes packets from a new input, and its frames follow on from the old
+// input's.
+//
+// Call vs_decoder_receive() until it returns 0 before sending another packet.
+//
+// Returns 0 on success, -1 on error.
+int
+vs_decoder_send(struct VSDecoder * const decoder,
+		const struct VSInput * const input, const AVPacket * const in_pkt,
+		const bool verbose)
+{
+	if (!decoder || (in_pkt && !input)) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(EINVAL));
+		return -1;
+	}
+
+	if (!in_pkt) {
+		const int flush_res = avcodec_send_packet(decoder->codec_ctx, NULL);
+		if (flush_res < 0 && flush_res != AVERROR_EOF) {
+			__vs_log(VS_LOG_ERROR, "unable to flush decoder: %s",
+					av_err2str(flush_res));
+			return -1;
+		}
+		return 0;
+	}
+
+	if (in_pkt->stream_index != input->video_stream_index) {
+		return 0;
+	}
+
+	AVPacket * const pkt = decoder->pkt;
+	if (av_packet_ref(pkt, in_pkt) != 0) {
+		__vs_log(VS_LOG_ERROR, "unable to reference packet");
+		return -1;
+	}
+
+	// The input may be reading meanwhile, so we use its copy of the time base.
+	// See VSInput.
+	av_packet_rescale_ts(pkt, input->time_base[0], decoder->time_base);
+
+	const int send_res = avcodec_send_packet(decoder->codec_ctx, pkt);
+	av_packet_unref(pkt);
+
+	// A damaged packet need not stop us. The decoder recovers at the next
+	// keyframe.
+	if (send_res == AVERROR_INVALIDDATA) {
+		__vs_log(VS_LOG_WARNING, "unable to decode packet: %s",
+				av_err2str(send_res));
+		return 0;
+	}
+
+	if (send_res < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to send packet to decoder: %s",
+				av_err2str(send_res));
+		return -1;
+	}
+
+	if (__vs_log_packet_enabled(verbose)) {
+		__vs_log(VS_LOG_TRACE, "decoding packet: pts:%s size:%d",
+				av_ts2str(in_pkt->pts), in_pkt->size);
+	}
+
+	return 0;
+}
+
+// Take the next frame the decoder has. It is in decoder->frame until the next
+// call. Its timestamps are in decoder->time_base, and always increase.
+//
+// Returns:
+// -1 if error
+// 0 if the decoder needs another packet
+// 1 if there is a frame
+int
+vs_decoder_receive(struct VSDecoder * const decoder, const bool verbose)
+{
+	if (!decoder) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(EINVAL));
+		return -1;
+	}
+
+	av_frame_unref(decoder->frame);
+
+	const int receive_res = avcodec_receive_frame(decoder->codec_ctx,
+			decoder->frame);
+	if (receive_res == AVERROR(EAGAIN)) {
+		return 0;
+	}
+
+	// We have every frame of the input. Get ready for the next one.
+	if (receive_res == AVERROR_EOF) {
+		avcodec_flush_buffers(decoder->codec_ctx);
+		decoder->rebase = true;
+		return 0;
+	}
+
+	if (receive_res < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to decode frame: %s",
+				av_err2str(receive_res));
+		return -1;
+	}
+
+	__vs_decoder_set_pts(decoder, decoder->frame, verbose);
+	return 1;
+}
+
+// Give the frame its timestamp: the decoder's best guess, shifted to follow on
+// from the frames before it if we switched inputs. A frame without one follows
+// on from the last frame. Encoders need timestamps to increase, so we make
+// sure they do.
+static void
+__vs_decoder_set_pts(struct VSDecoder * const decoder, AVFrame * const frame,
+		const bool verbose)
+{
+	int64_t pts = frame->best_effort_timestamp;
+	const int64_t next_pts = decoder->last_pts == AV_NOPTS_VALUE ? 0 :
+		decoder->last_pts+FFMAX(decoder->last_duration, 1);
+
+	if (pts != AV_NOPTS_VALUE && decoder->rebase) {
+		decoder->ts_offset = decoder->last_pts == AV_NOPTS_VALUE ? 0 :
+			next_pts-pts;
+		decoder->rebase = false;
+
+		if (verbose) {
+			__vs_log(VS_LOG_DEBUG, "rebasing decoded frames by %" PRId64,
+					decoder->ts_offset);
+		}
+	}
+
+	if (pts == AV_NOPTS_VALUE) {
+		pts = next_pts;
+	} else {
+		pts += decoder->ts_offset;
+	}
+
+	if (decoder->last_pts != AV_NOPTS_VALUE && pts <= decoder->last_pts) {
+		pts = decoder->last_pts+1;
+	}
+
+	frame->pts = pts;
+	decoder->last_pts = pts;
+	if (frame->pkt_duration > 0) {
+		decoder->last_duration = frame->pkt_duration;
+	}
+
+	if (__vs_log_packet_enabled(verbose)) {
+		__vs_log(VS_LOG_TRACE, "decoded frame: pts:%s keyframe:%d",
+				av_ts2str(frame->pts), frame->key_frame);
+	}
+}
+
+// Open an encoder for a rendition of the decoder's video.
+//
+// encoder_name is the encoder to use, such as libx264 or h264_nvenc. If it is
+// NULL or empty, we use the default H.264 encoder.
+//
+// To encode on a hardware device, give its type (such as vaapi, cuda, or qsv)
+// as hw_type, and the device (such as /dev/dri/renderD128) as hw_device, or
+// NULL or empty for the default one. The encoder must take frames on that kind
+// of device, such as h264_vaapi for vaapi. We scale on the CPU and upload the
+// frames.
+//
+// We scale to width x height. If one of them is 0 we pick it to keep the
+// input's aspect ratio, and if both are we keep the input's size. bit_rate is
+// in bits per second.
+//
+// threads is how many threads the encoder uses, or 0 for as many as there are
+// CPUs. We have it work on several frames at once (frame threading) if it can.
+// That delays its output by about a frame per thread.
+//
+// The encoder makes a keyframe wherever the input has one, so the rendition's
+// fragments line up with the input's.
+struct VSEncoder *
+vs_encoder_open(const struct VSDecoder * const decoder,
+		const char * const encoder_name, const char * const hw_type,
+		const char * const hw_device, const int width, const int height,
+		const int64_t bit_rate, const int threads, const bool verbose)
+{
+	if (!decoder || width < 0 || height < 0 || bit_rate <= 0 || threads < 0) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(EINVAL));
 		return NULL;
 	}
 
-	struct VSOutput * const output = calloc(1, sizeof(struct VSOutput));
-	if (!output) {
-		printf("%s\n", strerror(errno));
+	const AVCodecContext * const dec_ctx = decoder->codec_ctx;
+	if (dec_ctx->width <= 0 || dec_ctx->height <= 0) {
+		__vs_log(VS_LOG_ERROR, "input video size unknown");
 		return NULL;
 	}
 
+	struct VSEncoder * const encoder = calloc(1, sizeof(struct VSEncoder));
+	if (!encoder) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(errno));
+		return NULL;
+	}
 
-	AVOutputFormat * const output_format = av_guess_format(output_format_name,
-			NULL, NULL);
-	if (!output_format) {
-		printf("output format not found\n");
-		vs_destroy_output(output);
+	const AVCodec * const codec = encoder_name && strlen(encoder_name) > 0 ?
+		avcodec_find_encoder_by_name(encoder_name) :
+		avcodec_find_encoder(AV_CODEC_ID_H264);
+	if (!codec) {
+		__vs_log(VS_LOG_ERROR, "encoder not found: %s",
+				encoder_name && strlen(encoder_name) > 0 ? encoder_name : "h264");
+		vs_encoder_close(encoder);
 		return NULL;
 	}
 
-	if (avformat_alloc_output_context2(&output->format_ctx, output_format,
-				NULL, NULL) < 0) {
-		printf("unable to create output context\n");
-		vs_destroy_output(output);
+	encoder->codec_ctx = avcodec_alloc_context3(codec);
+	if (!encoder->codec_ctx) {
+		__vs_log(VS_LOG_ERROR, "unable to allocate encoder context");
+		vs_encoder_close(encoder);
 		return NULL;
 	}
 
+	AVCodecContext * const ctx = encoder->codec_ctx;
+
+	int out_width = width;
+	int out_height = height;
+	if (out_width == 0 && out_height == 0) {
+		out_width = dec_ctx->width;
+		out_height = dec_ctx->height;
+	} else if (out_width == 0) {
+		out_width = (int) av_rescale(out_height, dec_ctx->width, dec_ctx->height);
+	} else if (out_height == 0) {
+		out_height = (int) av_rescale(out_width, dec_ctx->height, dec_ctx->width);
+	}
 
-	// Copy the video stream.
+	// 4:2:0 needs an even size.
+	ctx->width = FFMAX(out_width & ~1, 2);
+	ctx->height = FFMAX(out_height & ~1, 2);
+	ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
+	ctx->time_base = decoder->time_base;
+	ctx->framerate = dec_ctx->framerate;
+	ctx->bit_rate = bit_rate;
+
+	// We make keyframes where the input has them (see vs_encoder_send()), so
+	// only make others if the input goes a long time without one. B-frames
+	// would delay each frame.
+	ctx->gop_size = 600;
+	ctx->max_b_frames = 0;
+
+	ctx->thread_count = threads;
+	ctx->thread_type = FF_THREAD_FRAME;
+
+	// MP4 holds the parameter sets in its header rather than in each keyframe.
+	ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	ctx->pix_fmt = codec->pix_fmts ? codec->pix_fmts[0] : AV_PIX_FMT_YUV420P;
+	enum AVPixelFormat sw_pix_fmt = ctx->pix_fmt;
+
+	if (hw_type && strlen(hw_type) > 0) {
+		if (__vs_encoder_hw_setup(encoder, hw_type, hw_device) != 0) {
+			vs_encoder_close(encoder);
+			return NULL;
+		}
+		sw_pix_fmt = ((AVHWFramesContext *) ctx->hw_frames_ctx->data)->sw_format;
+	}
 
-	AVStream * const out_stream = avformat_new_stream(output->format_ctx, NULL);
-	if (!out_stream) {
-		printf("unable to add stream\n");
-		vs_destroy_output(output);
+	// libx264 makes the keyframes we ask for IDR frames only with forced-idr.
+	// Other encoders ignore it.
+	AVDictionary * opts = NULL;
+	if (av_dict_set(&opts, "forced-idr", "1", 0) < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to set forced-idr opt");
+		vs_encoder_close(encoder);
 		return NULL;
 	}
 
-	AVStream * const in_stream = input->format_ctx->streams[
-		input->video_stream_index];
-
-	if (avcodec_parameters_copy(out_stream->codecpar,
-				in_stream->codecpar) < 0) {
-		printf("unable to copy codec parameters\n");
-		vs_destroy_output(output);
+	const int open_res = avcodec_open2(ctx, codec, &opts);
+	av_dict_free(&opts);
+	if (open_res < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to open encoder %s: %s", codec->name,
+				av_err2str(open_res));
+		vs_encoder_close(encoder);
 		return NULL;
 	}
 
+	encoder->scaled = av_frame_alloc();
+	if (!encoder->scaled) {
+		__vs_log(VS_LOG_ERROR, "unable to allocate frame");
+		vs_encoder_close(encoder);
+		return NULL;
+	}
 
-	if (verbose) {
-		av_dump_format(output->format_ctx, 0, output_url, 1);
+	encoder->scaled->format = sw_pix_fmt;
+	encoder->scaled->width = ctx->width;
+	encoder->scaled->height = ctx->height;
+	if (av_frame_get_buffer(encoder->scaled, 0) < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to allocate frame buffer");
+		vs_encoder_close(encoder);
+		return NULL;
 	}
 
+	if (ctx->hw_frames_ctx) {
+		encoder->hw_frame = av_frame_alloc();
+		if (!encoder->hw_frame) {
+			__vs_log(VS_LOG_ERROR, "unable to allocate frame");
+			vs_encoder_close(encoder);
+			return NULL;
+		}
+	}
 
-	// Open output file.
-	if (avio_open(&output->format_ctx->pb, output_url, AVIO_FLAG_WRITE) < 0) {
-		printf("unable to open output file\n");
-		vs_destroy_output(output);
+	if (__vs_encoder_stream(encoder) != 0) {
+		vs_encoder_close(encoder);
 		return NULL;
 	}
 
+	if (verbose) {
+		__vs_log(VS_LOG_DEBUG, "encoding %dx%d at %" PRId64 " bits/s with %s and %d threads (0 is auto)",
+				ctx->width, ctx->height, bit_rate, codec->name, threads);
+	}
 
-	// Write file header.
+	return encoder;
+}
 
-	AVDictionary * opts = NULL;
+// Set the encoder up to take frames on a hardware device of the given type.
+// We open the device, and give the encoder a pool of frames on it to upload
+// our frames to.
+//
+// Returns 0 on success, -1 on error.
+static int
+__vs_encoder_hw_setup(struct VSEncoder * const encoder,
+		const char * const hw_type, const char * const hw_device)
+{
+	AVCodecContext * const ctx = encoder->codec_ctx;
 
-	// -movflags frag_keyframe tells the mp4 muxer to fragment at each video
-	// keyframe. This is necessary for it to support output to a non-seekable
-	// file (e.g., pipe).
-	//
-	// -movflags isml+frag_keyframe is the same, except isml appears to be to
-	// make the output a live smooth streaming feed (as opposed to not live). I'm
-	// not sure the difference, but isml appears to be a microsoft
-	// format/protocol.
-	//
-	// To specify both, use isml+frag_keyframe as the value.
-	//
-	// I found that while Chrome had no trouble displaying the resulting mp4 with
-	// just frag_keyframe, Firefox would not until I also added empty_moov.
-	// empty_moov apparently writes some info at the start of the file.
-	if (av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov", 0) < 0) {
-		printf("unable to set movflags opt\n");
-		vs_destroy_output(output);
-		return NULL;
+	const enum AVHWDeviceType type = av_hwdevice_find_type_by_name(hw_type);
+	if (type == AV_HWDEVICE_TYPE_NONE) {
+		__vs_log(VS_LOG_ERROR, "unknown hardware device type: %s", hw_type);
+		return -1;
 	}
 
-	if (av_dict_set_int(&opts, "flush_packets", 1, 0) < 0) {
-		printf("unable to set flush_packets opt\n");
-		vs_destroy_output(output);
-		av_dict_free(&opts);
-		return NULL;
+	const enum AVPixelFormat hw_pix_fmt = __vs_hw_pix_fmt(type);
+	if (hw_pix_fmt == AV_PIX_FMT_NONE) {
+		__vs_log(VS_LOG_ERROR, "unable to encode on %s devices", hw_type);
+		return -1;
 	}
 
-	if (avformat_write_header(output->format_ctx, &opts) < 0) {
-		printf("unable to write header\n");
-		vs_destroy_output(output);
-		av_dict_free(&opts);
-		return NULL;
+	AVBufferRef * device_ctx = NULL;
+	const int device_res = av_hwdevice_ctx_create(&device_ctx, type,
+			hw_device && strlen(hw_device) > 0 ? hw_device : NULL, NULL, 0);
+	if (device_res < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to open %s device: %s", hw_type,
+				av_err2str(device_res));
+		return -1;
 	}
 
+	// The frames context holds its own reference to the device.
+	AVBufferRef * frames_ref = av_hwframe_ctx_alloc(device_ctx);
+	av_buffer_unref(&device_ctx);
+	if (!frames_ref) {
+		__vs_log(VS_LOG_ERROR, "unable to allocate hardware frames context");
+		return -1;
+	}
 
-	// Check any options that were not set. Because I'm not sure if all are
-	// appropriate to set through the avformat_write_header().
-	if (av_dict_count(opts) != 0) {
-		printf("some options not set\n");
-		vs_destroy_output(output);
-		av_dict_free(&opts);
-		return NULL;
+	AVHWFramesContext * const frames_ctx = (AVHWFramesContext *) frames_ref->data;
+	frames_ctx->format = hw_pix_fmt;
+	frames_ctx->sw_format = AV_PIX_FMT_NV12;
+	frames_ctx->width = ctx->width;
+	frames_ctx->height = ctx->height;
+	frames_ctx->initial_pool_size = 20;
+
+	const int init_res = av_hwframe_ctx_init(frames_ref);
+	if (init_res < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to set up hardware frames: %s",
+				av_err2str(init_res));
+		av_buffer_unref(&frames_ref);
+		return -1;
 	}
 
-	av_dict_free(&opts);
+	// The encoder takes our reference.
+	ctx->hw_frames_ctx = frames_ref;
+	ctx->pix_fmt = hw_pix_fmt;
+	return 0;
+}
 
+// Return the pixel format of frames on a device of the given type, or
+// AV_PIX_FMT_NONE if we don't encode on such devices.
+static enum AVPixelFormat
+__vs_hw_pix_fmt(const enum AVHWDeviceType type)
+{
+	// Not a switch: which devices there are depends on the libavutil version.
+	if (type == AV_HWDEVICE_TYPE_VAAPI) {
+		return AV_PIX_FMT_VAAPI;
+	}
+	if (type == AV_HWDEVICE_TYPE_CUDA) {
+		return AV_PIX_FMT_CUDA;
+	}
+	if (type == AV_HWDEVICE_TYPE_QSV) {
+		return AV_PIX_FMT_QSV;
+	}
+	return AV_PIX_FMT_NONE;
+}
+
+// Describe what the encoder produces as an input with one video stream. See
+// VSEncoder.
+//
+// Returns 0 on success, -1 on error.
+static int
+__vs_encoder_stream(struct VSEncoder * const encoder)
+{
+	encoder->stream = calloc(1, sizeof(struct VSInput));
+	if (!encoder->stream) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(errno));
+		return -1;
+	}
 
-	output->last_dts = AV_NOPTS_VALUE;
+	struct VSInput * const stream = encoder->stream;
+	stream->video_stream_index = 0;
+	stream->audio_stream_index = -1;
+	for (int i = 0; i < VS_MAX_STREAMS; i++) {
+		stream->last_dts[i] = AV_NOPTS_VALUE;
+	}
 
-	return output;
+	stream->format_ctx = avformat_alloc_context();
+	if (!stream->format_ctx) {
+		__vs_log(VS_LOG_ERROR, "unable to allocate format context");
+		return -1;
+	}
+
+	AVStream * const out_stream = avformat_new_stream(stream->format_ctx, NULL);
+	if (!out_stream) {
+		__vs_log(VS_LOG_ERROR, "unable to add stream");
+		return -1;
+	}
+
+	if (avcodec_parameters_from_context(out_stream->codecpar,
+				encoder->codec_ctx) < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to copy codec parameters from encoder");
+		return -1;
+	}
+
+	out_stream->time_base = encoder->codec_ctx->time_base;
+	stream->time_base[0] = out_stream->time_base;
+	return 0;
 }
 
 void
-vs_destroy_output(struct VSOutput * const output)
+vs_encoder_close(struct VSEncoder * const encoder)
 {
-	if (!output) {
+	if (!encoder) {
 		return;
 	}
 
-	if (output->format_ctx) {
-		if (av_write_trailer(output->format_ctx) != 0) {
-			printf("unable to write trailer\n");
-		}
-
-		if (avio_closep(&output->format_ctx->pb) != 0) {
-			printf("avio_closep failed\n");
-		}
+	avcodec_free_context(&encoder->codec_ctx);
+	sws_freeContext(encoder->sws_ctx);
+	av_frame_free(&encoder->scaled);
+	av_frame_free(&encoder->hw_frame);
 
-		avformat_free_context(output->format_ctx);
+	// We never opened the stream's format context, so we free it rather than
+	// closing it.
+	if (encoder->stream) {
+		avformat_free_context(encoder->stream->format_ctx);
+		free(encoder->stream);
 	}
 
-	free(output);
+	free(encoder);
 }
 
-// Read a compressed and encoded frame as a packet.
+// Pass the encoder a frame from its decoder. We scale it to the encoder's
+// size. We do not change the frame.
 //
-// Returns:
-// -1 if error
-// 0 if nothing useful read (e.g., non-video packet)
-// 1 if read a packet
+// A NULL frame flushes the encoder. vs_encoder_receive() then returns every
+// packet it has left.
+//
+// Call vs_encoder_receive() until it returns 0 before sending another frame.
+//
+// Returns 0 on success, -1 on error.
 int
-vs_read_packet(const struct VSInput * input, AVPacket * const pkt,
+vs_encoder_send(struct VSEncoder * const encoder, const AVFrame * const frame,
 		const bool verbose)
 {
-	if (!input || !pkt) {
-		printf("%s\n", strerror(errno));
+	if (!encoder) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(EINVAL));
 		return -1;
 	}
 
-	memset(pkt, 0, sizeof(AVPacket));
-
+	if (!frame) {
+		const int flush_res = avcodec_send_frame(encoder->codec_ctx, NULL);
+		if (flush_res < 0 && flush_res != AVERROR_EOF) {
+			__vs_log(VS_LOG_ERROR, "unable to flush encoder: %s",
+					av_err2str(flush_res));
+			return -1;
+		}
+		return 0;
+	}
 
-	// Read encoded frame (as a packet).
+	// The encoder may still hold the last frame we gave it. If so, this gives
+	// us a new buffer to scale into.
+	AVFrame * const scaled = encoder->scaled;
+	if (av_frame_make_writable(scaled) < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to make frame writable");
+		return -1;
+	}
 
-	if (av_read_frame(input->format_ctx, pkt) != 0) {
-		printf("unable to read frame\n");
+	// The frame's size or format may change, such as if the input changes.
+	encoder->sws_ctx = sws_getCachedContext(encoder->sws_ctx,
+			frame->width, frame->height, (enum AVPixelFormat) frame->format,
+			scaled->width, scaled->height, (enum AVPixelFormat) scaled->format,
+			SWS_BILINEAR, NULL, NULL, NULL);
+	if (!encoder->sws_ctx) {
+		__vs_log(VS_LOG_ERROR, "unable to scale %dx%d frames", frame->width,
+				frame->height);
 		return -1;
 	}
 
+	sws_scale(encoder->sws_ctx, (const uint8_t * const *) frame->data,
+			frame->linesize, 0, frame->height, scaled->data, scaled->linesize);
 
-	// Ignore it if it's not our video stream.
+	scaled->pts = frame->pts;
+	scaled->pict_type = frame->key_frame ? AV_PICTURE_TYPE_I :
+		AV_PICTURE_TYPE_NONE;
 
-	if (pkt->stream_index != input->video_stream_index) {
-		if (verbose) {
-			printf("skipping packet from input stream %d, our video is from stream %d\n",
-					pkt->stream_index, input->video_stream_index);
+	AVFrame * to_send = scaled;
+	if (encoder->hw_frame) {
+		AVFrame * const hw_frame = encoder->hw_frame;
+		av_frame_unref(hw_frame);
+
+		if (av_hwframe_get_buffer(encoder->codec_ctx->hw_frames_ctx, hw_frame,
+					0) < 0) {
+			__vs_log(VS_LOG_ERROR, "unable to get hardware frame");
+			return -1;
 		}
 
-		av_packet_unref(pkt);
-		return 0;
+		const int upload_res = av_hwframe_transfer_data(hw_frame, scaled, 0);
+		if (upload_res < 0) {
+			__vs_log(VS_LOG_ERROR, "unable to upload frame: %s",
+					av_err2str(upload_res));
+			return -1;
+		}
+
+		hw_frame->pts = scaled->pts;
+		hw_frame->pict_type = scaled->pict_type;
+		to_send = hw_frame;
 	}
 
+	const int send_res = avcodec_send_frame(encoder->codec_ctx, to_send);
+	if (send_res < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to send frame to encoder: %s",
+				av_err2str(send_res));
+		return -1;
+	}
 
-	if (verbose) {
-		__vs_log_packet(input->format_ctx, pkt, "in");
+	if (__vs_log_packet_enabled(verbose)) {
+		__vs_log(VS_LOG_TRACE, "encoding frame: pts:%s keyframe:%d",
+				av_ts2str(to_send->pts), frame->key_frame);
 	}
 
-	return 1;
+	return 0;
 }
 
-// We change the packet's pts, dts, duration, pos.
-//
-// We do not unref it.
+// Take the next packet the encoder has into pkt, replacing what pkt held. Its
+// timestamps are in the time base of the encoder's stream, ready for
+// vs_write_packet(encoder->stream, ...).
 //
 // Returns:
 // -1 if error
-// 1 if we wrote the packet
+// 0 if the encoder needs another frame, or has finished flushing
+// 1 if there is a packet
 int
-vs_write_packet(const struct VSInput * const input,
-		struct VSOutput * const output, AVPacket * const pkt, const bool verbose)
+vs_encoder_receive(struct VSEncoder * const encoder, AVPacket * const pkt,
+		const bool verbose)
 {
-	if (!input || !output || !pkt) {
-		printf("%s\n", strerror(EINVAL));
+	if (!encoder || !pkt) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(EINVAL));
 		return -1;
 	}
 
-	AVStream * const in_stream  = input->format_ctx->streams[pkt->stream_index];
-	if (!in_stream) {
-		printf("input stream not found with stream index %d\n", pkt->stream_index);
+	av_packet_unref(pkt);
+
+	const int receive_res = avcodec_receive_packet(encoder->codec_ctx, pkt);
+	if (receive_res == AVERROR(EAGAIN) || receive_res == AVERROR_EOF) {
+		return 0;
+	}
+
+	if (receive_res < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to encode frame: %s",
+				av_err2str(receive_res));
 		return -1;
 	}
 
+	pkt->stream_index = 0;
 
-	// If there are multiple input streams, then the stream index on the packet
-	// may not match the stream index in our output. We need to ensure the index
-	// matches. Note by this point we have checked that it is indeed a packet
-	// from the stream we want (we do this when reading the packet).
-	//
-	// As we only ever have a single output stream (one, video), the index will
-	// be 0.
-	if (pkt->stream_index != 0) {
-		if (verbose) {
-			printf("updating packet stream index to 0 (from %d)\n",
-					pkt->stream_index);
-		}
+	if (__vs_log_packet_enabled(verbose)) {
+		__vs_log_packet(encoder->stream->format_ctx, pkt, "encoded");
+	}
+
+	return 1;
+}
 
-		pkt->stream_index = 0;
+// Decode a keyframe packet from a video stream with the given codec
+// parameters, and encode the picture as a JPEG. quality is the JPEG quantizer
+// scale, from 2 (best) to 31.
+//
+// We open a decoder and an encoder for just this picture. This costs more than
+// keeping them open, but we don't need to decode every packet to have one
+// ready.
+//
+// Returns a packet holding the JPEG, which the caller frees with
+// av_packet_free(), or NULL on failure.
+AVPacket *
+vs_snapshot(const AVCodecParameters * const codecpar,
+		const AVPacket * const pkt, const int quality, const bool verbose)
+{
+	if (!codecpar || !pkt || quality < 2 || quality > 31) {
+		__vs_log(VS_LOG_ERROR, "%s", strerror(EINVAL));
+		return NULL;
 	}
 
+	AVFrame * frame = av_frame_alloc();
+	if (!frame) {
+		__vs_log(VS_LOG_ERROR, "unable to allocate frame");
+		return NULL;
+	}
 
-	AVStream * const out_stream = output->format_ctx->streams[pkt->stream_index];
-	if (!out_stream) {
-		printf("output stream not found with stream index %d\n", pkt->stream_index);
-		return -1;
+	if (__vs_snapshot_decode(codecpar, pkt, frame) != 0) {
+		av_frame_free(&frame);
+		return NULL;
 	}
 
-	// It is possible that the input is not well formed. Its dts (decompression
-	// timestamp) may fluctuate. av_write_frame() says that the dts must be
-	// strictly increasing.
-	//
-	// Packets from such inputs might look like:
-	//
-	// in: pts:18750 pts_time:0.208333 dts:18750 dts_time:0.208333 duration:3750 duration_time:0.0416667 stream_index:1
-	// in: pts:0 pts_time:0 dts:0 dts_time:0 duration:3750 duration_time:0.0416667 stream_index:1
-	//
-	// dts here is 18750 and then 0.
-	//
-	// If we try to write the second packet as is, we'll see this error:
-	// [mp4 @ 0x10f1ae0] Application provided invalid, non monotonically increasing dts to muxer in stream 1: 18750 >= 0
-	//
-	// This is apparently a fairly common problem. In ffmpeg.c (as of ffmpeg
-	// 3.2.4 at least) there is logic to rewrite the dts and warn if it happens.
-	// Let's do the same. Note my logic is a little different here.
-	bool fix_dts = pkt->dts != AV_NOPTS_VALUE &&
-		output->last_dts != AV_NOPTS_VALUE &&
-		pkt->dts <= output->last_dts;
+	AVPacket * jpeg = av_packet_alloc();
+	if (!jpeg) {
+		__vs_log(VS_LOG_ERROR, "unable to allocate packet");
+		av_frame_free(&frame);
+		return NULL;
+	}
 
-	// It is also possible for input streams to include a packet with
-	// dts/pts=NOPTS after packets with dts/pts set. These won't be caught by the
-	// prior case. If we try to send these to the encoder however, we'll generate
-	// the same error (non monotonically increasing DTS) since the output packet
-	// will have dts/pts=0.
-	fix_dts |= pkt->dts == AV_NOPTS_VALUE && output->last_dts != AV_NOPTS_VALUE;
+	if (__vs_snapshot_encode(frame, quality, jpeg) != 0) {
+		av_frame_free(&frame);
+		av_packet_free(&jpeg);
+		return NULL;
+	}
 
-	if (fix_dts) {
-		int64_t const next_dts = output->last_dts+1;
+	if (verbose) {
+		__vs_log(VS_LOG_DEBUG, "made %dx%d snapshot (%d bytes)", frame->width,
+				frame->height, jpeg->size);
+	}
 
-		if (verbose) {
-			printf("Warning: Non-monotonous DTS in input stream. Previous: %" PRId64 " current: %" PRId64 ". changing to %" PRId64 ".\n",
-					output->last_dts, pkt->dts, next_dts);
-		}
+	av_frame_free(&frame);
+	return jpeg;
+}
 
-		// We also apparently (ffmpeg.c does this too) need to update the pts.
-		// Otherwise we see an error like:
-		//
-		// [mp4 @ 0x555e6825ea60] pts (3780) < dts (22531) in stream 0
+// Decode the packet into frame.
+//
+// Returns 0 on success, -1 on error.
+static int
+__vs_snapshot_decode(const AVCodecParameters * const codecpar,
+		const AVPacket * const pkt, AVFrame * const frame)
+{
+	const AVCodec * const codec = avcodec_find_decoder(codecpar->codec_id);
+	if (!codec) {
+		__vs_log(VS_LOG_ERROR, "no decoder for %s",
+				avcodec_get_name(codecpar->codec_id));
+		return -1;
+	}
 
-		if (pkt->pts != AV_NOPTS_VALUE && pkt->pts >= pkt->dts) {
-			pkt->pts = FFMAX(pkt->pts, next_dts);
-		}
-		// In the case where pkt->dts was AV_NOPTS_VALUE, pkt->pts can be
-		// AV_NOPTS_VALUE too which we fix as well.
-		if (pkt->pts == AV_NOPTS_VALUE) {
-			pkt->pts = next_dts;
-		}
+	AVCodecContext * ctx = avcodec_alloc_context3(codec);
+	if (!ctx) {
+		__vs_log(VS_LOG_ERROR, "unable to allocate decoder context");
+		return -1;
+	}
 
-		pkt->dts = next_dts;
+	if (avcodec_parameters_to_context(ctx, codecpar) < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to copy codec parameters to decoder");
+		avcodec_free_context(&ctx);
+		return -1;
 	}
 
+	// One picture gains nothing from threads, and frame threads would hold it
+	// back until we flush.
+	ctx->thread_count = 1;
 
-	// Set pts/dts if not set. Otherwise we will receive warnings like
-	//
-	// [mp4 @ 0x55688397bc40] Timestamps are unset in a packet for stream 0. This
-	// is deprecated and will stop working in the future. Fix your code to set
-	// the timestamps properly
-	//
-	// [mp4 @ 0x55688397bc40] Encoder did not produce proper pts, making some up.
-	if (pkt->pts == AV_NOPTS_VALUE) {
-		pkt->pts = 0;
-	} else {
-		pkt->pts = av_rescale_q_rnd(pkt->pts, in_stream->time_base,
-				out_stream->time_base, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
+	const int open_res = avcodec_open2(ctx, codec, NULL);
+	if (open_res < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to open decoder: %s", av_err2str(open_res));
+		avcodec_free_context(&ctx);
+		return -1;
 	}
 
-	if (pkt->dts == AV_NOPTS_VALUE) {
-		pkt->dts = 0;
-	} else {
-		pkt->dts = av_rescale_q_rnd(pkt->dts, in_stream->time_base,
-				out_stream->time_base, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
+	// Send the packet and then flush, so the decoder gives us the picture even
+	// if it would usually wait for more.
+	int res = avcodec_send_packet(ctx, pkt);
+	if (res >= 0) {
+		res = avcodec_send_packet(ctx, NULL);
+	}
+	if (res >= 0) {
+		res = avcodec_receive_frame(ctx, frame);
 	}
 
-	pkt->duration = av_rescale_q(pkt->duration, in_stream->time_base,
-			out_stream->time_base);
-	pkt->pos = -1;
+	avcodec_free_context(&ctx);
+
+	if (res < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to decode keyframe: %s", av_err2str(res));
+		return -1;
+	}
 
+	return 0;
+}
 
-	if (verbose) {
-		__vs_log_packet(output->format_ctx, pkt, "out");
+// Encode the frame as a JPEG into pkt.
+//
+// Returns 0 on success, -1 on error.
+static int
+__vs_snapshot_encode(const AVFrame * const frame, const int quality,
+		AVPacket * const pkt)
+{
+	const AVCodec * const codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+	if (!codec) {
+		__vs_log(VS_LOG_ERROR, "no JPEG encoder");
+		return -1;
 	}
 
+	AVCodecContext * ctx = avcodec_alloc_context3(codec);
+	if (!ctx) {
+		__vs_log(VS_LOG_ERROR, "unable to allocate encoder context");
+		return -1;
+	}
 
-	// Track last dts we see (see where we use it for why).
-	output->last_dts = pkt->dts;
+	ctx->width = frame->width;
+	ctx->height = frame->height;
+	ctx->pix_fmt = AV_PIX_FMT_YUVJ420P;
+	ctx->sample_aspect_ratio = frame->sample_aspect_ratio;
+	ctx->time_base = (AVRational) {1, 25};
+	ctx->flags |= AV_CODEC_FLAG_QSCALE;
+	ctx->global_quality = FF_QP2LAMBDA*quality;
+
+	const int open_res = avcodec_open2(ctx, codec, NULL);
+	if (open_res < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to open JPEG encoder: %s",
+				av_err2str(open_res));
+		avcodec_free_context(&ctx);
+		return -1;
+	}
 
+	// Convert to full range 4:2:0, which is what JPEG holds.
+	AVFrame * picture = av_frame_alloc();
+	if (!picture) {
+		__vs_log(VS_LOG_ERROR, "unable to allocate frame");
+		avcodec_free_context(&ctx);
+		return -1;
+	}
 
-	// Write encoded frame (as a packet).
+	picture->format = ctx->pix_fmt;
+	picture->width = ctx->width;
+	picture->height = ctx->height;
+	if (av_frame_get_buffer(picture, 0) < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to allocate frame buffer");
+		av_frame_free(&picture);
+		avcodec_free_context(&ctx);
+		return -1;
+	}
 
-	// av_interleaved_write_frame() works too, but I don't think it is needed.
-	// Using av_write_frame() skips buffering.
-	const int write_res = av_write_frame(output->format_ctx, pkt);
-	if (write_res != 0) {
-		printf("unable to write frame: %s\n", av_err2str(write_res));
+	struct SwsContext * const sws_ctx = sws_getContext(frame->width,
+			frame->height, (enum AVPixelFormat) frame->format, picture->width,
+			picture->height, ctx->pix_fmt, SWS_BILINEAR, NULL, NULL, NULL);
+	if (!sws_ctx) {
+		__vs_log(VS_LOG_ERROR, "unable to convert %dx%d picture", frame->width,
+				frame->height);
+		av_frame_free(&picture);
+		avcodec_free_context(&ctx);
 		return -1;
 	}
 
-	return 1;
-}
+	sws_scale(sws_ctx, (const uint8_t * const *) frame->data, frame->linesize,
+			0, frame->height, picture->data, picture->linesize);
+	sws_freeContext(sws_ctx);
 
-static void
-__vs_log_packet(const AVFormatContext * const format_ctx,
-		const AVPacket * const pkt, const char * const tag)
-{
-		AVRational * const time_base = &format_ctx->streams[pkt->stream_index]->time_base;
+	picture->pts = 0;
+	picture->quality = ctx->global_quality;
+	picture->pict_type = AV_PICTURE_TYPE_I;
 
-		printf("%s: pts:%s pts_time:%s dts:%s dts_time:%s duration:%s duration_time:%s stream_index:%d\n",
-				tag, av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, time_base),
-				av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, time_base),
-				av_ts2str(pkt->duration), av_ts2timestr(pkt->duration, time_base),
-				pkt->stream_index);
+	int res = avcodec_send_frame(ctx, picture);
+	if (res >= 0) {
+		res = avcodec_send_frame(ctx, NULL);
+	}
+	if (res >= 0) {
+		res = avcodec_receive_packet(ctx, pkt);
+	}
+
+	av_frame_free(&picture);
+	avcodec_free_context(&ctx);
+
+	if (res < 0) {
+		__vs_log(VS_LOG_ERROR, "unable to encode JPEG: %s", av_err2str(res));
+		return -1;
+	}
+
+	return 0;
 }
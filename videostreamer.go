@@ -7,14 +7,17 @@ import (
 	"net"
 	"net/http"
 	"net/http/fcgi"
-	"os"
+	"strings"
 	"sync"
+	"time"
 	"unsafe"
 )
 
 // #include "videostreamer.h"
+// #include <errno.h>
 // #include <stdlib.h>
-// #cgo LDFLAGS: -lavformat -lavdevice -lavcodec -lavutil
+// extern int goWriteOutput(void *, uint8_t *, int);
+// #cgo LDFLAGS: -lavformat -lavdevice -lavcodec -lavutil -lswscale
 // #cgo CFLAGS: -std=c11
 // #cgo pkg-config: libavcodec
 import "C"
@@ -25,34 +28,71 @@ type Args struct {
 	ListenPort  int
 	InputFormat string
 	InputURL    string
-	Verbose     bool
+	// Inputs from the configuration file, if there is one. Otherwise the input
+	// from InputFormat and InputURL.
+	Inputs  []InputConfig
+	Verbose bool
 	// Serve with FCGI protocol (true) or HTTP (false).
 	FCGI bool
+	// How many bytes the muxer buffers before passing them to us.
+	AVIOBufferSize int
+	// How many GOPs a client may fall behind before we skip it ahead to the
+	// most recent keyframe.
+	MaxLag int
+	// How many times in a row we skip a client ahead before dropping it.
+	MaxSkips int
+	// The most bytes of fragments we gather into one write to a client, or 0
+	// to write through the http.ResponseWriter.
+	WriteCoalesce int
+	// The most clients we stream to at once, and the most bytes a second we
+	// send to them, or 0 for no limit. If OverloadRedirect is set, we redirect
+	// clients past a limit there. See Admission.
+	MaxClients       int
+	MaxEgress        int64
+	OverloadRedirect string
+	// What videostreamer.c logs: messages up to LogLevel, at most LogRate a
+	// second, and one in every LogSample per packet messages.
+	LogLevel  C.enum_VSLogLevel
+	LogRate   int
+	LogSample int
 }
 
 // HTTPHandler allows us to pass information to our request handlers.
 type HTTPHandler struct {
-	Verbose    bool
-	ClientChan chan<- *Client
+	Verbose  bool
+	Streams  *Streams
+	Segments *SegmentServer
+	MaxLag   int
+	MaxSkips int
+
+	// The most bytes of fragments we gather into one write to a client. If 0,
+	// we write each through the http.ResponseWriter instead of writing to the
+	// connection ourselves.
+	WriteCoalesce int
+
+	// Whether we have room for more clients.
+	Admission *Admission
 }
 
 // Client is servicing one HTTP client.
 type Client struct {
-	// Protect access to Output in particular. Destroying it when we clean up
-	// the client can race with packetWriter().
-	mutex *sync.RWMutex
-
-	// packetWriter goroutine writes out video packets to this pipe. HTTP
-	// goroutine reads from the read side.
-	OutPipe *os.File
-
-	// Reference to a media output context. Through this, the packetWriter
-	// goroutine writes packets to the write side of the pipe.
-	Output *C.struct_VSOutput
-
-	// Encoder writes packets to this channel, then the packetWriter goroutine
-	// writes them to the pipe.
-	PacketChan chan *C.AVPacket
+	// Once the encoder has the input open, it sends the ring holding the
+	// input's output on this channel. The HTTP goroutine reads fragments from
+	// it. If the encoder closes the channel instead, there is no output for the
+	// client.
+	RingChan chan *FragmentRing
+
+	// Which of the input's renditions the client wants, or "" for the input's
+	// own video. See Transcoder.
+	Rendition string
+
+	// The HTTP goroutine closes this when it is done with the client. The
+	// encoder stops counting the client then.
+	Done chan struct{}
+
+	// Whether the encoder sent the client a ring. Only the encoder accesses
+	// this.
+	attached bool
 }
 
 func main() {
@@ -62,19 +102,27 @@ func main() {
 	}
 
 	C.vs_setup()
+	setupCLog(args.LogLevel, args.LogRate, args.LogSample)
 
-	// Clients provide encoder info about themselves when they start up.
-	clientChan := make(chan *Client)
-
-	go encoder(args.InputFormat, args.InputURL, args.Verbose, clientChan)
+	// We start each input's encoder when a client first asks for it.
+	streams := newStreams(args.Inputs, args.Verbose, args.AVIOBufferSize)
 
 	// Start serving either with HTTP or FastCGI.
 
 	hostPort := fmt.Sprintf("%s:%d", args.ListenHost, args.ListenPort)
 
+	admission := newAdmission(args.MaxClients, args.MaxEgress,
+		args.OverloadRedirect)
+
 	handler := HTTPHandler{
-		Verbose:    args.Verbose,
-		ClientChan: clientChan,
+		Verbose:  args.Verbose,
+		Streams:  streams,
+		Segments: newSegmentServer(streams, admission),
+		MaxLag:   args.MaxLag,
+		MaxSkips: args.MaxSkips,
+
+		WriteCoalesce: args.WriteCoalesce,
+		Admission:     admission,
 	}
 
 	if args.FCGI {
@@ -110,8 +158,37 @@ func getArgs() (Args, error) {
 	listenPort := flag.Int("port", 8080, "Port to listen on.")
 	format := flag.String("format", "rtsp", "Input format. Example: rtsp for RTSP.")
 	input := flag.String("input", "rtsp://rtsp.stream/pattern", "Input URL valid for the given format. For RTSP you can provide a rtsp:// URL.")
-	verbose := flag.Bool("verbose", false, "Enable verbose logging output.")
+	linger := flag.Duration("linger", 0, "How long to keep an input open after its last client leaves. Inputs in the configuration file may set their own.")
+	readTimeout := flag.Duration("read-timeout", 10*time.Second, "How long opening or reading from an input may block before we give up on it and reconnect. 0 means no limit. Inputs in the configuration file may set their own.")
+	inputOptions := flag.String("input-options", "", "Options for opening the input, such as probesize=65536:rtsp_transport=tcp. Escape : and = in keys and values with \\, such as http_proxy=http\\://proxy\\:3128.")
+	readerThread := flag.Bool("reader-thread", false, "Read from the input on a dedicated C thread, and take packets from it in batches.")
+	fragment := flag.String("fragment", "gop", "How to fragment the output: gop (a fragment per GOP), frame (a fragment per frame, for the least latency), or duration (a fragment at each keyframe and every -fragment-duration).")
+	fragmentDuration := flag.Duration("fragment-duration", 0, "With -fragment duration, the most a fragment may last.")
+	dvr := flag.Duration("dvr", 0, "How much of the input's most recent output to keep so clients can start behind live, such as with /stream?offset=-30s. 0 means none.")
+	dvrSize := flag.Int("dvr-size", dvrDefaultSize, "The most bytes the DVR may use.")
+	dvrFile := flag.String("dvr-file", "", "Keep the DVR in a memory mapped file at this path rather than in memory. We create and remove it.")
+	record := flag.String("record", "", "Record the input to files in this directory while streaming it.")
+	recordDuration := flag.Duration("record-duration", recordDefaultDuration, "How long each recording file lasts.")
+	trace := flag.Bool("trace", false, "Note when packets and fragments pass each stage of the pipeline, for /metrics and /trace/{name}.")
+	recordSize := flag.Int("record-size", 0, "Start a new recording file once one reaches this many bytes. 0 means no limit.")
+	videoStream := flag.String("video-stream", "", "Which video stream to read, rather than the first: codec:name (such as codec:h264), or an ffmpeg stream specifier (such as v:1).")
+	audioStream := flag.String("audio-stream", "", "With -audio, which audio stream to read, like -video-stream.")
+	audio := flag.Bool("audio", false, "Carry the input's audio as well as its video, if the MP4 container can hold it (such as AAC).")
+	fastStart := flag.Bool("fast-start", false, "Open the input quickly: read little of it before streaming, and skip probing if possible.")
+	configFile := flag.String("config", "", "Configuration file listing named inputs (JSON). If given, we serve these inputs rather than the one from -format and -input.")
+	verbose := flag.Bool("verbose", false, "Enable verbose logging output. This is the same as -log-level debug.")
+	logLevel := flag.String("log-level", "info", "What to log: error, warning, info, debug, or trace. trace logs every packet.")
+	logRate := flag.Int("log-rate", 100, "The most messages a second to log from reading and muxing, other than errors. We drop the rest, and report how many. 0 means no limit.")
+	logSample := flag.Int("log-sample", 1, "With -log-level trace, log one in every this many packets.")
 	fcgiVar := flag.Bool("fcgi", false, "Serve using FastCGI (true) or as a regular HTTP server.")
+	maxLag := flag.Int("max-lag", 4, "GOPs a client may fall behind before we skip it ahead to the most recent keyframe.")
+	maxSkips := flag.Int("max-skips", 3, "Times we skip a client ahead without it catching up before we drop it.")
+	writeCoalesce := flag.Int("write-coalesce", 1024*1024, "The most bytes of fragments ready for a client that we gather into one vectored write. 0 means write each fragment through the HTTP server's buffering instead.")
+	maxClients := flag.Int("max-clients", 0, "The most clients we stream to at once, across every input. We turn away those past it. 0 means no limit.")
+	maxInputClients := flag.Int("max-input-clients", 0, "The most clients we stream an input to at once. 0 means no limit. Inputs in the configuration file may set their own.")
+	maxEgress := flag.Int64("max-egress", 0, "The most bytes a second we send to clients in all. We turn away new clients while we send this much. 0 means no limit.")
+	overloadRedirect := flag.String("overload-redirect", "", "Redirect clients we turn away to the same path on this videostreamer, such as http://peer:8080, rather than responding 503.")
+	avioBufferSize := flag.Int("avio-buffer-size", 1024*1024, "Bytes the muxer buffers before passing its output to us. A fragment up to this size reaches clients in one write.")
 
 	flag.Parse()
 
@@ -120,14 +197,153 @@ func getArgs() (Args, error) {
 		return Args{}, fmt.Errorf("you must provide a host")
 	}
 
-	if len(*format) == 0 {
+	var inputs []InputConfig
+	if len(*configFile) > 0 {
+		config, err := readConfig(*configFile)
+		if err != nil {
+			return Args{}, err
+		}
+		inputs = config.Inputs
+	} else {
+		if len(*format) == 0 {
+			flag.PrintDefaults()
+			return Args{}, fmt.Errorf("you must provide an input format")
+		}
+
+		if len(*input) == 0 {
+			flag.PrintDefaults()
+			return Args{}, fmt.Errorf("you must provide an input URL")
+		}
+
+		options, err := parseOptionString(*inputOptions)
+		if err != nil {
+			flag.PrintDefaults()
+			return Args{}, err
+		}
+
+		config := InputConfig{
+			Name:      "default",
+			Format:    *format,
+			URL:       *input,
+			Options:   options,
+			FastStart: *fastStart,
+
+			ReaderThread: *readerThread,
+			Audio:        *audio,
+			VideoStream:  *videoStream,
+			AudioStream:  *audioStream,
+			Fragment:     *fragment,
+		}
+		if *fragmentDuration != 0 {
+			d := Duration(*fragmentDuration)
+			config.FragmentDuration = &d
+		}
+		if *dvr != 0 {
+			d := Duration(*dvr)
+			config.DVR = &d
+			config.DVRSize = *dvrSize
+			config.DVRFile = *dvrFile
+		}
+		if *record != "" {
+			d := Duration(*recordDuration)
+			config.Record = *record
+			config.RecordDuration = &d
+			config.RecordSize = *recordSize
+		}
+		if err := config.validate(); err != nil {
+			flag.PrintDefaults()
+			return Args{}, err
+		}
+
+		inputs = []InputConfig{config}
+	}
+
+	if *linger < 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("linger must not be negative")
+	}
+
+	if *readTimeout < 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("read timeout must not be negative")
+	}
+
+	if *maxInputClients < 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("max input clients must not be negative")
+	}
+
+	for i := range inputs {
+		if *trace {
+			inputs[i].Trace = true
+		}
+		if inputs[i].Linger == nil {
+			d := Duration(*linger)
+			inputs[i].Linger = &d
+		}
+		if inputs[i].ReadTimeout == nil {
+			d := Duration(*readTimeout)
+			inputs[i].ReadTimeout = &d
+		}
+		if inputs[i].MaxClients == nil {
+			n := *maxInputClients
+			inputs[i].MaxClients = &n
+		}
+	}
+
+	if *maxLag <= 0 || *maxLag > fragmentRingSize {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("max lag must be between 1 and %d",
+			fragmentRingSize)
+	}
+
+	if *maxSkips < 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("max skips must not be negative")
+	}
+
+	if *writeCoalesce < 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("write coalesce must not be negative")
+	}
+
+	if *maxClients < 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("max clients must not be negative")
+	}
+
+	if *maxEgress < 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("max egress must not be negative")
+	}
+
+	if *overloadRedirect != "" && !validRedirect(*overloadRedirect) {
 		flag.PrintDefaults()
-		return Args{}, fmt.Errorf("you must provide an input format")
+		return Args{}, fmt.Errorf("overload redirect must be an http or https URL without a query")
 	}
 
-	if len(*input) == 0 {
+	if *avioBufferSize <= 0 {
 		flag.PrintDefaults()
-		return Args{}, fmt.Errorf("you must provide an input URL")
+		return Args{}, fmt.Errorf("you must provide a positive avio buffer size")
+	}
+
+	level, levelVerbose, err := parseLogLevel(*logLevel)
+	if err != nil {
+		flag.PrintDefaults()
+		return Args{}, err
+	}
+	if *verbose && !levelVerbose {
+		level = C.VS_LOG_DEBUG
+	}
+
+	if *logRate < 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("log rate must not be negative")
+	}
+
+	if *logSample < 1 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("log sample must be at least 1")
 	}
 
 	return Args{
@@ -135,86 +351,211 @@ func getArgs() (Args, error) {
 		ListenPort:  *listenPort,
 		InputFormat: *format,
 		InputURL:    *input,
-		Verbose:     *verbose,
+		Inputs:      inputs,
+		Verbose:     *verbose || levelVerbose,
 		FCGI:        *fcgiVar,
+
+		AVIOBufferSize: *avioBufferSize,
+		MaxLag:         *maxLag,
+		MaxSkips:       *maxSkips,
+		WriteCoalesce:  *writeCoalesce,
+		LogLevel:       level,
+		LogRate:        *logRate,
+		LogSample:      *logSample,
+
+		MaxClients:       *maxClients,
+		MaxEgress:        *maxEgress,
+		OverloadRedirect: strings.TrimSuffix(*overloadRedirect, "/"),
 	}, nil
 }
 
-func encoder(inputFormat, inputURL string, verbose bool,
+func encoder(config InputConfig, verbose bool, avioBufferSize int,
 	clientChan <-chan *Client) {
 	clients := []*Client{}
 	var input *Input
 
+	// When the last client left. We close the input once it has been idle for
+	// the linger time.
+	var idleSince time.Time
+
+	// Whether the input failed since we last opened it. We wait a while before
+	// opening it again.
+	failed := false
+
 	for {
-		// If there are no clients, then block waiting for one.
-		if len(clients) == 0 {
-			log.Printf("encoder: Waiting for clients...")
+		// If there are no clients and the input is closed, then block waiting for
+		// one. An always on input stays open regardless.
+		if len(clients) == 0 && input == nil && !config.AlwaysOn {
+			log.Printf("encoder %s: Waiting for clients...", config.Name)
 			client := <-clientChan
-			log.Printf("encoder: New client")
+			log.Printf("encoder %s: New client", config.Name)
 			clients = append(clients, client)
 			continue
 		}
 
-		// There is at least one client.
-
-		// Get any new clients, but don't block.
+		// Get any new clients, but don't block. Forget any that went away.
 		clientCountBefore := len(clients)
 		clients = acceptClients(clientChan, clients)
+		clients = removeDoneClients(clients)
 		clientCountAfter := len(clients)
 
 		if clientCountBefore != clientCountAfter {
-			log.Printf("encoder: %d clients", clientCountAfter)
+			log.Printf("encoder %s: %d clients", config.Name, clientCountAfter)
+		}
+
+		// If we get down to zero clients, close the input once we've lingered
+		// long enough. We keep reading in the meantime so that it is ready to go
+		// if a client arrives.
+		if len(clients) == 0 && input != nil && !config.AlwaysOn {
+			if idleSince.IsZero() {
+				idleSince = time.Now()
+			}
+
+			if time.Since(idleSince) >= time.Duration(*config.Linger) {
+				destroyInput(input)
+				input = nil
+				idleSince = time.Time{}
+				log.Printf("encoder %s: Closed input", config.Name)
+				continue
+			}
+		} else {
+			idleSince = time.Time{}
 		}
 
 		// Open the input if it is not open yet.
 		if input == nil {
-			input = openInput(inputFormat, inputURL, verbose)
+			input, clients = openInputRetrying(config, verbose, avioBufferSize,
+				clientChan, clients, failed)
+			failed = false
 			if input == nil {
-				log.Printf("encoder: Unable to open input")
+				log.Printf("encoder %s: No clients left, giving up opening input",
+					config.Name)
 				cleanupClients(clients)
 				return
 			}
 
 			if verbose {
-				log.Printf("encoder: Opened input")
+				log.Printf("encoder %s: Opened input", config.Name)
 			}
 		}
 
-		// Read a packet.
-		var pkt C.AVPacket
-		readRes := C.int(0)
-		// We might want to lock input here. It's probably not necessary though.
-		// Other goroutines should only be reading it. We're the writer.
-		readRes = C.vs_read_packet(input.vsInput, &pkt, C.bool(verbose))
-		if readRes == -1 {
-			log.Printf("encoder: Failure reading packet")
+		attachClients(clients, input.ring, input.transcoder)
+
+		// Read packets.
+		pkts, err := readPackets(input, verbose)
+		if err == errReadFailed {
+			log.Printf("encoder %s: Failure reading packet", config.Name)
+
+			clients, err = reconnectInput(config, verbose, input, clientChan, clients)
+			if err != nil {
+				log.Printf("encoder %s: Unable to reconnect: %s", config.Name, err)
+				destroyInput(input)
+				input = nil
+				cleanupClients(clients)
+				clients = nil
+				continue
+			}
+
+			log.Printf("encoder %s: Reconnected", config.Name)
+			continue
+		}
+		if err == nil {
+			err = muxPackets(input, pkts)
+		}
+		if err != nil {
+			// Clients lose the output. An always on input opens again.
+			log.Printf("encoder %s: %s", config.Name, err)
 			destroyInput(input)
+			input = nil
 			cleanupClients(clients)
-			return
+			clients = nil
+			if !config.AlwaysOn {
+				return
+			}
+			failed = true
 		}
+	}
+}
 
-		if readRes == 0 {
-			continue
+// Open the input, retrying with backoff while it is wanted: while it is always
+// on, or while clients wait for it. We accept clients meanwhile. If waitFirst
+// is set, such as when the input just failed, we wait before the first try.
+//
+// We return nil once no one wants the input.
+func openInputRetrying(config InputConfig, verbose bool, avioBufferSize int,
+	clientChan <-chan *Client, clients []*Client,
+	waitFirst bool) (*Input, []*Client) {
+	backoff := reconnectMinBackoff
+	for wait := waitFirst; ; wait = true {
+		if wait {
+			log.Printf("encoder %s: Opening input in %s", config.Name, backoff)
+			clients = waitForRetry(clientChan, clients, backoff)
+
+			clients = removeDoneClients(clients)
+			if len(clients) == 0 && !config.AlwaysOn {
+				return nil, clients
+			}
+
+			backoff *= 2
+			if backoff > reconnectMaxBackoff {
+				backoff = reconnectMaxBackoff
+			}
 		}
 
-		// Write the packet to all clients.
-		clientCountBefore = len(clients)
-		clients = writePacketToClients(input, &pkt, clients, verbose)
-		clientCountAfter = len(clients)
+		if input := openInput(config, verbose, avioBufferSize); input != nil {
+			return input, clients
+		}
+		log.Printf("encoder %s: Unable to open input", config.Name)
+	}
+}
 
-		if clientCountBefore != clientCountAfter {
-			log.Printf("encoder: %d clients", clientCountAfter)
+// Wait for d, accepting clients meanwhile.
+func waitForRetry(clientChan <-chan *Client, clients []*Client,
+	d time.Duration) []*Client {
+	timer := time.NewTimer(d)
+	for {
+		select {
+		case client := <-clientChan:
+			clients = append(clients, client)
+		case <-timer.C:
+			return clients
 		}
+	}
+}
 
-		C.av_packet_unref(&pkt)
+// Pass packets to the muxer, taking our references to them. We mux each once
+// and every client receives the resulting fragments.
+func muxPackets(input *Input, pkts []*SharedPacket) error {
+	for i, pkt := range pkts {
+		// After reconnecting, start from a video keyframe. Clients would not be
+		// able to decode what comes before it. We drop audio until then too.
+		if input.waitKeyframe {
+			if pkt.Packet.stream_index != input.vsInput.video_stream_index ||
+				pkt.Packet.flags&C.AV_PKT_FLAG_KEY == 0 {
+				input.metrics.PacketsDropped.Inc()
+				pkt.Release()
+				continue
+			}
+			input.waitKeyframe = false
+		}
 
-		// If we get down to zero clients, close the input.
-		if len(clients) == 0 {
-			destroyInput(input)
-			input = nil
-			log.Printf("encoder: Closed input")
+		if input.transcoder != nil {
+			input.transcoder.Send(input.vsInput, pkt)
+		}
+
+		if pkt.Packet.stream_index == input.vsInput.video_stream_index &&
+			pkt.Packet.flags&C.AV_PKT_FLAG_KEY != 0 {
+			input.snapshot.SetKeyframe(pkt)
+		}
+
+		if err := sendToMuxer(input, pkt); err != nil {
+			for _, pkt := range pkts[i+1:] {
+				pkt.Release()
+			}
+			return err
 		}
 	}
+	return nil
 }
 
 func acceptClients(clientChan <-chan *Client, clients []*Client) []*Client {
@@ -228,187 +569,681 @@ func acceptClients(clientChan <-chan *Client, clients []*Client) []*Client {
 	}
 }
 
+// Drop clients whose HTTP goroutine is done with them.
+func removeDoneClients(clients []*Client) []*Client {
+	clients2 := clients[:0]
+	for _, client := range clients {
+		select {
+		case <-client.Done:
+		default:
+			clients2 = append(clients2, client)
+		}
+	}
+	return clients2
+}
+
+// Send the ring holding what each client wants to any clients that don't have
+// it yet: ring, or one of the transcoder's. If we don't have it, such as if the
+// input's renditions failed to open, we close the client's channel instead.
+// transcoder may be nil.
+func attachClients(clients []*Client, ring *FragmentRing,
+	transcoder *Transcoder) {
+	for _, client := range clients {
+		if client.attached {
+			continue
+		}
+
+		clientRing := ring
+		if client.Rendition != "" {
+			clientRing = nil
+			if transcoder != nil {
+				clientRing = transcoder.Ring(client.Rendition)
+			}
+		}
+
+		if clientRing != nil {
+			client.RingChan <- clientRing
+		} else {
+			close(client.RingChan)
+		}
+		client.attached = true
+	}
+}
+
 func cleanupClients(clients []*Client) {
 	for _, client := range clients {
 		cleanupClient(client)
 	}
 }
 
+// Clients with a ring find out they are done when we close the ring. Closing
+// the channel tells the others.
 func cleanupClient(client *Client) {
-	client.mutex.Lock()
+	if !client.attached {
+		close(client.RingChan)
+	}
+}
+
+// Input represents a video input and the output we mux it to.
+type Input struct {
+	vsInput *C.struct_VSInput
+
+	metrics *InputMetrics
+	tracing bool
+
+	// We mux once for all clients. The muxer passes what it writes to the
+	// fragmenter (through goWriteOutput()), which splits it into fragments and
+	// stores them in the ring. Clients read from there.
+	output     *C.struct_VSOutput
+	fragmenter *Fragmenter
+	ring       *FragmentRing
+
+	// The muxer's callback receives this. It holds the fragmenter's ID.
+	outputID *C.uintptr_t
+
+	// If the input has renditions, this encodes them.
+	transcoder *Transcoder
+
+	// We keep the most recent keyframe here for /snapshot.
+	snapshot *Snapshot
+
+	// We read packets into shells from this pool.
+	packetPool *PacketPool
+
+	// The encoder passes packets to the muxer goroutine through this channel.
+	// The muxer goroutine owns output while it runs. It closes muxDone when it
+	// ends, after setting muxErr if it failed.
+	muxChan chan *SharedPacket
+	muxDone chan struct{}
+	muxErr  error
+
+	// The muxer signals this when it receives a nil packet. It then has written
+	// every packet before it.
+	muxFlushed chan struct{}
+
+	// Whether we skip packets until a keyframe. We do after reconnecting.
+	waitKeyframe bool
+
+	// We read packets in batches into the shells in readBatch. readBatchC
+	// holds the shells' AVPackets for C. We return the packets we read in
+	// readOut. If reader is set, a C thread reads from vsInput and we take
+	// packets from it.
+	reader     *C.struct_VSReader
+	readBatch  []*SharedPacket
+	readBatchC **C.AVPacket
+	readOut    []*SharedPacket
+}
+
+// How many fragments each ring holds. With a fragment per keyframe, a client
+// may fall behind by this many GOPs before being dropped.
+const fragmentRingSize = 8
+
+// How many fragments a ring holds when fragments are smaller than a GOP. At 30
+// frames per second with a fragment per frame, this is about 17 seconds.
+const chunkedRingSize = 512
+
+// How many bytes a DVR uses by default.
+const dvrDefaultSize = 256 * 1024 * 1024
+
+// How long we wait before trying to reopen an input after reading from it
+// failed. We double the wait after each failed attempt, up to the maximum.
+const reconnectMinBackoff = 500 * time.Millisecond
+const reconnectMaxBackoff = 30 * time.Second
+
+// How many packets we take from a reader thread at once, and how long we wait
+// for them. We stop waiting so that we can look after clients.
+const readBatchSize = 16
+const readBatchTimeout = 100 * time.Millisecond
+
+// How many packets the muxer writes at once, at most.
+const writeBatchSize = 16
+
+// How many packets may wait for the muxer. We wait for it if it falls further
+// behind than this.
+const muxQueueSize = 64
+
+// The muxer calls into Go to pass us its output. C must not keep Go pointers,
+// so we give it an ID to look up the fragmenter with.
+var outputs = struct {
+	mutex      *sync.RWMutex
+	fragmenter map[uintptr]*Fragmenter
+	nextID     uintptr
+}{
+	mutex:      &sync.RWMutex{},
+	fragmenter: map[uintptr]*Fragmenter{},
+}
+
+func openInput(config InputConfig, verbose bool, avioBufferSize int) *Input {
+	metrics := metricsFor(config.Name)
+
+	vsInput := openVSInput(config, verbose)
+	if vsInput == nil {
+		metrics.OpenFailures.Inc()
+		return nil
+	}
 
-	// Closing write side will make read side receive EOF.
-	if client.OutPipe != nil {
-		_ = client.OutPipe.Close()
-		client.OutPipe = nil
+	var dvr *DVR
+	if config.hasDVR() {
+		var err error
+		dvr, err = newDVR(time.Duration(*config.DVR), config.dvrSize(),
+			config.DVRFile)
+		if err != nil {
+			log.Printf("Unable to create DVR: %s", err)
+			C.vs_destroy_input(vsInput)
+			return nil
+		}
 	}
 
-	if client.Output != nil {
-		C.vs_destroy_output(client.Output)
-		client.Output = nil
+	ring := newFragmentRing(config.ringSize(), dvr)
+
+	input := &Input{
+		vsInput:    vsInput,
+		metrics:    metrics,
+		tracing:    config.Trace,
+		snapshot:   snapshotFor(config.Name),
+		fragmenter: newFragmenter(ring, metrics),
+		ring:       ring,
+		packetPool: newPacketPool(muxQueueSize),
+		muxChan:    make(chan *SharedPacket, muxQueueSize),
+		muxDone:    make(chan struct{}),
+		muxFlushed: make(chan struct{}),
+		readBatch:  make([]*SharedPacket, readBatchSize),
+		readBatchC: (**C.AVPacket)(C.calloc(C.size_t(readBatchSize),
+			C.size_t(unsafe.Sizeof((*C.AVPacket)(nil))))),
 	}
 
-	client.mutex.Unlock()
+	input.fragmenter.tracing = config.Trace
 
-	if client.PacketChan != nil {
-		close(client.PacketChan)
+	if err := input.snapshot.SetInput(vsInput); err != nil {
+		log.Printf("Unable to set up snapshots: %s", err)
+	}
 
-		// Drain it. The packetWriter should be draining it too. However it is
-		// possible that it ended.
-		//
-		// Note one may think that draining both here and in the packetWriter could
-		// lead to the unfortunate likelihood that the client will receive some
-		// packets but not others, leading to corruption. But since we closed the
-		// write side of the pipe above, this will not happen. No further packets
-		// will be reaching the client.
-		for pkt := range client.PacketChan {
-			C.av_packet_free(&pkt)
+	input.output, input.outputID = openOutput(config, verbose, avioBufferSize,
+		input.vsInput, input.fragmenter)
+	if input.output == nil {
+		close(input.muxDone)
+		destroyInput(input)
+		return nil
+	}
+
+	go muxer(input, verbose)
+
+	// If we can't transcode, we still serve the input's own video.
+	if len(config.Renditions) > 0 {
+		transcoder, err := openTranscoder(config, vsInput, verbose,
+			avioBufferSize)
+		if err != nil {
+			log.Printf("Unable to start transcoding: %s", err)
+		} else {
+			input.transcoder = transcoder
+			transcoder.Start(input)
 		}
+	}
 
-		client.PacketChan = nil
+	if config.ReaderThread {
+		if !startReader(input, verbose) {
+			destroyInput(input)
+			return nil
+		}
 	}
+
+	return input
 }
 
-// Input represents a video input.
-type Input struct {
-	mutex   *sync.RWMutex
-	vsInput *C.struct_VSInput
+// Start a C thread reading from the input.
+func startReader(input *Input, verbose bool) bool {
+	input.reader = C.vs_reader_start(input.vsInput, C.int(muxQueueSize),
+		C.bool(verbose))
+	if input.reader == nil {
+		log.Printf("Unable to start reader")
+		return false
+	}
+	return true
 }
 
-func openInput(inputFormat, inputURL string, verbose bool) *Input {
-	inputFormatC := C.CString(inputFormat)
-	inputURLC := C.CString(inputURL)
+// Stop the input's reader thread, if it has one. This leaves the input
+// unusable for reading (see vs_reader_stop()).
+func stopReader(input *Input) {
+	if input.reader == nil {
+		return
+	}
+	C.vs_reader_stop(input.reader)
+	input.reader = nil
+}
 
-	input := C.vs_open_input(inputFormatC, inputURLC, C.bool(verbose))
-	if input == nil {
-		C.free(unsafe.Pointer(inputFormatC))
-		C.free(unsafe.Pointer(inputURLC))
-		return nil
+// errReadFailed means reading from the input failed. We may be able to
+// reconnect to it.
+var errReadFailed = fmt.Errorf("failure reading packet")
+
+// Read packets from the input. We hold a reference to each packet we return.
+//
+// Without a reader thread we read until we have a video packet. We don't wait
+// for more after it as that would delay it. With a reader thread we take
+// however many the thread has ready. We may return no packets.
+func readPackets(input *Input, verbose bool) ([]*SharedPacket, error) {
+	// Give C a shell for each slot we handed on last time.
+	shellsC := (*[1 << 20]*C.AVPacket)(unsafe.Pointer(input.readBatchC))
+	shells := shellsC[:readBatchSize:readBatchSize]
+	for i, pkt := range input.readBatch {
+		if pkt != nil {
+			continue
+		}
+		pkt = input.packetPool.Get()
+		if pkt == nil {
+			return nil, fmt.Errorf("unable to allocate packet")
+		}
+		input.readBatch[i] = pkt
+		shells[i] = pkt.Packet
+	}
+
+	start := time.Now()
+	var readRes C.int
+	if input.reader == nil {
+		readRes = C.vs_read_packets(input.vsInput, input.readBatchC,
+			C.int(readBatchSize), 0, C.bool(verbose))
+	} else {
+		readRes = C.vs_reader_read(input.reader, input.readBatchC,
+			C.int(readBatchSize), C.int64_t(readBatchTimeout/time.Microsecond))
+	}
+	if readRes == -1 {
+		return nil, errReadFailed
+	}
+
+	n := int(readRes)
+	if n > 0 {
+		input.metrics.ReadTime.ObserveDuration(start)
 	}
+	var now time.Time
+	if input.tracing && n > 0 {
+		now = time.Now()
+	}
+	size := uint64(0)
+	input.readOut = append(input.readOut[:0], input.readBatch[:n]...)
+	for i := 0; i < n; i++ {
+		size += uint64(input.readBatch[i].Packet.size)
+		input.readBatch[i].ReadAt = now
+		input.readBatch[i] = nil
+	}
+	input.metrics.PacketsRead.Add(uint64(n))
+	input.metrics.BytesRead.Add(size)
+	return input.readOut, nil
+}
+
+// Open the input itself. This is the part of an Input we replace when we
+// reconnect.
+func openVSInput(config InputConfig, verbose bool) *C.struct_VSInput {
+	defer metricsFor(config.Name).OpenTime.ObserveDuration(time.Now())
+
+	inputFormatC := C.CString(config.Format)
+	inputURLC := C.CString(config.URL)
+	optionsC := C.CString(config.optionString())
+	videoStreamC := C.CString(config.VideoStream)
+	audioStreamC := C.CString(config.AudioStream)
+
+	timeout := time.Duration(*config.ReadTimeout) / time.Microsecond
+
+	vsInput := C.vs_open_input(inputFormatC, inputURLC, optionsC, videoStreamC,
+		audioStreamC, C.bool(config.FastStart), C.bool(config.Audio),
+		C.int64_t(timeout), C.bool(verbose))
 	C.free(unsafe.Pointer(inputFormatC))
 	C.free(unsafe.Pointer(inputURLC))
+	C.free(unsafe.Pointer(optionsC))
+	C.free(unsafe.Pointer(videoStreamC))
+	C.free(unsafe.Pointer(audioStreamC))
+	return vsInput
+}
+
+// Reopen the input after reading from it failed, such as when a camera
+// reboots.
+//
+// We keep the output and its ring, so clients stay connected. They see the
+// video pause and then continue. The output shifts the new input's timestamps
+// to follow on from what it already wrote.
+//
+// We retry with backoff, accepting clients meanwhile. We give up if no clients
+// remain (unless the input is always on), or if the input's video changed such
+// that the output can't take it.
+func reconnectInput(config InputConfig, verbose bool, input *Input,
+	clientChan <-chan *Client, clients []*Client) ([]*Client, error) {
+	// The muxer and transcoder use the input. Let them finish with it before we
+	// replace it.
+	if err := flushMuxer(input); err != nil {
+		return clients, err
+	}
+	if input.transcoder != nil {
+		input.transcoder.Flush()
+	}
+
+	stopReader(input)
+	C.vs_destroy_input(input.vsInput)
+	input.vsInput = nil
+
+	start := time.Now()
+	backoff := reconnectMinBackoff
+	for {
+		log.Printf("encoder %s: Reconnecting in %s", config.Name, backoff)
+
+		timer := time.NewTimer(backoff)
+	Wait:
+		for {
+			select {
+			case client := <-clientChan:
+				clients = append(clients, client)
+				attachClients(clients, input.ring, input.transcoder)
+			case <-timer.C:
+				break Wait
+			}
+		}
+
+		clients = removeDoneClients(clients)
+		if len(clients) == 0 && !config.AlwaysOn {
+			return clients, fmt.Errorf("no clients")
+		}
+
+		vsInput := openVSInput(config, verbose)
+		if vsInput == nil {
+			input.metrics.OpenFailures.Inc()
+			backoff *= 2
+			if backoff > reconnectMaxBackoff {
+				backoff = reconnectMaxBackoff
+			}
+			continue
+		}
+
+		if !C.vs_output_compatible(input.output, vsInput) {
+			C.vs_destroy_input(vsInput)
+			return clients, fmt.Errorf("input video changed")
+		}
 
-	return &Input{
-		mutex:   &sync.RWMutex{},
-		vsInput: input,
+		input.vsInput = vsInput
+		C.vs_output_rebase(input.output)
+		if err := input.snapshot.SetInput(vsInput); err != nil {
+			log.Printf("encoder %s: Unable to set up snapshots: %s", config.Name,
+				err)
+		}
+		input.waitKeyframe = true
+
+		if config.ReaderThread && !startReader(input, verbose) {
+			return clients, fmt.Errorf("unable to start reader")
+		}
+
+		input.metrics.Reconnects.Inc()
+		input.metrics.ReconnectTime.ObserveDuration(start)
+		return clients, nil
 	}
 }
 
 func destroyInput(input *Input) {
-	input.mutex.Lock()
-	defer input.mutex.Unlock()
+	// The reader thread uses the input, so stop it first.
+	stopReader(input)
+	for _, pkt := range input.readBatch {
+		if pkt != nil {
+			pkt.Release()
+		}
+	}
+	input.readBatch = nil
+	if input.readBatchC != nil {
+		C.free(unsafe.Pointer(input.readBatchC))
+		input.readBatchC = nil
+	}
+
+	// Stop the muxer before we destroy what it uses. Release any packets it did
+	// not get to.
+	close(input.muxChan)
+	<-input.muxDone
+	for pkt := range input.muxChan {
+		if pkt != nil {
+			pkt.Release()
+		}
+	}
+
+	if input.transcoder != nil {
+		input.transcoder.close()
+		input.transcoder = nil
+	}
+
+	input.snapshot.Clear()
+
+	input.ring.Close()
+	if dvr := input.ring.DVR(); dvr != nil {
+		dvr.Close()
+	}
+
+	closeOutput(input.output, input.outputID)
+	input.output = nil
+	input.outputID = nil
 
 	if input.vsInput != nil {
 		C.vs_destroy_input(input.vsInput)
 		input.vsInput = nil
 	}
+
+	input.packetPool.Close()
 }
 
-// Try to write the packet to each client. If we fail, we clean up the client
-// and it will not be in the returned list of clients.
-func writePacketToClients(input *Input, pkt *C.AVPacket,
-	clients []*Client, verbose bool) []*Client {
-	// Rewrite clients slice with only those we succeeded in writing to. If we
-	// failed for some reason we clean up the client and no longer send it
-	// anything further.
-	clients2 := []*Client{}
+// Hand our reference to the packet to the input's muxer goroutine.
+//
+// If the muxer failed, we release the packet and return why.
+func sendToMuxer(input *Input, pkt *SharedPacket) error {
+	// Check first so we don't keep queueing packets to a muxer that's gone.
+	select {
+	case <-input.muxDone:
+		pkt.Release()
+		return input.muxErr
+	default:
+	}
 
-	for _, client := range clients {
-		// Open the client's output if it is not yet open.
-		client.mutex.Lock()
-		if client.Output == nil {
-			outputFormat := "mp4"
-			outputURL := fmt.Sprintf("pipe:%d", client.OutPipe.Fd())
-			client.Output = openOutput(outputFormat, outputURL, verbose, input)
-			if client.Output == nil {
-				log.Printf("Unable to open output for client")
-				cleanupClient(client)
-				client.mutex.Unlock()
-				continue
-			}
+	select {
+	case input.muxChan <- pkt:
+		return nil
+	case <-input.muxDone:
+		pkt.Release()
+		return input.muxErr
+	}
+}
 
-			// We pass packets to the client via this channel. We give each client
-			// its own goroutine for the purposes of receiving these packets and
-			// writing them to the write side of the pipe. We do it this way rather
-			// than directly here because we do not want the encoder to block waiting
-			// on a write to the write side of the pipe because there is a slow HTTP
-			// client.
-			client.PacketChan = make(chan *C.AVPacket, 32)
+// Wait until the muxer has written every packet we sent it.
+//
+// If the muxer failed, we return why.
+func flushMuxer(input *Input) error {
+	select {
+	case input.muxChan <- nil:
+	case <-input.muxDone:
+		return input.muxErr
+	}
 
-			go packetWriter(client, input, verbose)
+	select {
+	case <-input.muxFlushed:
+		return nil
+	case <-input.muxDone:
+		return input.muxErr
+	}
+}
 
-			log.Printf("Opened output for client")
+// Receive packets from the encoder and write them to the input's output.
+//
+// This runs at the same time as the encoder reads from the input. That is safe
+// as vs_write_packet() doesn't look at the input's streams, which reading may
+// change. It only uses the stream indexes and time bases VSInput copied when
+// we opened the input. When the encoder replaces the input, it first waits
+// for us to finish with the old one (see flushMuxer()).
+//
+// We end when the encoder closes the channel, or if we encounter a write
+// error.
+func muxer(input *Input, verbose bool) {
+	defer close(input.muxDone)
+
+	batch := make([]*SharedPacket, 0, writeBatchSize)
+	batchC := (**C.AVPacket)(C.calloc(C.size_t(writeBatchSize),
+		C.size_t(unsafe.Sizeof((*C.AVPacket)(nil)))))
+	defer C.free(unsafe.Pointer(batchC))
+
+	for pkt := range input.muxChan {
+		// Take whatever else is waiting too, and write it all in one call. A nil
+		// packet asks us to signal once we've written what came before it.
+		batch = append(batch[:0], pkt)
+		flush := pkt == nil
+	Gather:
+		for !flush && len(batch) < writeBatchSize {
+			select {
+			case pkt, ok := <-input.muxChan:
+				if !ok {
+					break Gather
+				}
+				batch = append(batch, pkt)
+				flush = pkt == nil
+			default:
+				break Gather
+			}
+		}
+		if flush {
+			batch = batch[:len(batch)-1]
 		}
-		client.mutex.Unlock()
 
-		// Duplicate the packet. Each client's goroutine will receive a copy.
-		pktCopy := C.av_packet_clone(pkt)
-		if pktCopy == nil {
-			log.Printf("Unable to clone packet")
-			cleanupClient(client)
-			continue
+		var start time.Time
+		if input.tracing && len(batch) > 0 {
+			start = time.Now()
+			for _, pkt := range batch {
+				if !pkt.ReadAt.IsZero() {
+					input.metrics.MuxQueueTime.Observe(int64(start.Sub(pkt.ReadAt)))
+				}
+			}
+			if input.fragmenter.traceRead.IsZero() {
+				input.fragmenter.traceRead = batch[0].ReadAt
+			}
 		}
 
-		// Pass the packet to a goroutine that writes it to this client.
-		select {
-		case client.PacketChan <- pktCopy:
-		default:
-			log.Printf("Client too slow")
-			C.av_packet_free(&pktCopy)
-			cleanupClient(client)
-			continue
+		err := writePackets(input, batch, batchC, verbose)
+		if !start.IsZero() {
+			input.metrics.MuxTime.ObserveDuration(start)
+		}
+		for _, pkt := range batch {
+			pkt.Release()
+		}
+		if err != nil {
+			input.muxErr = err
+			return
+		}
+
+		if flush {
+			input.muxFlushed <- struct{}{}
 		}
+	}
+}
 
-		// Successful so far. Keep the client around.
-		clients2 = append(clients2, client)
+// Write the packets to the input's output. What the muxer writes goes to the
+// fragmenter. batchC must have room for the packets.
+func writePackets(input *Input, pkts []*SharedPacket, batchC **C.AVPacket,
+	verbose bool) error {
+	if len(pkts) == 0 {
+		return nil
 	}
 
-	return clients2
+	batch := (*[1 << 20]*C.AVPacket)(unsafe.Pointer(batchC))[:len(pkts):len(pkts)]
+	for i, pkt := range pkts {
+		batch[i] = pkt.Packet
+	}
+
+	writeRes := C.vs_write_packets(input.vsInput, input.output, batchC,
+		C.int(len(pkts)), C.bool(verbose))
+	if input.fragmenter.err != nil {
+		return input.fragmenter.err
+	}
+	if int(writeRes) != len(pkts) {
+		return fmt.Errorf("failure writing packet")
+	}
+	return nil
 }
 
-// Receive packets from the encoder, and write them out to the client's pipe.
-//
-// We end when encoder closes the channel, or if we encounter a write error.
-func packetWriter(client *Client, input *Input, verbose bool) {
-	for pkt := range client.PacketChan {
-		writeRes := C.int(0)
-		client.mutex.RLock()
-		input.mutex.RLock()
-		writeRes = C.vs_write_packet(input.vsInput, client.Output, pkt,
-			C.bool(verbose))
-		input.mutex.RUnlock()
-		if writeRes == -1 {
-			log.Printf("Failure writing packet")
-			C.av_packet_free(&pkt)
-			client.mutex.RUnlock()
-			return
-		}
-		client.mutex.RUnlock()
-		C.av_packet_free(&pkt)
+// fragmentMode returns how the input's output fragments, and for
+// VS_FRAGMENT_DURATION, the duration.
+func (c InputConfig) fragmentMode() (C.enum_VSFragmentMode, time.Duration) {
+	switch c.Fragment {
+	case "frame":
+		return C.VS_FRAGMENT_FRAME, 0
+	case "duration":
+		return C.VS_FRAGMENT_DURATION, time.Duration(*c.FragmentDuration)
+	default:
+		return C.VS_FRAGMENT_GOP, 0
 	}
 }
 
-// Open the output file. This creates an MP4 container and writes the header to
-// the given output URL.
-func openOutput(outputFormat, outputURL string, verbose bool,
-	input *Input) *C.struct_VSOutput {
+// Open an output for the input's video (or a rendition's). This creates an MP4
+// container and writes the header. The muxer passes what it writes to the
+// fragmenter. We also return the ID the muxer's callback receives. Pass both to
+// closeOutput() when done.
+func openOutput(config InputConfig, verbose bool, avioBufferSize int,
+	vsInput *C.struct_VSInput,
+	fragmenter *Fragmenter) (*C.struct_VSOutput, *C.uintptr_t) {
+	outputs.mutex.Lock()
+	id := outputs.nextID
+	outputs.nextID++
+	outputs.fragmenter[id] = fragmenter
+	outputs.mutex.Unlock()
+
+	outputID := (*C.uintptr_t)(C.malloc(C.sizeof_uintptr_t))
+	*outputID = C.uintptr_t(id)
+
 	outputFormatC := C.CString("mp4")
-	outputURLC := C.CString(outputURL)
 
-	input.mutex.RLock()
-	output := C.vs_open_output(outputFormatC, outputURLC, input.vsInput,
-		C.bool(verbose))
-	input.mutex.RUnlock()
+	fragmentMode, fragmentDuration := config.fragmentMode()
+
+	output := C.vs_open_output_callback(outputFormatC, vsInput,
+		C.vs_write_cb(C.goWriteOutput), unsafe.Pointer(outputID),
+		C.int(avioBufferSize), fragmentMode,
+		C.int64_t(fragmentDuration/time.Microsecond), C.bool(verbose))
+	C.free(unsafe.Pointer(outputFormatC))
 	if output == nil {
 		log.Printf("Unable to open output")
-		C.free(unsafe.Pointer(outputFormatC))
-		C.free(unsafe.Pointer(outputURLC))
-		return nil
+		return nil, outputID
+	}
+
+	if fragmenter.err != nil {
+		log.Printf("Unable to split output header: %s", fragmenter.err)
+		C.vs_destroy_output(output)
+		return nil, outputID
+	}
+
+	return output, outputID
+}
+
+// Close an output from openOutput(). Either may be nil.
+func closeOutput(output *C.struct_VSOutput, outputID *C.uintptr_t) {
+	if output != nil {
+		C.vs_destroy_output(output)
 	}
-	C.free(unsafe.Pointer(outputFormatC))
-	C.free(unsafe.Pointer(outputURLC))
 
-	return output
+	if outputID != nil {
+		outputs.mutex.Lock()
+		delete(outputs.fragmenter, uintptr(*outputID))
+		outputs.mutex.Unlock()
+		C.free(unsafe.Pointer(outputID))
+	}
+}
+
+// goWriteOutput receives what a muxer writes. The bytes are only valid during
+// the call.
+//
+//export goWriteOutput
+func goWriteOutput(opaque unsafe.Pointer, buf *C.uint8_t, bufSize C.int) C.int {
+	outputs.mutex.RLock()
+	fragmenter := outputs.fragmenter[uintptr(*(*C.uintptr_t)(opaque))]
+	outputs.mutex.RUnlock()
+	if fragmenter == nil {
+		return -C.EIO
+	}
+
+	if fragmenter.err != nil {
+		return -C.EIO
+	}
+
+	data := (*[1 << 30]byte)(unsafe.Pointer(buf))[:bufSize:bufSize]
+	if err := fragmenter.Write(data); err != nil {
+		fragmenter.err = err
+		return -C.EIO
+	}
+
+	return bufSize
 }
 
 // ServeHTTP handles an HTTP request.
@@ -416,8 +1251,51 @@ func (h HTTPHandler) ServeHTTP(rw http.ResponseWriter, r *http.Request) {
 	log.Printf("Serving [%s] request from [%s] to path [%s] (%d bytes)",
 		r.Method, r.RemoteAddr, r.URL.Path, r.ContentLength)
 
+	if r.Method == "GET" && r.URL.Path == "/metrics" {
+		rw.Header().Set("Content-Type", "text/plain; version=0.0.4")
+		if _, err := metrics.WriteTo(rw); err != nil {
+			log.Printf("%s: Write error: %s", r.RemoteAddr, err)
+		}
+		return
+	}
+
+	if r.Method == "GET" && strings.HasPrefix(r.URL.Path, "/trace/") {
+		h.traceRequest(rw, r, strings.TrimPrefix(r.URL.Path, "/trace/"))
+		return
+	}
+
+	if r.Method == "GET" && strings.HasPrefix(r.URL.Path, "/snapshot/") {
+		h.snapshotRequest(rw, r, strings.TrimPrefix(r.URL.Path, "/snapshot/"))
+		return
+	}
+
 	if r.Method == "GET" && r.URL.Path == "/stream" {
-		h.streamRequest(rw, r)
+		h.streamRequest(rw, r, h.Streams.DefaultName(), false)
+		return
+	}
+
+	if r.Method == "GET" && strings.HasPrefix(r.URL.Path, "/stream/") {
+		h.streamRequest(rw, r, strings.TrimPrefix(r.URL.Path, "/stream/"), false)
+		return
+	}
+
+	if r.Method == "GET" && r.URL.Path == "/ws" {
+		h.streamRequest(rw, r, h.Streams.DefaultName(), true)
+		return
+	}
+
+	if r.Method == "GET" && strings.HasPrefix(r.URL.Path, "/ws/") {
+		h.streamRequest(rw, r, strings.TrimPrefix(r.URL.Path, "/ws/"), true)
+		return
+	}
+
+	if r.Method == "GET" && strings.HasPrefix(r.URL.Path, "/hls/") {
+		h.Segments.Serve(rw, r, false, strings.TrimPrefix(r.URL.Path, "/hls/"))
+		return
+	}
+
+	if r.Method == "GET" && strings.HasPrefix(r.URL.Path, "/dash/") {
+		h.Segments.Serve(rw, r, true, strings.TrimPrefix(r.URL.Path, "/dash/"))
 		return
 	}
 
@@ -426,71 +1304,349 @@ func (h HTTPHandler) ServeHTTP(rw http.ResponseWriter, r *http.Request) {
 	_, _ = rw.Write([]byte("<h1>404 Not found</h1>"))
 }
 
-// Read from a pipe where streaming media shows up. We read a chunk and write it
-// immediately to the client, and repeat forever (until either the client goes
-// away, or an error of some kind occurs).
-func (h HTTPHandler) streamRequest(rw http.ResponseWriter, r *http.Request) {
-	// The encoder writes to the out pipe (using the packetWriter goroutine). We
-	// read from the in pipe.
-	inPipe, outPipe, err := os.Pipe()
+// Send the init segment and then fragments from the input's ring as they
+// arrive, forever (until either the client goes away, or an error of some
+// kind occurs).
+//
+// If websocket is true, the client asked for a WebSocket. We send the init
+// segment and each fragment as a binary message each rather than as one
+// continuous response.
+func (h HTTPHandler) streamRequest(rw http.ResponseWriter, r *http.Request,
+	name string, websocket bool) {
+	// A negative offset asks to start that far behind live, from the DVR.
+	offset := time.Duration(0)
+	if r.URL.Query().Get("offset") != "" {
+		var err error
+		offset, err = time.ParseDuration(r.URL.Query().Get("offset"))
+		if err != nil || offset > 0 {
+			log.Printf("%s: Invalid offset: %s", r.RemoteAddr,
+				r.URL.Query().Get("offset"))
+			rw.WriteHeader(http.StatusBadRequest)
+			_, _ = rw.Write([]byte("<h1>400 Bad request</h1>"))
+			return
+		}
+	}
+
+	config, ok := h.Streams.Config(name)
+	if !ok {
+		log.Printf("%s: Unknown input: %s", r.RemoteAddr, name)
+		rw.WriteHeader(http.StatusNotFound)
+		_, _ = rw.Write([]byte("<h1>404 Not found</h1>"))
+		return
+	}
+
+	// q asks for one of the input's renditions rather than its own video.
+	rendition := r.URL.Query().Get("q")
+	if rendition != "" && !config.hasRendition(rendition) {
+		log.Printf("%s: Unknown rendition: %s", r.RemoteAddr, rendition)
+		rw.WriteHeader(http.StatusNotFound)
+		_, _ = rw.Write([]byte("<h1>404 Not found</h1>"))
+		return
+	}
+
+	m := metricsFor(name)
+	if rendition != "" {
+		m = metricsFor(renditionName(name, rendition))
+	}
+
+	// Before we cost the pipeline anything, make sure we have room.
+	if err := h.Admission.Admit(config); err != nil {
+		log.Printf("%s: Turning client away: %s", r.RemoteAddr, err)
+		m.ClientsRejected.Inc()
+		h.Admission.Reject(rw, r, websocket)
+		return
+	}
+	defer h.Admission.Leave(name)
+
+	c := &Client{
+		RingChan:  make(chan *FragmentRing, 1),
+		Rendition: rendition,
+		Done:      make(chan struct{}),
+	}
+
+	// Tell the input's encoder we're here.
+	if !h.Streams.Join(name, c) {
+		log.Printf("%s: Unknown input: %s", r.RemoteAddr, name)
+		rw.WriteHeader(http.StatusNotFound)
+		_, _ = rw.Write([]byte("<h1>404 Not found</h1>"))
+		return
+	}
+
+	defer close(c.Done)
+
+	m.Clients.Add(1)
+	defer m.Clients.Add(-1)
+
+	// If the input is failing to open, we wait while the encoder retries, for
+	// as long as the client does.
+	var ring *FragmentRing
+	select {
+	case ring, ok = <-c.RingChan:
+	case <-r.Context().Done():
+		log.Printf("%s: Client went away waiting for the input", r.RemoteAddr)
+		return
+	}
+	if !ok {
+		log.Printf("%s: No output available", r.RemoteAddr)
+		rw.WriteHeader(http.StatusInternalServerError)
+		_, _ = rw.Write([]byte("<h1>500 Internal server error</h1>"))
+		return
+	}
+
+	initSegment, err := ring.InitSegment()
 	if err != nil {
-		log.Printf("Unable to open pipe: %s", err)
+		log.Printf("%s: Unable to get init segment: %s", r.RemoteAddr, err)
 		rw.WriteHeader(http.StatusInternalServerError)
 		_, _ = rw.Write([]byte("<h1>500 Internal server error</h1>"))
 		return
 	}
 
-	c := &Client{
-		mutex:   &sync.RWMutex{},
-		OutPipe: outPipe,
+	if !websocket {
+		rw.Header().Set("Content-Type", "video/mp4")
+		rw.Header().Set("Cache-Control", "no-cache, no-store, must-revalidate")
+
+		// A relay reading this stream checks the epoch to tell whether it can
+		// carry on from where it was when it reconnects. See Relay.
+		rw.Header().Set(relayEpochHeader, ring.Epoch())
+
+		// We send chunked by default
 	}
 
-	// Tell the encoder we're here.
-	h.ClientChan <- c
+	// write writes the data to the client in order.
+	write := func(data ...[]byte) error { return writeToClient(rw, data...) }
 
-	rw.Header().Set("Content-Type", "video/mp4")
-	rw.Header().Set("Cache-Control", "no-cache, no-store, must-revalidate")
+	// Closed once the client goes away.
+	gone := r.Context().Done()
 
-	// We send chunked by default
+	if websocket {
+		ws, err := upgradeWebSocket(rw, r)
+		if err != nil {
+			log.Printf("%s: Unable to upgrade to WebSocket: %s", r.RemoteAddr, err)
+			return
+		}
+		defer ws.Close()
+		write = ws.WriteMessages
+
+		// Once we take over the connection, the request's context no longer
+		// tells us when the client goes away.
+		gone = ws.Done()
+	} else if h.WriteCoalesce > 0 {
+		stream, err := startRawStream(rw, r)
+		if err != nil {
+			log.Printf("%s: Unable to start stream: %s", r.RemoteAddr, err)
+			return
+		}
+		if stream != nil {
+			defer stream.Close()
+			write = stream.Write
 
-	for {
-		buf := make([]byte, 1024)
-		readSize, err := inPipe.Read(buf)
+			// As with a WebSocket, the request's context no longer tells us.
+			gone = stream.Done()
+		}
+	}
+
+	// Count what we send, for the egress limit.
+	send := write
+	write = func(data ...[]byte) error {
+		if err := send(data...); err != nil {
+			return err
+		}
+		n := 0
+		for _, d := range data {
+			n += len(d)
+		}
+		m.BytesSent.Add(uint64(n))
+		h.Admission.Sent(n)
+		return nil
+	}
+
+	if err := write(initSegment); err != nil {
+		log.Printf("%s: Write error: %s", r.RemoteAddr, err)
+		return
+	}
+
+	var reader *RingReader
+	if offset < 0 {
+		seq, ok, err := sendFromDVR(write, ring, offset)
 		if err != nil {
-			log.Printf("%s: Read error: %s", r.RemoteAddr, err)
-			break
+			log.Printf("%s: Unable to send from DVR: %s", r.RemoteAddr, err)
+			return
 		}
+		if ok {
+			reader = ring.NewReaderAt(seq, uint64(h.MaxLag), h.MaxSkips)
+		} else {
+			log.Printf("%s: No DVR to start behind live from", r.RemoteAddr)
+		}
+	}
+
+	// Start with the most recent GOP, if we have it.
+	if reader == nil {
+		reader = ring.NewReader(uint64(h.MaxLag), h.MaxSkips)
+	}
 
-		// We get EOF if write side of pipe closed.
-		if readSize == 0 {
-			log.Printf("%s: EOF", r.RemoteAddr)
+	// We notice a client went away when writing to it fails, but we only write
+	// when a fragment arrives. While the input is down none do, so we watch for
+	// the client going away too. Otherwise we'd keep counting it, and keep the
+	// encoder reopening the input for it.
+	stopWatching := make(chan struct{})
+	defer close(stopWatching)
+	go func() {
+		select {
+		case <-gone:
+			reader.Cancel()
+		case <-stopWatching:
+		}
+	}()
+
+	var frags []*Fragment
+	var batch [][]byte
+
+	for {
+		skips := reader.Skips()
+		frags, err = reader.Read(frags[:0])
+		if err != nil {
+			if err == errClientTooSlow {
+				log.Printf("%s: Client too slow", r.RemoteAddr)
+				m.ClientsDropped.Inc()
+			} else if err == errReaderCancelled {
+				log.Printf("%s: Client went away", r.RemoteAddr)
+			} else {
+				log.Printf("%s: EOF", r.RemoteAddr)
+			}
 			break
 		}
 
-		writeSize, err := rw.Write(buf[:readSize])
+		if reader.Skips() > skips {
+			log.Printf("%s: Client behind, skipped ahead to keyframe (%d/%d)",
+				r.RemoteAddr, reader.Skips(), h.MaxSkips)
+			m.ClientSkips.Inc()
+		}
+		m.ClientQueue.Observe(int64(len(frags)))
+
+		batch, err = writeFragments(write, frags, batch, h.WriteCoalesce)
+		if err == nil {
+			for _, frag := range frags {
+				if frag.Trace != nil {
+					traceWrite(m, frag.Trace)
+				}
+			}
+		}
+		releaseFragments(frags)
 		if err != nil {
 			log.Printf("%s: Write error: %s", r.RemoteAddr, err)
-			break
+			log.Printf("%s: Client cleaned up", r.RemoteAddr)
+			return
 		}
 
-		if writeSize != readSize {
-			log.Printf("%s: Short write", r.RemoteAddr)
-			break
+		if h.Verbose {
+			log.Printf("%s: Sent %d fragments to client", r.RemoteAddr, len(frags))
 		}
+	}
 
-		// ResponseWriter buffers chunks. Flush them out ASAP to reduce the time a
-		// client is waiting, especially initially.
-		if flusher, ok := rw.(http.Flusher); ok {
-			flusher.Flush()
+	log.Printf("%s: Client cleaned up", r.RemoteAddr)
+}
+
+// Write the fragments in as few writes as we can, gathering up to coalesce
+// bytes into each. batch is space for the gathered data. We return it to reuse
+// next time.
+func writeFragments(write func(...[]byte) error, frags []*Fragment,
+	batch [][]byte, coalesce int) ([][]byte, error) {
+	batch = batch[:0]
+	batchSize := 0
+	for i, frag := range frags {
+		batch = append(batch, frag.Data)
+		batchSize += len(frag.Data)
+		if i+1 < len(frags) && batchSize+len(frags[i+1].Data) <= coalesce {
+			continue
 		}
 
-		if h.Verbose {
-			//log.Printf("%s: Sent %d bytes to client", r.RemoteAddr, n)
+		err := write(batch...)
+		for j := range batch {
+			batch[j] = nil
+		}
+		if err != nil {
+			return batch[:0], err
 		}
+		batch = batch[:0]
+		batchSize = 0
 	}
+	return batch, nil
+}
 
-	// Writes to write side will raise error when read side is closed.
-	_ = inPipe.Close()
+// Note that we wrote a fragment to a client.
+func traceWrite(m *InputMetrics, trace *FragmentTrace) {
+	now := time.Now()
+	m.DeliverTime.Observe(int64(now.Sub(trace.Fragmented)))
+	if !trace.Read.IsZero() {
+		m.Latency.Observe(int64(now.Sub(trace.Read)))
+	}
+	trace.wrote(now)
+}
 
-	log.Printf("%s: Client cleaned up", r.RemoteAddr)
+// Serve the input's most recent fragment traces.
+func (h HTTPHandler) traceRequest(rw http.ResponseWriter, r *http.Request,
+	name string) {
+	if _, ok := h.Streams.Config(name); !ok {
+		rw.WriteHeader(http.StatusNotFound)
+		_, _ = rw.Write([]byte("<h1>404 Not found</h1>"))
+		return
+	}
+
+	rw.Header().Set("Content-Type", "application/json")
+	rw.Header().Set("Cache-Control", "no-cache")
+	if _, err := metricsFor(name).Traces.WriteTo(rw); err != nil {
+		log.Printf("%s: Write error: %s", r.RemoteAddr, err)
+	}
+}
+
+// Send fragments from the ring's DVR starting offset behind live until we
+// catch up to it. We return the sequence number to continue from in the ring.
+//
+// ok is false if there is nothing to send from the DVR.
+func sendFromDVR(write func(...[]byte) error, ring *FragmentRing,
+	offset time.Duration) (uint64, bool, error) {
+	if ring.DVR() == nil {
+		return 0, false, nil
+	}
+
+	reader, ok := ring.DVR().NewReader(offset)
+	if !ok {
+		return 0, false, nil
+	}
+
+	for {
+		data, err := reader.Read()
+		if err == errDVRCaughtUp {
+			return reader.Seq(), true, nil
+		}
+		if err != nil {
+			return 0, false, err
+		}
+
+		if err := write(data); err != nil {
+			return 0, false, err
+		}
+	}
+}
+
+// Write the data to the client and flush it.
+func writeToClient(rw http.ResponseWriter, data ...[]byte) error {
+	for _, d := range data {
+		writeSize, err := rw.Write(d)
+		if err != nil {
+			return err
+		}
+
+		if writeSize != len(d) {
+			return fmt.Errorf("short write")
+		}
+	}
+
+	// ResponseWriter buffers chunks. Flush them out ASAP to reduce the time a
+	// client is waiting, especially initially.
+	if flusher, ok := rw.(http.Flusher); ok {
+		flusher.Flush()
+	}
+
+	return nil
 }
@@ -5,28 +5,188 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+// The most streams an input or output carries: video, and possibly audio.
+#define VS_MAX_STREAMS 2
+
 struct VSInput {
 	AVFormatContext * format_ctx;
 	int video_stream_index;
+
+	// The audio stream we read, or -1 if none.
+	int audio_stream_index;
+
+	// The time bases of the video stream (0) and the audio stream (1), copied
+	// when we open the input. Demuxers that find streams as they read (such as
+	// mpegts) add to format_ctx->streams while reading, which may move it, and
+	// we may read on another thread (see vs_reader_start()). What runs
+	// alongside reading, writing and decoding packets, uses these rather than
+	// the streams.
+	AVRational time_base[VS_MAX_STREAMS];
+
+	// The dts of the last packet we read from the video stream (0) and the
+	// audio stream (1), or AV_NOPTS_VALUE if none yet. We fix up timestamps as
+	// we read packets (see __vs_fix_timestamps()).
+	int64_t last_dts[VS_MAX_STREAMS];
+
+	// How many packets in a row we've fixed the dts of, per stream as for
+	// last_dts. We log a burst of fixes once rather than for each packet.
+	int dts_fixes[VS_MAX_STREAMS];
+
+	// How long (microseconds) a blocking operation on the input may take. 0
+	// means no limit. deadline is when the current one must end by (in
+	// av_gettime_relative() time), or 0 if none.
+	int64_t timeout;
+	int64_t deadline;
+
+	// Set by vs_cancel_input(), possibly from another thread. Access it
+	// atomically.
+	int cancelled;
+
+	// Set once vs_read_packets() has seen a read fail.
+	bool read_failed;
 };
 
-struct VSOutput {
-	AVFormatContext * format_ctx;
+// How an output splits into fragments.
+enum VSFragmentMode {
+	// A fragment per GOP. Each starts at a video keyframe.
+	VS_FRAGMENT_GOP,
 
+	// A fragment per video frame. Each reaches the output as soon as we write
+	// the frame. This has the least latency.
+	VS_FRAGMENT_FRAME,
+
+	// A fragment at each video keyframe, and whenever one reaches the output's
+	// fragment duration.
+	VS_FRAGMENT_DURATION,
+};
+
+// What we track for each stream we output.
+struct VSOutputStream {
   // Track the last dts we output. We use it to double check that dts is
   // monotonic.
   //
   // I am not sure if it is available anywhere already. I tried
   // AVStream->info->last_dts and that is apparently not set.
   int64_t last_dts;
+	int64_t last_duration;
+
+	// The shift we apply to every packet's timestamps. See rebase.
+	int64_t ts_offset;
+
+	// Converting a timestamp from the input stream's time base to ours is
+	// multiplying by rescale_mul and dividing by rescale_div. We work them out
+	// once for in_time_base, and again only if an input with another time base
+	// replaces it.
+	AVRational in_time_base;
+	int64_t rescale_mul;
+	int64_t rescale_div;
+};
+
+struct VSOutput {
+	AVFormatContext * format_ctx;
+
+	// Stream 0 is video. Stream 1, if present, is audio.
+	struct VSOutputStream streams[VS_MAX_STREAMS];
+	int nb_streams;
+
+	// How we fragment, and for VS_FRAGMENT_DURATION, the most a fragment may
+	// last (microseconds).
+	enum VSFragmentMode fragment_mode;
+	int64_t fragment_duration;
+
+	// When set, we shift the next packet's timestamps to follow on from the
+	// last packet we wrote on any stream, and apply the same shift to the
+	// packets after it.
+	bool rebase;
+
+	// Set when the muxer writes through a callback
+	// (vs_open_output_callback()) rather than to a URL. We own the AVIOContext
+	// then.
+	bool custom_io;
+
+	// We write packets through this so we don't change the caller's.
+	AVPacket * pkt;
+};
+
+// Reads packets from an input on its own thread. See vs_reader_start().
+struct VSReader;
+
+// Decodes an input's video. See vs_decoder_open().
+struct VSDecoder {
+	AVCodecContext * codec_ctx;
+
+	// Frames have timestamps in this time base. It is the input's video stream's
+	// when we opened the decoder. We rescale packets from later inputs to it.
+	AVRational time_base;
+
+	// We rescale packets in this rather than changing the caller's.
+	AVPacket * pkt;
+
+	// vs_decoder_receive() gives frames here.
+	AVFrame * frame;
+
+	// Set once we finish an input. We shift the next frame's timestamps to
+	// follow on from the last one we gave, and apply the same shift to the
+	// frames after it, as with VSOutput's rebase.
+	bool rebase;
+	int64_t ts_offset;
+	int64_t last_pts;
+	int64_t last_duration;
+};
+
+// Encodes a decoder's frames at some size and bitrate: one rendition of the
+// input. See vs_encoder_open().
+struct VSEncoder {
+	AVCodecContext * codec_ctx;
+
+	// We scale frames to the encoder's size and pixel format into scaled. With
+	// hardware encoding, we then upload them to hw_frame.
+	struct SwsContext * sws_ctx;
+	AVFrame * scaled;
+	AVFrame * hw_frame;
+
+	// The encoded video, as an input with one stream. Open the rendition's
+	// output with it and write the encoder's packets with it
+	// (vs_open_output_callback(), vs_write_packet()). Don't read from it.
+	struct VSInput * stream;
+};
+
+// How severe a log message is. Enabling a level enables those before it.
+enum VSLogLevel {
+	VS_LOG_ERROR,
+	VS_LOG_WARNING,
+	VS_LOG_INFO,
+
+	// What we log when a function's verbose argument is set.
+	VS_LOG_DEBUG,
+
+	// What we log for every packet when verbose is set.
+	VS_LOG_TRACE,
 };
 
+// Receives log messages. See vs_set_log_callback(). The message has no
+// trailing newline, and is only valid during the call.
+typedef void (*vs_log_cb)(void *, enum VSLogLevel, char *);
+
+// Receives what the muxer writes when using vs_open_output_callback(). This is
+// the same as the AVIOContext write_packet callback. It returns the number of
+// bytes written, or a negative AVERROR on failure.
+typedef int (*vs_write_cb)(void *, uint8_t *, int);
+
 void
 vs_setup(void);
 
+void
+vs_set_log_callback(const vs_log_cb, void * const, const enum VSLogLevel,
+		const int, const int);
+
 struct VSInput *
 vs_open_input(const char * const,
-		const char * const, const bool);
+		const char * const, const char * const, const char * const,
+		const char * const, const bool, const bool, const int64_t, const bool);
+
+void
+vs_cancel_input(struct VSInput * const);
 
 void
 vs_destroy_input(struct VSInput * const);
@@ -36,15 +196,79 @@ vs_open_output(const char * const,
 		const char * const, const struct VSInput * const,
 		const bool);
 
+struct VSOutput *
+vs_open_output_callback(const char * const,
+		const struct VSInput * const, const vs_write_cb, void * const,
+		const int, const enum VSFragmentMode, const int64_t, const bool);
+
 void
 vs_destroy_output(struct VSOutput * const);
 
+void
+vs_output_rebase(struct VSOutput * const);
+
+bool
+vs_output_compatible(const struct VSOutput * const,
+		const struct VSInput * const);
+
+
 int
-vs_read_packet(const struct VSInput *, AVPacket * const,
+vs_read_packet(struct VSInput * const, AVPacket * const,
 		const bool);
 
+int
+vs_read_packets(struct VSInput * const, AVPacket ** const, const int,
+		const int64_t, const bool);
+
+struct VSReader *
+vs_reader_start(struct VSInput * const, const int, const bool);
+
+void
+vs_reader_stop(struct VSReader * const);
+
+int
+vs_reader_read(struct VSReader * const, AVPacket ** const, const int,
+		const int64_t);
+
 int
 vs_write_packet(const struct VSInput * const,
-		struct VSOutput * const, AVPacket * const, const bool);
+		struct VSOutput * const, const AVPacket * const, const bool);
+
+int
+vs_write_packets(const struct VSInput * const,
+		struct VSOutput * const, const AVPacket * const * const, const int,
+		const bool);
+
+struct VSDecoder *
+vs_decoder_open(const struct VSInput * const, const int, const bool);
+
+void
+vs_decoder_close(struct VSDecoder * const);
+
+int
+vs_decoder_send(struct VSDecoder * const, const struct VSInput * const,
+		const AVPacket * const, const bool);
+
+int
+vs_decoder_receive(struct VSDecoder * const, const bool);
+
+struct VSEncoder *
+vs_encoder_open(const struct VSDecoder * const, const char * const,
+		const char * const, const char * const, const int, const int,
+		const int64_t, const int, const bool);
+
+void
+vs_encoder_close(struct VSEncoder * const);
+
+int
+vs_encoder_send(struct VSEncoder * const, const AVFrame * const,
+		const bool);
+
+int
+vs_encoder_receive(struct VSEncoder * const, AVPacket * const, const bool);
+
+AVPacket *
+vs_snapshot(const AVCodecParameters * const, const AVPacket * const,
+		const int, const bool);
 
 #endif
@@ -0,0 +1,308 @@
+package main
+
+import (
+	"bufio"
+	"crypto/sha1"
+	"encoding/base64"
+	"encoding/binary"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"net"
+	"net/http"
+	"strings"
+	"sync"
+	"time"
+)
+
+// WebSocket is the server side of a WebSocket connection (RFC 6455). We only
+// send binary messages. We read what the client sends only to answer pings
+// and to notice when it closes.
+//
+// We send each fragment as one message, so a player knows where fragments
+// start and end, and can append each to a MediaSource as it arrives.
+type WebSocket struct {
+	conn net.Conn
+	rw   *bufio.ReadWriter
+
+	// Messages, pongs, and the close frame may come from two goroutines.
+	// headers and bufs are reused for each write, under the mutex. Writing
+	// consumes pending, so we keep the slice in bufs too.
+	writeMutex *sync.Mutex
+	headers    []byte
+	bufs       net.Buffers
+	pending    net.Buffers
+
+	// Closed once the client closes the connection or reading from it fails.
+	done chan struct{}
+
+	closeOnce *sync.Once
+}
+
+// The GUID the handshake combines with the client's key (RFC 6455 section
+// 1.3).
+const webSocketGUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+// Opcodes.
+const (
+	webSocketBinary = 0x2
+	webSocketClose  = 0x8
+	webSocketPing   = 0x9
+	webSocketPong   = 0xa
+)
+
+// The largest control frame payload (RFC 6455 section 5.5), and the largest
+// message we read from a client. Clients have nothing to send us but control
+// frames.
+const webSocketMaxControl = 125
+const webSocketMaxRead = 4096
+
+// isWebSocketRequest returns whether the request asks to upgrade to a
+// WebSocket.
+func isWebSocketRequest(r *http.Request) bool {
+	return headerHasToken(r.Header, "Connection", "upgrade") &&
+		headerHasToken(r.Header, "Upgrade", "websocket")
+}
+
+// upgradeWebSocket completes the handshake and takes over the connection. If
+// it fails before taking over the connection, it responds with an error.
+func upgradeWebSocket(rw http.ResponseWriter,
+	r *http.Request) (*WebSocket, error) {
+	key := r.Header.Get("Sec-WebSocket-Key")
+	if r.Method != "GET" || !isWebSocketRequest(r) || key == "" {
+		badRequest(rw)
+		return nil, fmt.Errorf("not a WebSocket handshake")
+	}
+
+	if r.Header.Get("Sec-WebSocket-Version") != "13" {
+		rw.Header().Set("Sec-WebSocket-Version", "13")
+		badRequest(rw)
+		return nil, fmt.Errorf("unsupported WebSocket version: %s",
+			r.Header.Get("Sec-WebSocket-Version"))
+	}
+
+	hijacker, ok := rw.(http.Hijacker)
+	if !ok {
+		rw.WriteHeader(http.StatusNotImplemented)
+		_, _ = rw.Write([]byte("<h1>501 Not implemented</h1>"))
+		return nil, fmt.Errorf("connection does not support WebSockets")
+	}
+
+	conn, bufrw, err := hijacker.Hijack()
+	if err != nil {
+		return nil, fmt.Errorf("unable to take over connection: %s", err)
+	}
+
+	sum := sha1.Sum([]byte(key + webSocketGUID))
+	accept := base64.StdEncoding.EncodeToString(sum[:])
+
+	ws := &WebSocket{
+		conn:       conn,
+		rw:         bufrw,
+		writeMutex: &sync.Mutex{},
+		done:       make(chan struct{}),
+		closeOnce:  &sync.Once{},
+	}
+
+	ws.writeMutex.Lock()
+	_ = conn.SetWriteDeadline(time.Now().Add(clientWriteTimeout))
+	_, err = bufrw.WriteString("HTTP/1.1 101 Switching Protocols\r\n" +
+		"Upgrade: websocket\r\n" +
+		"Connection: Upgrade\r\n" +
+		"Sec-WebSocket-Accept: " + accept + "\r\n\r\n")
+	if err == nil {
+		err = bufrw.Flush()
+	}
+	ws.writeMutex.Unlock()
+	if err != nil {
+		_ = conn.Close()
+		return nil, fmt.Errorf("unable to complete handshake: %s", err)
+	}
+
+	go ws.readLoop()
+
+	return ws, nil
+}
+
+// WriteMessages sends each data as one binary message. We write them all with
+// one writev where the kernel takes it all at once.
+func (ws *WebSocket) WriteMessages(data ...[]byte) error {
+	return ws.writeFrames(webSocketBinary, data...)
+}
+
+// Done returns a channel closed once the client is gone.
+func (ws *WebSocket) Done() <-chan struct{} {
+	return ws.done
+}
+
+// Close sends a close frame, if the client hasn't closed already, and closes
+// the connection.
+func (ws *WebSocket) Close() {
+	select {
+	case <-ws.done:
+	default:
+		// 1000 is a normal closure.
+		_ = ws.writeFrames(webSocketClose, []byte{0x03, 0xe8})
+	}
+	ws.closeConn()
+}
+
+func (ws *WebSocket) closeConn() {
+	ws.closeOnce.Do(func() {
+		_ = ws.conn.Close()
+	})
+}
+
+// Write a frame holding each whole payload. Frames from a server are not
+// masked.
+func (ws *WebSocket) writeFrames(opcode byte, payloads ...[]byte) error {
+	ws.writeMutex.Lock()
+	defer ws.writeMutex.Unlock()
+
+	// Make all the headers first. Appending may move the headers, so we slice
+	// them only once they are all there.
+	ws.headers = ws.headers[:0]
+	for _, payload := range payloads {
+		ws.headers = append(ws.headers, 0x80|opcode)
+		switch {
+		case len(payload) < 126:
+			ws.headers = append(ws.headers, byte(len(payload)))
+		case len(payload) <= 0xffff:
+			ws.headers = append(ws.headers, 126, 0, 0)
+			binary.BigEndian.PutUint16(ws.headers[len(ws.headers)-2:],
+				uint16(len(payload)))
+		default:
+			ws.headers = append(ws.headers, 127, 0, 0, 0, 0, 0, 0, 0, 0)
+			binary.BigEndian.PutUint64(ws.headers[len(ws.headers)-8:],
+				uint64(len(payload)))
+		}
+	}
+
+	ws.bufs = ws.bufs[:0]
+	headers := ws.headers
+	for _, payload := range payloads {
+		n := 2
+		if headers[1] == 126 {
+			n = 4
+		} else if headers[1] == 127 {
+			n = 10
+		}
+		ws.bufs = append(ws.bufs, headers[:n], payload)
+		headers = headers[n:]
+	}
+	ws.pending = ws.bufs
+
+	_ = ws.conn.SetWriteDeadline(time.Now().Add(clientWriteTimeout))
+	_, err := ws.pending.WriteTo(ws.conn)
+
+	// Don't keep fragments the ring may reuse.
+	for i := range ws.bufs {
+		ws.bufs[i] = nil
+	}
+	return err
+}
+
+// Read frames from the client until it closes the connection or reading
+// fails. We answer pings and discard anything else.
+func (ws *WebSocket) readLoop() {
+	defer close(ws.done)
+
+	for {
+		opcode, payload, err := ws.readFrame()
+		if err != nil {
+			ws.closeConn()
+			return
+		}
+
+		switch opcode {
+		case webSocketPing:
+			if err := ws.writeFrames(webSocketPong, payload); err != nil {
+				ws.closeConn()
+				return
+			}
+		case webSocketClose:
+			// Echo the status code, if any, and we're done.
+			if len(payload) > 2 {
+				payload = payload[:2]
+			}
+			_ = ws.writeFrames(webSocketClose, payload)
+			ws.closeConn()
+			return
+		default:
+		}
+	}
+}
+
+// Read one frame from the client. We read at most webSocketMaxRead of any
+// payload, and discard the rest.
+func (ws *WebSocket) readFrame() (byte, []byte, error) {
+	var header [2]byte
+	if _, err := io.ReadFull(ws.rw, header[:]); err != nil {
+		return 0, nil, err
+	}
+
+	opcode := header[0] & 0x0f
+	masked := header[1]&0x80 != 0
+	length := uint64(header[1] & 0x7f)
+
+	// Clients must mask what they send (RFC 6455 section 5.1).
+	if !masked {
+		return 0, nil, fmt.Errorf("unmasked frame from client")
+	}
+
+	if opcode >= webSocketClose && length > webSocketMaxControl {
+		return 0, nil, fmt.Errorf("control frame too large")
+	}
+
+	switch length {
+	case 126:
+		var ext [2]byte
+		if _, err := io.ReadFull(ws.rw, ext[:]); err != nil {
+			return 0, nil, err
+		}
+		length = uint64(binary.BigEndian.Uint16(ext[:]))
+	case 127:
+		var ext [8]byte
+		if _, err := io.ReadFull(ws.rw, ext[:]); err != nil {
+			return 0, nil, err
+		}
+		length = binary.BigEndian.Uint64(ext[:])
+	}
+
+	var mask [4]byte
+	if _, err := io.ReadFull(ws.rw, mask[:]); err != nil {
+		return 0, nil, err
+	}
+
+	keep := length
+	if keep > webSocketMaxRead {
+		keep = webSocketMaxRead
+	}
+
+	payload := make([]byte, keep)
+	if _, err := io.ReadFull(ws.rw, payload); err != nil {
+		return 0, nil, err
+	}
+	if _, err := io.CopyN(ioutil.Discard, ws.rw, int64(length-keep)); err != nil {
+		return 0, nil, err
+	}
+
+	for i := range payload {
+		payload[i] ^= mask[i%4]
+	}
+
+	return opcode, payload, nil
+}
+
+// headerHasToken returns whether the comma separated header holds the token,
+// ignoring case.
+func headerHasToken(header http.Header, name, token string) bool {
+	for _, value := range header[http.CanonicalHeaderKey(name)] {
+		for _, t := range strings.Split(value, ",") {
+			if strings.EqualFold(strings.TrimSpace(t), token) {
+				return true
+			}
+		}
+	}
+	return false
+}